@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "admission.h"
+#include "custom_TCP.h"
+#include "event_loop.h"
+#include "stats.h"
+
+// helper, forget the deadlines left in the wheel (none is pending any more)
+static void clear_wheel(struct admission *admission) {
+	int i;
+
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		admission->wheel[i].clear();
+}
+
+/**
+	@brief Function that creates the admission stage of the broker, for the
+		   connections accepted by shard 0.
+
+	@param epoll_fd Event loop of shard 0.
+	@param timeout_ms Time a new connection has to send its first frame.
+	@param stats Statistics of shard 0.
+
+	@return struct admission* The admission stage.
+**/
+struct admission *create_admission(int epoll_fd, u_int32_t timeout_ms, struct broker_stats *stats) {
+	struct admission *admission = new struct admission();
+
+	admission->epoll_fd = epoll_fd;
+	admission->timeout_us = (u_int64_t) timeout_ms * 1000;
+	admission->timer_fd = create_timer();
+	watch_fd(epoll_fd, admission->timer_fd, EPOLLIN);
+	admission->next_tick = 0;
+	admission->nr_pending = 0;
+	admission->serial = 0;
+	admission->stats = stats;
+
+	return admission;
+}
+
+/**
+	@brief Function that closes the connections still waiting for their
+		   first frame, when the broker stops.
+
+	@param admission The admission stage.
+**/
+void close_admission(struct admission *admission) {
+	size_t i;
+
+	for (i = 0; i < admission->by_fd.size(); i++) {
+		if (admission->by_fd[i] != NULL)
+			drop_handshake(admission, admission->by_fd[i]);
+	}
+	close(admission->timer_fd);
+	delete admission;
+}
+
+/**
+	@brief Function that registers a connection that was just accepted. Its
+		   socket is watched until its first frame is complete or its
+		   deadline passes.
+
+	@param admission The admission stage.
+	@param socket The (non-blocking) socket of the connection.
+	@param addr Address of the client.
+**/
+void add_handshake(struct admission *admission, int socket, struct sockaddr_in *addr) {
+	struct handshake *handshake = new struct handshake;
+	u_int64_t now = monotonic_us(), tick;
+
+	handshake->socket = socket;
+	handshake->serial = ++admission->serial;
+	handshake->deadline = now + admission->timeout_us;
+	handshake->addr = *addr;
+	init_reader(&handshake->reader);
+	if ((size_t) socket >= admission->by_fd.size())
+		admission->by_fd.resize(socket + 1, NULL);
+	admission->by_fd[socket] = handshake;
+
+	// the timer is stopped while nothing is pending, the wheel starts again from now
+	tick = (handshake->deadline + WHEEL_TICK_US - 1) / WHEEL_TICK_US;
+	if (admission->nr_pending == 0) {
+		clear_wheel(admission);
+		admission->next_tick = now / WHEEL_TICK_US;
+		arm_timer(admission->timer_fd, tick * WHEEL_TICK_US);
+	}
+	admission->wheel[tick % WHEEL_SLOTS].push_back({socket, handshake->serial});
+	admission->nr_pending++;
+	set_stat(admission->stats, STAT_HANDSHAKES, admission->nr_pending);
+
+	watch_fd(admission->epoll_fd, socket, EPOLLIN);
+}
+
+/**
+	@brief Function that finds the pending handshake of a socket.
+
+	@param admission The admission stage.
+	@param socket The socket.
+
+	@return struct handshake* The handshake, NULL if the socket is not
+							  waiting for its first frame.
+**/
+struct handshake *find_handshake(struct admission *admission, int socket) {
+	if (socket < 0 || (size_t) socket >= admission->by_fd.size())
+		return NULL;
+	return admission->by_fd[socket];
+}
+
+/**
+	@brief Function that reads what a pending connection sent, without
+		   blocking, and decodes its first frame if it is complete.
+
+	@param handshake The handshake.
+	@param msg Where the first frame is stored.
+
+	@return int FRAME_READY if the frame was decoded, FRAME_INCOMPLETE if
+				more bytes are needed, FRAME_INVALID if the connection was
+				closed or the frame is not valid.
+**/
+int read_handshake(struct handshake *handshake, struct TCP_msg *msg) {
+	if (fill_reader(handshake->socket, &handshake->reader) == READ_CLOSED)
+		return FRAME_INVALID;
+
+	return next_frame(&handshake->reader, msg);
+}
+
+/**
+	@brief Function that removes a handshake whose connection is admitted.
+		   The socket and the receive buffer (with the bytes that followed
+		   the first frame) now belong to the caller.
+
+	@param admission The admission stage.
+	@param handshake The handshake (freed).
+**/
+void remove_handshake(struct admission *admission, struct handshake *handshake) {
+	// its entry in the wheel is skipped, the serial no longer matches
+	unwatch_fd(admission->epoll_fd, handshake->socket);
+	admission->by_fd[handshake->socket] = NULL;
+	admission->nr_pending--;
+	set_stat(admission->stats, STAT_HANDSHAKES, admission->nr_pending);
+	delete handshake;
+}
+
+/**
+	@brief Function that closes a pending connection.
+
+	@param admission The admission stage.
+	@param handshake The handshake (freed).
+**/
+void drop_handshake(struct admission *admission, struct handshake *handshake) {
+	int socket = handshake->socket;
+
+	free_reader(&handshake->reader);
+	remove_handshake(admission, handshake);
+	close(socket);
+}
+
+/**
+	@brief Function that closes the connections whose deadline passed
+		   (called when the timer of the wheel expires), then sets the timer
+		   to the next tick if handshakes are still pending.
+
+	@param admission The admission stage.
+**/
+void expire_handshakes(struct admission *admission) {
+	u_int64_t expirations, now = monotonic_us(), now_tick = now / WHEEL_TICK_US, tick;
+	vector <struct wheel_entry> entries;
+	struct handshake *handshake;
+	size_t i;
+
+	// reset the readiness of the timer
+	while (read(admission->timer_fd, &expirations, sizeof(expirations)) > 0);
+
+	// every slot is visited at most once, entries of a later turn of the wheel stay in it
+	for (tick = admission->next_tick; tick <= now_tick && tick < admission->next_tick + WHEEL_SLOTS; tick++) {
+		entries.swap(admission->wheel[tick % WHEEL_SLOTS]);
+		for (i = 0; i < entries.size(); i++) {
+			handshake = find_handshake(admission, entries[i].socket);
+			if (handshake == NULL || handshake->serial != entries[i].serial)
+				continue;
+			if (handshake->deadline > now) {
+				admission->wheel[tick % WHEEL_SLOTS].push_back(entries[i]);
+				continue;
+			}
+			drop_handshake(admission, handshake);
+			count_stat(admission->stats, STAT_HANDSHAKE_TIMEOUTS, 1);
+		}
+		entries.clear();
+	}
+	admission->next_tick = now_tick + 1;
+
+	if (admission->nr_pending > 0)
+		arm_timer(admission->timer_fd, admission->next_tick * WHEEL_TICK_US);
+	else
+		clear_wheel(admission);
+}
@@ -0,0 +1,62 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <vector>
+#include "frame_reader.h"
+
+using namespace std;
+
+#define DEFAULT_LISTEN_BACKLOG 4096	// capped by the kernel (net.core.somaxconn)
+#define DEFAULT_HANDSHAKE_MS 5000	// time a new connection has to send its first frame
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK_US 100000		// deadlines are rounded up to a tick
+
+struct broker_stats;
+
+// connection accepted by the broker, whose first frame (ID, or hello of a peer) is not complete yet
+struct handshake {
+	int socket;
+	u_int32_t serial;	// tells the connection from a later one on the same socket number
+	u_int64_t deadline;	// monotonic time (us) after which the connection is closed
+	struct sockaddr_in addr;
+	struct frame_reader reader;
+};
+
+// deadline of a handshake, in the slot of its tick
+struct wheel_entry {
+	int socket;
+	u_int32_t serial;
+};
+
+/*
+ * Connections accepted by shard 0 that did not identify themselves yet. They
+ * are watched by the event loop like the sessions, and become a session (or
+ * the link of a peer broker) only once their first frame is complete, so a
+ * slow or silent client never stops the loop. Deadlines are kept in a timer
+ * wheel, a slot per tick: the timer only ticks while handshakes are pending,
+ * and an entry whose connection was admitted or closed is simply skipped.
+ */
+struct admission {
+	int epoll_fd;			// event loop of shard 0
+	int timer_fd;
+	u_int64_t timeout_us;
+	vector <struct handshake *> by_fd;	// pending handshakes, by socket
+	vector <struct wheel_entry> wheel[WHEEL_SLOTS];
+	u_int64_t next_tick;	// first tick whose slot was not expired yet
+	u_int32_t nr_pending;
+	u_int32_t serial;
+	struct broker_stats *stats;	// of shard 0
+};
+
+struct admission *create_admission(int epoll_fd, u_int32_t timeout_ms, struct broker_stats *stats);
+void close_admission(struct admission *admission);
+void add_handshake(struct admission *admission, int socket, struct sockaddr_in *addr);
+struct handshake *find_handshake(struct admission *admission, int socket);
+int read_handshake(struct handshake *handshake, struct TCP_msg *msg);
+void remove_handshake(struct admission *admission, struct handshake *handshake);
+void drop_handshake(struct admission *admission, struct handshake *handshake);
+void expire_handshakes(struct admission *admission);
+
+#endif
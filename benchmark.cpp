@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "custom_TCP.h"
+#include "event_loop.h"
+#include "broker_client.h"
+
+using namespace std;
+
+#define USAGE "Invalid arguments.\n \
+				./benchmark [--server <PATH>] [--port <PORT>] [--publishers <N>] [--subscribers <M>]\n \
+				[--topics <T>] [--fanout <F>] [--payload int|short_real|float|string] [--rate <MSGS/S>]\n \
+				[--duration <SECONDS>] [--shm] [--suite] [-- <SERVER OPTIONS>]\n"
+
+#define STRING_SIZE 200			// characters of a STRING payload
+#define TIMESTAMP_SIZE 8		// send time, appended to every payload
+#define DRAIN_MS 500			// time left to the broker after the publishers stop
+#define CONNECT_RETRIES 100		// every 20 ms, while the server starts
+
+/*
+ * One benchmark run: the shape of the load and the server it is sent to.
+ * Every topic is subscribed by exactly fanout subscribers, so every message
+ * sent is expected fanout times.
+ */
+struct bench_config {
+	const char *server;
+	int port;
+	int nr_publishers;
+	int nr_subscribers;
+	int nr_topics;
+	int fanout;
+	u_int8_t payload;
+	u_int32_t rate;			// messages per second, for all publishers (0 = unpaced)
+	double duration;		// seconds
+	u_int8_t transport;		// TRANSPORT_SHM to read the shared memory ring of the broker
+	vector <char *> server_options;
+};
+
+struct bench_result {
+	u_int64_t sent;
+	u_int64_t received;
+	double seconds;
+	u_int64_t p50, p99, p999;	// end-to-end latency (ns)
+	long rss_kb, peak_rss_kb;	// of the broker, at the end of the run
+};
+
+// samples of the receiving thread
+struct receiver {
+	vector <u_int64_t> latencies;
+};
+
+static const char *payload_names[] = {"int", "short_real", "float", "string"};
+
+// helper, monotonic time in nanoseconds (the same clock for every process on the host)
+static u_int64_t now_ns() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (u_int64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// helper, build the datagram of a publisher; returns its size (the timestamp goes in the last bytes)
+static int build_datagram(char *datagram, int topic, u_int8_t payload, u_int32_t counter) {
+	u_int32_t value32 = htonl(counter);
+	u_int16_t value16 = htons((u_int16_t) counter);
+	int size = TOPIC_SIZE;
+
+	memset(datagram, 0, TOPIC_SIZE);
+	snprintf(datagram, TOPIC_SIZE, "bench/%d", topic);
+	datagram[size++] = payload;
+	switch (payload) {
+		case TYPE_INT:
+			datagram[size++] = 0;
+			memcpy(datagram + size, &value32, sizeof(value32));
+			size += sizeof(value32);
+			break;
+		case TYPE_SHORT_REAL:
+			memcpy(datagram + size, &value16, sizeof(value16));
+			size += sizeof(value16);
+			break;
+		case TYPE_FLOAT:
+			datagram[size++] = 0;
+			memcpy(datagram + size, &value32, sizeof(value32));
+			size += sizeof(value32);
+			datagram[size++] = 2;
+			break;
+		default:
+			memset(datagram + size, 'a' + counter % 26, STRING_SIZE);
+			size += STRING_SIZE;
+			datagram[size++] = '\0';
+			break;
+	}
+	return size + TIMESTAMP_SIZE;
+}
+
+// helper, send the messages of one publisher, paced to its share of the rate
+static void run_publisher(struct bench_config *config, int self, atomic <bool> *stop, atomic <u_int64_t> *sent) {
+	char datagram[BUFLEN];
+	struct sockaddr_in server;
+	u_int64_t start, timestamp, nr_sent = 0, due;
+	double rate = (double) config->rate / config->nr_publishers;
+	int sock, size, topic = self % config->nr_topics;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	ABORT(sock == -1, "Benchmark: UDP socket CREATE error\n");
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(config->port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	start = now_ns();
+	while (!stop->load(std::memory_order_relaxed)) {
+		due = config->rate == 0 ? nr_sent + 1 : (u_int64_t) ((now_ns() - start) * rate / 1e9);
+		if (nr_sent >= due) {
+			usleep(100);
+			continue;
+		}
+
+		for (; nr_sent < due; nr_sent++) {
+			size = build_datagram(datagram, topic, config->payload, (u_int32_t) nr_sent);
+			timestamp = now_ns();
+			memcpy(datagram + size - TIMESTAMP_SIZE, &timestamp, TIMESTAMP_SIZE);
+			sendto(sock, datagram, size, 0, (struct sockaddr *) &server, sizeof(server));
+			topic = (topic + 1) % config->nr_topics;
+		}
+	}
+
+	sent->fetch_add(nr_sent);
+	close(sock);
+}
+
+// helper, take the latency of a message from the timestamp at the end of its value
+static void record_latency(const struct message_view *message, void *arg) {
+	struct receiver *receiver = (struct receiver *) arg;
+	u_int64_t timestamp;
+
+	if (message->value.size() < TIMESTAMP_SIZE)
+		return;
+	memcpy(&timestamp, message->value.data() + message->value.size() - TIMESTAMP_SIZE, TIMESTAMP_SIZE);
+	receiver->latencies.push_back(now_ns() - timestamp);
+}
+
+// helper, receive on every subscriber connection until stop is set
+static void run_receiver(vector <struct broker_client> *clients, struct receiver *receiver, atomic <bool> *stop) {
+	struct epoll_event events[MAX_EVENTS], event;
+	vector <int> wake_fds(clients->size(), -1);
+	int epoll_fd, nr_events, i;
+	u_int32_t client;
+	size_t j;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	ABORT(epoll_fd == -1, "Benchmark: EPOLL error\n");
+	event.events = EPOLLIN;
+	for (j = 0; j < clients->size(); j++) {
+		event.data.u32 = j;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, (*clients)[j].socket, &event);
+	}
+
+	while (!stop->load(std::memory_order_relaxed)) {
+		nr_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 10);
+		for (i = 0; i < nr_events; i++) {
+			client = events[i].data.u32;
+			client_drain(&(*clients)[client], record_latency, receiver);
+
+			// the ring of the broker is known once the answer to the ID message is read
+			if (client_wake_fd(&(*clients)[client]) != wake_fds[client]) {
+				wake_fds[client] = client_wake_fd(&(*clients)[client]);
+				event.data.u32 = client;
+				if (wake_fds[client] != -1)
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fds[client], &event);
+			}
+		}
+	}
+	close(epoll_fd);
+}
+
+// helper, write every queued request of a client (its socket is non-blocking)
+static bool flush_requests(struct broker_client *client) {
+	struct pollfd descriptor;
+	int ret;
+
+	descriptor.fd = client->socket;
+	descriptor.events = POLLOUT;
+	while ((ret = client_flush(client)) == QUEUE_PENDING)
+		poll(&descriptor, 1, 100);
+	return ret == QUEUE_EMPTY;
+}
+
+// helper, start the server, with stdin on a pipe (for the exit command)
+static pid_t start_server(struct bench_config *config, int *command_fd) {
+	vector <char *> argv;
+	char port[16];
+	int command_pipe[2], null_fd;
+	pid_t pid;
+
+	snprintf(port, sizeof(port), "%d", config->port);
+	argv.push_back((char *) config->server);
+	argv.push_back(port);
+	argv.insert(argv.end(), config->server_options.begin(), config->server_options.end());
+	argv.push_back(NULL);
+
+	ABORT(pipe(command_pipe) == -1, "Benchmark: PIPE error\n");
+	pid = fork();
+	ABORT(pid == -1, "Benchmark: FORK error\n");
+	if (pid == 0) {
+		null_fd = open("/dev/null", O_WRONLY);
+		dup2(command_pipe[0], STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		close(command_pipe[0]);
+		close(command_pipe[1]);
+		execv(config->server, argv.data());
+		_exit(EXIT_FAILURE);
+	}
+
+	close(command_pipe[0]);
+	*command_fd = command_pipe[1];
+	return pid;
+}
+
+// helper, the VmRSS and VmHWM (peak) lines of a process
+static void read_rss(pid_t pid, long *rss_kb, long *peak_rss_kb) {
+	char path[64], line[256];
+	FILE *status;
+
+	*rss_kb = *peak_rss_kb = -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	status = fopen(path, "r");
+	if (status == NULL)
+		return;
+	while (fgets(line, sizeof(line), status) != NULL) {
+		if (!strncmp(line, "VmRSS:", 6))
+			*rss_kb = atol(line + 6);
+		else if (!strncmp(line, "VmHWM:", 6))
+			*peak_rss_kb = atol(line + 6);
+	}
+	fclose(status);
+}
+
+// helper, connect a subscriber, retrying while the server starts
+static void connect_subscriber(struct bench_config *config, struct broker_client *client, int index) {
+	struct sockaddr_in server;
+	char id[16];
+	int retries;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(config->port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	snprintf(id, sizeof(id), "bench%d", index);
+
+	for (retries = 0; retries < CONNECT_RETRIES; retries++) {
+		if (client_connect(client, id, &server, PROTOCOL_V2, config->transport) != -1) {
+			if (flush_requests(client))
+				return;
+			client_close(client);
+		}
+		usleep(20000);
+	}
+	ABORT(1, "Benchmark: the server does not accept connections\n");
+}
+
+/**
+	@brief Function that runs one benchmark: it starts the server, subscribes
+		   every topic from fanout subscribers, sends the messages of the
+		   publishers for the configured duration and measures what the
+		   subscribers receive.
+
+	@param config The shape of the load.
+	@param result Where the measurements are stored.
+**/
+void run_benchmark(struct bench_config *config, struct bench_result *result) {
+	vector <struct broker_client> clients(config->nr_subscribers);
+	vector <thread> publishers;
+	struct receiver receiver;
+	atomic <bool> stop_publishers(false), stop_receiver(false);
+	atomic <u_int64_t> sent(0);
+	char topic[TOPIC_SIZE + 1];
+	u_int64_t start;
+	pid_t server;
+	int command_fd, i, j;
+
+	server = start_server(config, &command_fd);
+	for (i = 0; i < config->nr_subscribers; i++)
+		connect_subscriber(config, &clients[i], i);
+
+	// topic t is subscribed by the subscribers t * fanout ... t * fanout + fanout - 1 (mod M)
+	for (i = 0; i < config->nr_topics; i++) {
+		snprintf(topic, sizeof(topic), "bench/%d", i);
+		for (j = 0; j < config->fanout; j++)
+			client_subscribe(&clients[(i * config->fanout + j) % config->nr_subscribers], topic, 0, 0, NULL);
+	}
+	for (i = 0; i < config->nr_subscribers; i++)
+		ABORT(!flush_requests(&clients[i]), "Benchmark: SUBSCRIBE error\n");
+	usleep(200000 + config->nr_topics * config->fanout * 2);
+
+	receiver.latencies.reserve(1 << 20);
+	thread receiving(run_receiver, &clients, &receiver, &stop_receiver);
+	start = now_ns();
+	for (i = 0; i < config->nr_publishers; i++)
+		publishers.emplace_back(run_publisher, config, i, &stop_publishers, &sent);
+
+	usleep((useconds_t) (config->duration * 1e6));
+	stop_publishers = true;
+	for (i = 0; i < config->nr_publishers; i++)
+		publishers[i].join();
+	result->seconds = (now_ns() - start) / 1e9;
+
+	usleep(DRAIN_MS * 1000);
+	stop_receiver = true;
+	receiving.join();
+
+	read_rss(server, &result->rss_kb, &result->peak_rss_kb);
+	write(command_fd, "exit\n", 5);
+	close(command_fd);
+	waitpid(server, NULL, 0);
+	for (i = 0; i < config->nr_subscribers; i++)
+		client_close(&clients[i]);
+
+	result->sent = sent;
+	result->received = receiver.latencies.size();
+	result->p50 = result->p99 = result->p999 = 0;
+	if (receiver.latencies.empty())
+		return;
+	sort(receiver.latencies.begin(), receiver.latencies.end());
+	result->p50 = receiver.latencies[receiver.latencies.size() * 50 / 100];
+	result->p99 = receiver.latencies[receiver.latencies.size() * 99 / 100];
+	result->p999 = receiver.latencies[receiver.latencies.size() * 999 / 1000];
+}
+
+// helper, one line of the report
+static void print_result(struct bench_config *config, struct bench_result *result) {
+	u_int64_t expected = result->sent * config->fanout;
+
+	printf("%7d %7d %-10s %11.0f %12.0f %7.2f %9.1f %9.1f %9.1f %9ld %9ld\n",
+		config->nr_topics, config->fanout, payload_names[config->payload],
+		result->sent / result->seconds, result->received / result->seconds,
+		expected == 0 ? 0.0 : 100.0 * (1.0 - (double) result->received / expected),
+		result->p50 / 1e3, result->p99 / 1e3, result->p999 / 1e3,
+		result->rss_kb, result->peak_rss_kb);
+}
+
+/**
+	@brief Function that parses the arguments of the benchmark.
+
+	@param argc Number of arguments.
+	@param argv The arguments.
+	@param config Where the shape of the load is stored.
+	@param suite Where the choice of the full suite is stored.
+**/
+void parse_options(int argc, char **argv, struct bench_config *config, bool *suite) {
+	int i, j;
+
+	config->server = "./server";
+	config->port = 12345;
+	config->nr_publishers = 2;
+	config->nr_subscribers = 8;
+	config->nr_topics = 100;
+	config->fanout = 4;
+	config->payload = TYPE_INT;
+	config->rate = 100000;
+	config->duration = 3;
+	config->transport = TRANSPORT_TCP;
+	*suite = false;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--server") && i + 1 < argc) {
+			config->server = argv[++i];
+		} else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+			config->port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--publishers") && i + 1 < argc) {
+			config->nr_publishers = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--subscribers") && i + 1 < argc) {
+			config->nr_subscribers = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--topics") && i + 1 < argc) {
+			config->nr_topics = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--fanout") && i + 1 < argc) {
+			config->fanout = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--payload") && i + 1 < argc) {
+			i++;
+			for (j = TYPE_INT; j <= TYPE_STRING && strcmp(argv[i], payload_names[j]); j++);
+			ABORT(j > TYPE_STRING, "Invalid payload. Use int, short_real, float or string.\n");
+			config->payload = j;
+		} else if (!strcmp(argv[i], "--rate") && i + 1 < argc) {
+			config->rate = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+			config->duration = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--shm")) {
+			config->transport = TRANSPORT_SHM;
+		} else if (!strcmp(argv[i], "--suite")) {
+			*suite = true;
+		} else if (!strcmp(argv[i], "--")) {
+			config->server_options.assign(argv + i + 1, argv + argc);
+			break;
+		} else {
+			ABORT(1, USAGE);
+		}
+	}
+
+	ABORT(config->nr_publishers < 1 || config->nr_subscribers < 1 || config->nr_topics < 1, USAGE);
+	ABORT(config->fanout < 1 || config->fanout > config->nr_subscribers,
+		"Invalid fanout (1 - number of subscribers).\n");
+}
+
+int main(int argc, char **argv) {
+	static const int suite_topics[] = {10, 1000};
+	static const int suite_fanouts[] = {1, 8};
+	static const u_int8_t suite_payloads[] = {TYPE_INT, TYPE_FLOAT, TYPE_STRING};
+	struct bench_config config;
+	struct bench_result result;
+	bool suite;
+	size_t i, j, k;
+
+	signal(SIGPIPE, SIG_IGN);
+	parse_options(argc, argv, &config, &suite);
+	setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+
+	printf("%d publishers, %d subscribers, %u msgs/s offered, %.1f s per run\n",
+		config.nr_publishers, config.nr_subscribers, config.rate, config.duration);
+	printf("%7s %7s %-10s %11s %12s %7s %9s %9s %9s %9s %9s\n", "topics", "fanout", "payload",
+		"sent/s", "delivered/s", "loss%", "p50(us)", "p99(us)", "p99.9(us)", "rss(KB)", "peak(KB)");
+
+	if (!suite) {
+		run_benchmark(&config, &result);
+		print_result(&config, &result);
+		return 0;
+	}
+
+	if (config.nr_subscribers < suite_fanouts[1])
+		config.nr_subscribers = suite_fanouts[1];
+	for (i = 0; i < sizeof(suite_topics) / sizeof(suite_topics[0]); i++) {
+		for (j = 0; j < sizeof(suite_fanouts) / sizeof(suite_fanouts[0]); j++) {
+			for (k = 0; k < sizeof(suite_payloads); k++) {
+				config.nr_topics = suite_topics[i];
+				config.fanout = suite_fanouts[j];
+				config.payload = suite_payloads[k];
+				run_benchmark(&config, &result);
+				print_result(&config, &result);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,509 @@
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "broker_client.h"
+#include "event_loop.h"
+#include "custom_TCP.h"
+
+// helper, queue a v1 frame and write as much as the socket accepts
+static int queue_request(struct broker_client *client, struct TCP_msg *msg) {
+	const char *frame = (const char *) msg;
+
+	client->pending.insert(client->pending.end(), frame, frame + ntohl(msg->length));
+	return client_flush(client) == QUEUE_ERROR ? -1 : 0;
+}
+
+// helper, the view of a PUBLISH payload (topic slot, then data type and value)
+static void view_payload(const char *payload, u_int32_t length, struct message_view *message) {
+	message->topic = string_view(payload, strnlen(payload, length < TOPIC_SIZE ? length : TOPIC_SIZE));
+	if (length <= TOPIC_SIZE) {
+		message->data_type = NO_DATA_TYPE;
+		message->value = string_view();
+		return;
+	}
+	message->data_type = (u_int8_t) payload[TOPIC_SIZE];
+	message->value = string_view(payload + TOPIC_SIZE + 1, length - TOPIC_SIZE - 1);
+}
+
+// helper, the view of a v1 PUBLISH frame
+static void view_v1_publish(const char *frame, u_int32_t length, struct message_view *message) {
+	memcpy(&message->UDP_addr, frame + offsetof(struct TCP_msg, UDP_addr), sizeof(message->UDP_addr));
+	memcpy(&message->UDP_port, frame + offsetof(struct TCP_msg, UDP_port), sizeof(message->UDP_port));
+	view_payload(frame + HEADER_SIZE, length - HEADER_SIZE, message);
+}
+
+// helper, decode a v2 PUBLISH body; false if it is malformed
+static bool view_v2_publish(struct broker_client *client, const char *body, u_int32_t length,
+							struct message_view *message) {
+	u_int32_t alias, topic_length, position;
+	int size;
+
+	if ((size = get_varint(body, length, &alias)) <= 0)
+		return false;
+	position = size;
+
+	if (alias == NO_ALIAS) {
+		if ((size = get_varint(body + position, length - position, &topic_length)) <= 0
+				|| topic_length > TOPIC_SIZE || position + size + topic_length > length)
+			return false;
+		position += size;
+		message->topic = string_view(body + position, topic_length);
+		position += topic_length;
+	} else {
+		if (alias >= client->aliases.size())
+			return false;
+		message->topic = client->aliases[alias];
+	}
+
+	if (position + sizeof(message->UDP_addr) + sizeof(message->UDP_port) > length)
+		return false;
+	memcpy(&message->UDP_addr, body + position, sizeof(message->UDP_addr));
+	position += sizeof(message->UDP_addr);
+	memcpy(&message->UDP_port, body + position, sizeof(message->UDP_port));
+	position += sizeof(message->UDP_port);
+
+	if (position == length) {
+		message->data_type = NO_DATA_TYPE;
+		message->value = string_view();
+		return true;
+	}
+	message->data_type = (u_int8_t) body[position];
+	message->value = string_view(body + position + 1, length - position - 1);
+	return true;
+}
+
+// helper, remember the topic name announced for an alias
+static void store_alias(struct broker_client *client, const char *body, u_int32_t length) {
+	u_int32_t alias;
+	int size;
+
+	if ((size = get_varint(body, length, &alias)) <= 0 || alias == NO_ALIAS || length - size > TOPIC_SIZE)
+		return;
+	if (alias >= client->aliases.size())
+		client->aliases.resize(alias + 1);
+	client->aliases[alias].assign(body + size, length - size);
+}
+
+// helper, count a message received on the socket; without a number from the broker (v1 fallback, ring) there is none to advance
+static void count_message(struct broker_client *client) {
+	if (client->sequence != NO_RESUME)
+		client->sequence++;
+}
+
+/*
+ * helper, handle the answer to the ID message: the protocol of the next frames,
+ * the number of the next message and, if the client asked for it, the shared
+ * memory ring it may read (a ring that cannot be mapped is never read, the
+ * broker then takes the slot back)
+ */
+static void accept_answer(struct broker_client *client, const char *frame, u_int32_t length) {
+	const char *payload = frame + HEADER_SIZE;
+	u_int32_t name = ANSWER_SEQUENCE + sizeof(u_int64_t);
+	u_int64_t sequence;
+
+	if (length <= HEADER_SIZE)
+		return;
+	if (client->requested_protocol == PROTOCOL_V2 && payload[0] == PROTOCOL_V2)
+		client->protocol = PROTOCOL_V2;
+	if (length < HEADER_SIZE + name)
+		return;
+
+	// the messages between the last one received and the next one are lost
+	memcpy(&sequence, payload + ANSWER_SEQUENCE, sizeof(sequence));
+	sequence = be64toh(sequence);
+	if (client->sequence != NO_RESUME && sequence > client->sequence)
+		client->lost += sequence - client->sequence;
+	client->sequence = sequence;
+
+	if (length > HEADER_SIZE + name && payload[1] == TRANSPORT_SHM && client->shm == NULL
+			&& memchr(payload + name, '\0', length - HEADER_SIZE - name) != NULL)
+		client->shm = open_shm_reader(payload + name, (u_int8_t) payload[2]);
+}
+
+/**
+	@brief Function that starts a non-blocking connection to the broker and
+		   queues the ID message of the client.
+
+	@param client The client to be initialized.
+	@param id The ID of the client (at most 10 characters).
+	@param server Address of the broker.
+	@param protocol PROTOCOL_V2 to ask for the compact protocol, PROTOCOL_V1
+					to keep the original one.
+	@param transport TRANSPORT_SHM to ask for the shared memory ring of the
+					 broker (granted only on the same host), TRANSPORT_TCP
+					 otherwise.
+
+	@return int The socket of the connection (to be polled for client_events()),
+				or -1 if the connection failed.
+**/
+int client_connect(struct broker_client *client, const char *id, struct sockaddr_in *server, u_int8_t protocol,
+				u_int8_t transport) {
+	if (strlen(id) > 10)
+		return -1;
+
+	strcpy(client->id, id);
+	client->requested_protocol = protocol;
+	client->transport = transport;
+	client->sequence = NO_RESUME;	// the broker gives the first number
+	client->lost = 0;
+	return client_reconnect(client, server);
+}
+
+/**
+	@brief Function that connects a closed client again, with the same ID
+		   and options. The broker first sends the messages the client did
+		   not receive on its previous connection.
+
+	@param client The client (closed by client_close()).
+	@param server Address of the broker.
+
+	@return int The socket of the connection, or -1 if the connection failed.
+**/
+int client_reconnect(struct broker_client *client, struct sockaddr_in *server) {
+	struct TCP_msg msg;
+	int enable = 1;
+
+	client->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (client->socket < 0)
+		return -1;
+
+	// disable Neagle algorithm
+	setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+	set_nonblocking(client->socket);
+	if (connect(client->socket, (struct sockaddr *) server, sizeof(*server)) == -1 && errno != EINPROGRESS) {
+		close(client->socket);
+		client->socket = -1;
+		return -1;
+	}
+
+	client->protocol = PROTOCOL_V1;	// until the server accepts v2
+	client->pending.clear();
+	client->pending_sent = 0;
+	client->aliases.clear();
+	client->shm = NULL;
+	init_reader(&client->reader, CLIENT_BUFFER_SIZE);
+
+	create_id_msg(client->id, client->requested_protocol, client->transport, client->sequence, &msg);
+	if (queue_request(client, &msg) == -1) {
+		client_close(client);
+		return -1;
+	}
+	return client->socket;
+}
+
+/**
+	@brief Function that subscribes the client to a topic or a pattern.
+
+	@param client The client.
+	@param topic Name of the topic (at most 50 characters).
+	@param SF 1 to keep the messages sent while the client is offline.
+	@param options SUBSCRIBE_* flags (SUBSCRIBE_CONFLATE to get only the
+				   newest message of a topic when the client falls behind).
+	@param filter Only the messages selected by this filter are sent (see
+				  compile_filter()), NULL for all of them.
+
+	@return int 0 on success, -1 if the topic is too long, the filter is invalid
+				or the connection is broken.
+**/
+int client_subscribe(struct broker_client *client, const char *topic, u_int8_t SF, u_int8_t options,
+					const char *filter) {
+	struct content_filter compiled;
+	struct TCP_msg msg;
+
+	if (strlen(topic) > TOPIC_SIZE)
+		return -1;
+	// the server ignores subscriptions with an invalid filter, they are refused here
+	if (filter != NULL && (strlen(filter) >= FILTER_SIZE || !compile_filter(filter, &compiled)))
+		return -1;
+	create_subscribe_msg(SF, options, client->id, topic, filter, &msg);
+	return queue_request(client, &msg);
+}
+
+/**
+	@brief Function that unsubscribes the client from a topic or a pattern.
+
+	@param client The client.
+	@param topic Name of the topic (at most 50 characters).
+
+	@return int 0 on success, -1 if the topic is too long or the connection is broken.
+**/
+int client_unsubscribe(struct broker_client *client, const char *topic) {
+	struct TCP_msg msg;
+
+	if (strlen(topic) > TOPIC_SIZE)
+		return -1;
+	create_unsubscribe_msg(client->id, topic, &msg);
+	return queue_request(client, &msg);
+}
+
+/**
+	@brief Function that changes the output mode of the client on the server.
+
+	@param client The client.
+	@param mode OUTPUT_LATENCY or OUTPUT_THROUGHPUT.
+
+	@return int 0 on success, -1 if the connection is broken.
+**/
+int client_set_mode(struct broker_client *client, u_int8_t mode) {
+	struct TCP_msg msg;
+
+	create_mode_msg(client->id, mode, &msg);
+	return queue_request(client, &msg);
+}
+
+/**
+	@brief Function that returns the descriptor signaled when the shared
+		   memory ring has messages for the client, to be polled for POLLIN
+		   besides the socket (client_drain() handles both).
+
+	@param client The client.
+
+	@return int The descriptor, -1 if the client does not read a ring.
+**/
+int client_wake_fd(struct broker_client *client) {
+	return client->shm == NULL ? -1 : client->shm->wake_fd;
+}
+
+/**
+	@brief Function that returns the events to poll for on the socket of the
+		   client: POLLOUT is only needed while some requests are not written.
+
+	@param client The client.
+
+	@return short Mask of poll events.
+**/
+short client_events(struct broker_client *client) {
+	return client->pending_sent < client->pending.size() ? POLLIN | POLLOUT : POLLIN;
+}
+
+/**
+	@brief Function that writes the queued requests, as much as the socket
+		   accepts.
+
+	@param client The client.
+
+	@return int QUEUE_EMPTY if everything was written, QUEUE_PENDING if the
+				socket is full (or still connecting) and QUEUE_ERROR if the
+				connection is broken.
+**/
+int client_flush(struct broker_client *client) {
+	ssize_t bytes_sent;
+
+	while (client->pending_sent < client->pending.size()) {
+		bytes_sent = send(client->socket, client->pending.data() + client->pending_sent,
+						client->pending.size() - client->pending_sent, MSG_NOSIGNAL);
+		if (bytes_sent == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+				return QUEUE_PENDING;
+			return QUEUE_ERROR;
+		}
+		client->pending_sent += bytes_sent;
+	}
+
+	client->pending.clear();
+	client->pending_sent = 0;
+	return QUEUE_EMPTY;
+}
+
+/**
+	@brief Function that reads the bytes available on the socket of the client
+		   in its receive buffer. Views of previously decoded messages are no
+		   longer valid.
+
+	@param client The client.
+
+	@return int Number of bytes read, READ_AGAIN or READ_CLOSED.
+**/
+int client_read(struct broker_client *client) {
+	return fill_reader(client->socket, &client->reader);
+}
+
+/**
+	@brief Function that decodes the next PUBLISH message from the receive
+		   buffer, without copying it. The other frames (the answer to the ID
+		   message, topic aliases) are handled on the way.
+
+	@param client The client.
+	@param message Where the view of the message is stored.
+
+	@return int FRAME_READY, FRAME_INCOMPLETE if client_read() must be called
+				first or FRAME_INVALID if the connection is corrupted.
+**/
+int client_next_message(struct broker_client *client, struct message_view *message) {
+	u_int32_t type, length;
+	const char *frame;
+	int ret;
+
+	// the ring first; once it is empty, the broker rings the doorbell for the next record
+	while (client->shm != NULL) {
+		ret = next_shm_frame(client->shm, &frame, &length);
+		if (ret == FRAME_READY && length >= HEADER_SIZE) {
+			view_v1_publish(frame, length, message);
+			return FRAME_READY;
+		}
+		if (ret == FRAME_INCOMPLETE && sleep_shm_reader(client->shm))
+			break;
+		if (ret == SHM_CLOSED) {
+			// the broker took the slot back, the next messages come trough the socket
+			close_shm_reader(client->shm);
+			client->shm = NULL;
+		}
+	}
+
+	while (1) {
+		if (client->protocol == PROTOCOL_V2) {
+			if ((ret = next_v2_frame(&client->reader, &type, &frame, &length)) != FRAME_READY)
+				return ret;
+			if (type == TOPIC_ALIAS)
+				store_alias(client, frame, length);
+			if (type != PUBLISH)
+				continue;
+			count_message(client);
+			if (view_v2_publish(client, frame, length, message))
+				return FRAME_READY;
+			continue;
+		}
+
+		if ((ret = peek_frame(&client->reader, &frame, &length)) != FRAME_READY)
+			return ret;
+		type = (u_int8_t) frame[offsetof(struct TCP_msg, type)];
+
+		// the server accepted v2 (the next frames use it) or the shared memory ring
+		if (type == ID) {
+			accept_answer(client, frame, length);
+			// the ring may already hold messages
+			if (client->shm != NULL)
+				return client_next_message(client, message);
+			continue;
+		}
+		if (type != PUBLISH || length < HEADER_SIZE)
+			continue;
+
+		count_message(client);
+		view_v1_publish(frame, length, message);
+		return FRAME_READY;
+	}
+}
+
+/**
+	@brief Function that reads once from the socket of the client and hands
+		   every complete message to a callback.
+
+	@param client The client.
+	@param callback Called with the view of every message.
+	@param arg Passed to the callback.
+
+	@return int Number of messages, CLIENT_CLOSED if the server closed the
+				connection or CLIENT_INVALID if it sent an invalid frame.
+**/
+int client_drain(struct broker_client *client, message_callback callback, void *arg) {
+	struct message_view message;
+	u_int64_t value;
+	int ret, nr_messages = 0;
+
+	if (client_read(client) == READ_CLOSED)
+		return CLIENT_CLOSED;
+	if (client->shm != NULL)
+		read(client->shm->wake_fd, &value, sizeof(value));
+
+	while ((ret = client_next_message(client, &message)) == FRAME_READY) {
+		callback(&message, arg);
+		nr_messages++;
+	}
+	return ret == FRAME_INVALID ? CLIENT_INVALID : nr_messages;
+}
+
+/**
+	@brief Function that closes the connection of the client and releases its
+		   buffers.
+
+	@param client The client.
+**/
+void client_close(struct broker_client *client) {
+	close(client->socket);
+	client->socket = -1;
+	client->pending.clear();
+	client->pending_sent = 0;
+	client->aliases.clear();
+	free_reader(&client->reader);
+	if (client->shm != NULL) {
+		close_shm_reader(client->shm);
+		client->shm = NULL;
+	}
+}
+
+/**
+	@brief Function that decodes the value of an INT message.
+
+	@param message The message.
+	@param value Where the value is stored.
+
+	@return bool False if the message does not hold an INT value.
+**/
+bool view_int(const struct message_view *message, int32_t *value) {
+	u_int32_t magnitude;
+
+	if (message->data_type != TYPE_INT || message->value.size() < 1 + sizeof(magnitude))
+		return false;
+	memcpy(&magnitude, message->value.data() + 1, sizeof(magnitude));
+	magnitude = ntohl(magnitude);
+	*value = (int32_t) (message->value[0] == 0 ? magnitude : 0u - magnitude);
+	return true;
+}
+
+/**
+	@brief Function that decodes the value of a SHORT_REAL message.
+
+	@param message The message.
+	@param value Where the value is stored, in hundredths.
+
+	@return bool False if the message does not hold a SHORT_REAL value.
+**/
+bool view_short_real(const struct message_view *message, u_int16_t *value) {
+	if (message->data_type != TYPE_SHORT_REAL || message->value.size() < sizeof(*value))
+		return false;
+	memcpy(value, message->value.data(), sizeof(*value));
+	*value = ntohs(*value);
+	return true;
+}
+
+/**
+	@brief Function that decodes the value of a FLOAT message, which is
+		   (negative ? -1 : 1) * value / 10 ^ exponent.
+
+	@param message The message.
+	@param value Where the absolute value of the digits is stored.
+	@param exponent Where the power of ten is stored.
+	@param negative Where the sign is stored.
+
+	@return bool False if the message does not hold a FLOAT value.
+**/
+bool view_float(const struct message_view *message, u_int32_t *value, u_int8_t *exponent, bool *negative) {
+	if (message->data_type != TYPE_FLOAT || message->value.size() < 2 + sizeof(*value))
+		return false;
+	*negative = message->value[0] != 0;
+	memcpy(value, message->value.data() + 1, sizeof(*value));
+	*value = ntohl(*value);
+	*exponent = (u_int8_t) message->value[1 + sizeof(*value)];
+	return true;
+}
+
+/**
+	@brief Function that returns the text of a STRING message.
+
+	@param message The message.
+
+	@return string_view The text (empty if the message is not a STRING).
+**/
+string_view view_string(const struct message_view *message) {
+	if (message->data_type != TYPE_STRING)
+		return string_view();
+	return message->value.substr(0, strnlen(message->value.data(), message->value.size()));
+}
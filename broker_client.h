@@ -0,0 +1,83 @@
+#ifndef _BROKER_CLIENT_H
+#define _BROKER_CLIENT_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "frame_reader.h"
+#include "content_filter.h"
+#include "shm_ring.h"
+
+using namespace std;
+
+#define CLIENT_BUFFER_SIZE (256 * 1024)	// frames decoded for every read
+
+// results of client_drain() (besides the number of messages)
+#define CLIENT_CLOSED -1
+#define CLIENT_INVALID -2
+
+/*
+ * A PUBLISH message as it was received. The topic and the value point into the
+ * receive buffer of the client (or into its topic aliases), so they are valid
+ * until the next call of client_next_message() or client_read().
+ */
+struct message_view {
+	struct in_addr UDP_addr;
+	u_int16_t UDP_port;		// network order
+	string_view topic;
+	u_int8_t data_type;
+	string_view value;		// encoded value, after the data type
+};
+
+typedef void (*message_callback)(const struct message_view *message, void *arg);
+
+/*
+ * Connection of a subscriber to the broker, on a non-blocking socket. The
+ * requests of the client are queued in pending and written as the socket
+ * accepts them; the messages of the server are decoded in place from a large
+ * receive buffer. A client on the same host may also read its messages from
+ * the shared memory ring of the broker, until the broker takes it back.
+ *
+ * The messages received on the socket are numbered (not while the client
+ * reads the ring). A client that connects
+ * again asks for the messages after the last one it got, so those lost with
+ * the previous connection are sent again (if the broker still has them).
+ */
+struct broker_client {
+	int socket;
+	char id[13];
+	u_int8_t requested_protocol;
+	u_int8_t protocol;		// of the frames received, v1 until the server accepts v2
+	u_int8_t transport;		// requested
+	u_int64_t sequence;		// number of the next message expected on the socket, NO_RESUME until the broker numbers them
+	u_int64_t lost;			// messages the broker could not send again after a reconnection
+	vector <char> pending;	// requests not written yet
+	size_t pending_sent;
+	vector <string> aliases;	// topic names announced by the server (v2), by alias
+	struct frame_reader reader;
+	struct shm_reader *shm;	// NULL while the messages only come trough the socket
+};
+
+int client_connect(struct broker_client *client, const char *id, struct sockaddr_in *server, u_int8_t protocol,
+				u_int8_t transport);
+int client_reconnect(struct broker_client *client, struct sockaddr_in *server);
+int client_wake_fd(struct broker_client *client);
+int client_subscribe(struct broker_client *client, const char *topic, u_int8_t SF, u_int8_t options,
+					const char *filter);
+int client_unsubscribe(struct broker_client *client, const char *topic);
+int client_set_mode(struct broker_client *client, u_int8_t mode);
+short client_events(struct broker_client *client);
+int client_flush(struct broker_client *client);
+int client_read(struct broker_client *client);
+int client_next_message(struct broker_client *client, struct message_view *message);
+int client_drain(struct broker_client *client, message_callback callback, void *arg);
+void client_close(struct broker_client *client);
+
+bool view_int(const struct message_view *message, int32_t *value);
+bool view_short_real(const struct message_view *message, u_int16_t *value);
+bool view_float(const struct message_view *message, u_int32_t *value, u_int8_t *exponent, bool *negative);
+string_view view_string(const struct message_view *message);
+
+#endif
@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <endian.h>
+#include "custom_TCP.h"
+
+/**
+	@brief Function that creates a subscribe message (used by clients).
+
+	@param SF 1 for store-and-forward activated, 0 otherwise.
+	@param options SUBSCRIBE_* flags, 0 for none.
+	@param id The ID of the client that generates this message. 
+	@param topic Name of the subscribed topic.
+	@param filter Content filter of the subscription (see compile_filter()), NULL for none.
+	@param msg Pointer to the structure that will store this message.
+**/ 
+void create_subscribe_msg(u_int8_t SF, u_int8_t options, const char *id, const char *topic, const char *filter,
+						struct TCP_msg *msg) {
+	memset(msg, 0, sizeof(struct TCP_msg));
+	msg->length = htonl(HEADER_SIZE + strlen(topic));
+	if (SF == 0)
+		msg->type = SUBSCRIBE;
+	else
+		msg->type = SUBSCRIBE_SF;
+	memcpy(msg->id, id, strlen(id));
+	memcpy(msg->payload, topic, strlen(topic));
+
+	// servers that do not know the options stop reading at the terminator of the name
+	if (filter != NULL)
+		options |= SUBSCRIBE_FILTER;
+	if (options != 0) {
+		msg->length = htonl(HEADER_SIZE + strlen(topic) + 2);
+		msg->payload[strlen(topic) + 1] = options;
+	}
+	if (filter != NULL) {
+		memcpy(msg->payload + strlen(topic) + 2, filter, strnlen(filter, FILTER_SIZE - 1));
+		msg->length = htonl(HEADER_SIZE + strlen(topic) + 3 + strnlen(filter, FILTER_SIZE - 1));
+	}
+}
+
+/**
+	@brief Function that creates a subscribe message (used by clients).
+
+	@param id The ID of the client that generates this message. 
+	@param topic Name of the subscribed topic.
+	@param msg Pointer to the structure that will store this message.
+**/ 
+void create_unsubscribe_msg(const char *id, const char *topic, struct TCP_msg *msg) {
+	memset(msg, 0, sizeof(struct TCP_msg));
+	msg->length = htonl(HEADER_SIZE + strlen(topic));
+	msg->type = UNSUBSCRIBE;
+	memcpy(msg->id, id, strlen(id));
+	memcpy(msg->payload, topic, strlen(topic));
+}
+
+/**
+	@brief Function that creates an ID type message (used by clients
+		   imediately after connecting to a server).
+	
+	@param id The ID of the client that generates this message. 
+	@param version The protocol requested for the messages sent by the server
+				   (PROTOCOL_V1 keeps the original 18 bytes message).
+	@param transport TRANSPORT_SHM to ask for the shared memory ring of the
+					 broker, TRANSPORT_TCP to get every message on the socket.
+	@param resume Number of the next message the client expects, NO_RESUME
+				  on its first connection (v2 or shared memory only, the
+				  messages of the original protocol are not numbered).
+	@param msg Pointer to the structure that will store this message.
+**/ 
+void create_id_msg(const char *id, u_int8_t version, u_int8_t transport, u_int64_t resume, struct TCP_msg *msg) {
+	memset(msg, 0, HEADER_SIZE + RESUME_OFFSET + sizeof(resume));
+	msg->length = htonl(18);
+	msg->type = ID;
+	memcpy(msg->id, id, strlen(id));
+	msg->payload[0] = version;
+	if (version == PROTOCOL_V1 && transport == TRANSPORT_TCP)
+		return;
+
+	msg->length = htonl(HEADER_SIZE + RESUME_OFFSET + sizeof(resume));
+	msg->payload[1] = transport;
+	resume = htobe64(resume);
+	memcpy(msg->payload + RESUME_OFFSET, &resume, sizeof(resume));
+}
+
+/**
+	@brief Function that creates an output mode message (used by clients).
+
+	@param id The ID of the client that generates this message.
+	@param mode OUTPUT_LATENCY or OUTPUT_THROUGHPUT.
+	@param msg Pointer to the structure that will store this message.
+**/
+void create_mode_msg(const char *id, u_int8_t mode, struct TCP_msg *msg) {
+	memset(msg, 0, HEADER_SIZE + 1);
+	msg->length = htonl(HEADER_SIZE + 1);
+	msg->type = OUTPUT_MODE;
+	memcpy(msg->id, id, strlen(id));
+	msg->payload[0] = mode;
+}
+
+/**
+	@brief Function for sending a message on the specified (blocking) socket, using TCP.
+	
+	@param socket The socket used for message sending.
+	@param msg Pointer to the structure containing the message to be sent.
+
+	@return int 0 on success, -1 if the connection is broken.
+**/
+int send_msg(int socket, struct TCP_msg *msg) {
+	u_int32_t total_sent = 0;
+	ssize_t bytes_sent;
+
+	// make sure we send exactly the required number of bytes
+	while (total_sent < ntohl(msg->length)) {
+		bytes_sent = send(socket, (char *) msg + total_sent, ntohl(msg->length) - total_sent, MSG_NOSIGNAL);
+		if (bytes_sent == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total_sent += bytes_sent;
+	}
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "content_filter.h"
+#include "protocol_v2.h"
+
+// helper, take the next word (separated by spaces) out of the text
+static string_view next_word(string_view &rest) {
+	size_t start = rest.find_first_not_of(' '), end;
+	string_view word;
+
+	if (start == string_view::npos) {
+		rest = string_view();
+		return word;
+	}
+	end = rest.find(' ', start);
+	if (end == string_view::npos)
+		end = rest.size();
+	word = rest.substr(start, end - start);
+	rest = rest.substr(end);
+	return word;
+}
+
+// helper, parse a finite number that is a whole word
+static bool parse_number(string_view word, double *number) {
+	char text[64], *end;
+
+	if (word.empty() || word.size() >= sizeof(text))
+		return false;
+	memcpy(text, word.data(), word.size());
+	text[word.size()] = '\0';
+	*number = strtod(text, &end);
+	return *end == '\0' && isfinite(*number);
+}
+
+// helper, compile a numeric comparison into an interval
+static bool compile_number(string_view op, string_view rest, struct content_filter *filter) {
+	double first, second;
+
+	if (!parse_number(next_word(rest), &first))
+		return false;
+
+	filter->op = FILTER_INSIDE;
+	filter->low = -INFINITY;
+	filter->high = INFINITY;
+	if (op == "between" || op == "outside") {
+		if (!parse_number(next_word(rest), &second))
+			return false;
+		filter->op = op == "between" ? FILTER_INSIDE : FILTER_OUTSIDE;
+		filter->low = first < second ? first : second;
+		filter->high = first < second ? second : first;
+	} else if (op == ">") {
+		filter->low = nextafter(first, INFINITY);
+	} else if (op == ">=") {
+		filter->low = first;
+	} else if (op == "<") {
+		filter->high = nextafter(first, -INFINITY);
+	} else if (op == "<=") {
+		filter->high = first;
+	} else if (op == "==" || op == "!=") {
+		filter->op = op == "==" ? FILTER_INSIDE : FILTER_OUTSIDE;
+		filter->low = filter->high = first;
+	} else {
+		return false;
+	}
+	return next_word(rest).empty();
+}
+
+/**
+	@brief Function that compiles the text of a filter. Numbers are compared
+		   with <, <=, >, >=, ==, != or as a band (between / outside A B,
+		   bounds included in the band); texts with ==, !=, prefix or
+		   contains, the operand being the rest of the filter.
+
+	@param text The filter, as "<TYPE> <OP> <OPERAND>...".
+	@param filter Where the compiled filter is stored.
+
+	@return bool False if the filter is invalid.
+**/
+bool compile_filter(string_view text, struct content_filter *filter) {
+	string_view type = next_word(text), op = next_word(text);
+
+	filter->data_type = NO_DATA_TYPE;
+	filter->text.clear();
+	if (type == "STRING") {
+		if (op == "==")
+			filter->op = FILTER_EQUAL;
+		else if (op == "!=")
+			filter->op = FILTER_DIFFERENT;
+		else if (op == "prefix")
+			filter->op = FILTER_PREFIX;
+		else if (op == "contains")
+			filter->op = FILTER_CONTAINS;
+		else
+			return false;
+		// a single space separates the operator from the operand
+		filter->text.assign(text.empty() ? text : text.substr(1));
+		filter->data_type = TYPE_STRING;
+		return true;
+	}
+
+	if (!compile_number(op, text, filter))
+		return false;
+	if (type == "INT")
+		filter->data_type = TYPE_INT;
+	else if (type == "SHORT_REAL")
+		filter->data_type = TYPE_SHORT_REAL;
+	else if (type == "FLOAT")
+		filter->data_type = TYPE_FLOAT;
+	return filter->data_type != NO_DATA_TYPE;
+}
+
+/**
+	@brief Function that compares two compiled filters.
+
+	@return bool True if both select the same messages.
+**/
+bool same_filter(const struct content_filter *first, const struct content_filter *second) {
+	if (first->data_type != second->data_type)
+		return false;
+	if (first->data_type == NO_DATA_TYPE)
+		return true;
+	return first->op == second->op && first->low == second->low && first->high == second->high
+		&& first->text == second->text;
+}
+
+/**
+	@brief Function that decodes the value of a PUBLISH message for the
+		   filters: INT, SHORT_REAL and FLOAT values as numbers (exactly as
+		   the same decimal number is parsed in a filter), STRING values as
+		   text.
+
+	@param payload The payload of the v1 frame (topic, data type, value).
+	@param length Number of payload bytes.
+	@param value Where the value is stored.
+**/
+void read_filter_value(const char *payload, u_int32_t length, struct filter_value *value) {
+	const char *data = payload + TOPIC_SIZE + 1;
+	u_int32_t size = length > TOPIC_SIZE + 1 ? length - TOPIC_SIZE - 1 : 0, digits;
+	u_int16_t hundredths;
+	double power = 1;
+	int i;
+
+	value->data_type = size > 0 ? (u_int8_t) payload[TOPIC_SIZE] : NO_DATA_TYPE;
+	if (value->data_type == TYPE_INT && size >= 1 + sizeof(digits)) {
+		memcpy(&digits, data + 1, sizeof(digits));
+		value->number = data[0] == 0 ? (double) ntohl(digits) : -(double) ntohl(digits);
+	} else if (value->data_type == TYPE_SHORT_REAL && size >= sizeof(hundredths)) {
+		memcpy(&hundredths, data, sizeof(hundredths));
+		value->number = ntohs(hundredths) / 100.0;
+	} else if (value->data_type == TYPE_FLOAT && size >= 2 + sizeof(digits)) {
+		memcpy(&digits, data + 1, sizeof(digits));
+		for (i = 0; i < (u_int8_t) data[1 + sizeof(digits)]; i++)
+			power *= 10;
+		value->number = ntohl(digits) / power;
+		if (data[0] != 0)
+			value->number = -value->number;
+	} else if (value->data_type == TYPE_STRING) {
+		value->text = string_view(data, strnlen(data, size));
+	} else {
+		value->data_type = NO_DATA_TYPE;
+	}
+}
+
+/**
+	@brief Function that tests the value of a message against a filter.
+
+	@param filter The compiled filter.
+	@param value The decoded value of the message.
+
+	@return bool True if the message is selected by the filter.
+**/
+bool filter_matches(const struct content_filter *filter, const struct filter_value *value) {
+	if (filter->data_type == NO_DATA_TYPE)
+		return true;
+	if (value->data_type != filter->data_type)
+		return false;
+
+	if (filter->op == FILTER_INSIDE)
+		return filter->low <= value->number && value->number <= filter->high;
+	if (filter->op == FILTER_OUTSIDE)
+		return value->number < filter->low || filter->high < value->number;
+	if (filter->op == FILTER_EQUAL)
+		return value->text == filter->text;
+	if (filter->op == FILTER_DIFFERENT)
+		return value->text != filter->text;
+	if (filter->op == FILTER_PREFIX)
+		return value->text.substr(0, filter->text.size()) == filter->text;
+	return value->text.find(filter->text) != string_view::npos;
+}
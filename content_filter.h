@@ -0,0 +1,52 @@
+#ifndef _CONTENT_FILTER_H
+#define _CONTENT_FILTER_H
+
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// data types of a PUBLISH payload
+#define TYPE_INT 0
+#define TYPE_SHORT_REAL 1
+#define TYPE_FLOAT 2
+#define TYPE_STRING 3
+#define NO_DATA_TYPE 0xff	// the payload stops after the topic (or the type is unknown)
+
+#define FILTER_SIZE 256		// longest filter text, terminator included
+
+// comparisons of a compiled filter
+#define FILTER_INSIDE 0		// number in [low, high]
+#define FILTER_OUTSIDE 1	// number not in [low, high]
+#define FILTER_EQUAL 2		// text equal to the operand
+#define FILTER_DIFFERENT 3	// text different from the operand
+#define FILTER_PREFIX 4		// text starting with the operand
+#define FILTER_CONTAINS 5	// text containing the operand
+
+/*
+ * Predicate over the value of a message, as "<TYPE> <OP> <OPERAND>...", e.g.
+ * "INT > 100", "FLOAT outside -1.5 1.5" or "STRING prefix ALARM". It is
+ * compiled once, when the subscription is made: every numeric comparison
+ * becomes a closed interval and messages of another type never match.
+ */
+struct content_filter {
+	u_int8_t data_type;	// of the matched messages, NO_DATA_TYPE if every message matches
+	u_int8_t op;
+	double low, high;	// bounds of the numeric comparisons
+	string text;		// operand of the text comparisons
+};
+
+// value of a message, decoded once for all the filters that test it
+struct filter_value {
+	u_int8_t data_type;	// NO_DATA_TYPE if the value is truncated
+	double number;
+	string_view text;
+};
+
+bool compile_filter(string_view text, struct content_filter *filter);
+bool same_filter(const struct content_filter *first, const struct content_filter *second);
+void read_filter_value(const char *payload, u_int32_t length, struct filter_value *value);
+bool filter_matches(const struct content_filter *filter, const struct filter_value *value);
+
+#endif
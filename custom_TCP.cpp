@@ -1,161 +1,1021 @@
+#include <errno.h>
+#include <endian.h>
+#include <algorithm>
 #include <unordered_map>
 #include "custom_TCP.h"
+#include "event_loop.h"
+#include "uring.h"
 
 using namespace std;
 
-// helper, compute 10 ^ power
-uint32_t power_of_ten(u_int8_t power) {
-	uint32_t result = 1;
-	while (power > 0) {
-		result *= 10;
-		power--;
+// helper, take a topic out of the retained list of the broker
+static void unlink_retained(struct broker *broker, struct topic *topic) {
+	if (topic->older != NULL)
+		topic->older->newer = topic->newer;
+	else
+		broker->oldest_retained = topic->newer;
+	if (topic->newer != NULL)
+		topic->newer->older = topic->older;
+	else
+		broker->newest_retained = topic->older;
+	topic->older = topic->newer = NULL;
+}
+
+// helper, forget the retained message of a topic
+static void drop_retained(struct broker *broker, struct topic *topic) {
+	if (topic->retained == NULL)
+		return;
+	unlink_retained(broker, topic);
+	broker->retained_bytes -= topic->retained->length;
+	release_msg(topic->retained);
+	topic->retained = NULL;
+	set_stat(&broker->stats, STAT_RETAINED_BYTES, broker->retained_bytes);
+}
+
+/**
+	@brief Function that makes a message the retained message of its topic.
+		   When the retained messages exceed the limit of the broker, those
+		   of the topics updated least recently are dropped.
+
+	@param broker The broker state.
+	@param topic The topic of the message (with subscribers).
+	@param buf The encoded message.
+**/
+static void retain_message(struct broker *broker, struct topic *topic, struct msg_buf *buf) {
+	if (buf->length > broker->retain_max_bytes)
+		return;
+
+	drop_retained(broker, topic);
+	topic->retained = hold_msg(buf);
+	broker->retained_bytes += buf->length;
+	topic->older = broker->newest_retained;
+	if (broker->newest_retained != NULL)
+		broker->newest_retained->newer = topic;
+	else
+		broker->oldest_retained = topic;
+	broker->newest_retained = topic;
+
+	while (broker->retained_bytes > broker->retain_max_bytes)
+		drop_retained(broker, broker->oldest_retained);
+	set_stat(&broker->stats, STAT_RETAINED_BYTES, broker->retained_bytes);
+}
+
+/*
+ * helper, count a subscription that was added or removed. The other shards
+ * (which then only hand this shard the messages it needs) and the peer
+ * brokers are told when a topic or pattern gets its first subscription on
+ * this shard and when it loses its last one.
+ */
+static void note_interest(struct broker *broker, u_int8_t op, string_view name) {
+	unordered_map <string, u_int32_t>::iterator iter;
+
+	if (!broker->federated && !broker->sharded)
+		return;
+	if (op == INTEREST_ADD) {
+		if (broker->interest[string(name)]++ > 0)
+			return;
+	} else {
+		iter = broker->interest.find(string(name));
+		if (iter == broker->interest.end() || --(*iter).second > 0)
+			return;
+		broker->interest.erase(iter);
+	}
+	broker->interest_changes.push_back(interest_change());
+	broker->interest_changes.back().name.assign(name);
+	broker->interest_changes.back().op = op;
+}
+
+// helper, rebuild the cached matches of a topic, after its subscriptions or the patterns changed
+static void resolve_topic(struct broker *broker, struct topic *topic) {
+	topic->matches = topic->subscriptions;
+	match_topic(&broker->patterns, topic->name, topic->matches);
+	merge_subscriptions(topic->matches);
+
+	// messages are retained only for topics with subscribers
+	if (topic->matches.empty())
+		drop_retained(broker, topic);
+}
+
+/**
+	@brief Function that returns the handle of a topic, interning the topic
+		   the first time it is subscribed (or published, while there are
+		   wildcard subscriptions).
+
+	@param broker The broker state.
+	@param name Name of the topic.
+	@param create True if a new topic may be interned.
+
+	@return u_int32_t The handle of the topic, NO_HANDLE if the topic is not
+					  known and create is false.
+**/
+static u_int32_t intern_topic(struct broker *broker, string_view name, bool create) {
+	unordered_map <string_view, u_int32_t>::iterator iter = broker->topics_table.find(name);
+
+	if (iter != broker->topics_table.end())
+		return (*iter).second;
+	if (!create)
+		return NO_HANDLE;
+
+	// the key of the table points to the name stored in the topic
+	broker->topics.emplace_back();
+	broker->topics.back().name.assign(name);
+	broker->topics.back().retained = NULL;
+	broker->topics.back().older = broker->topics.back().newer = NULL;
+	broker->topics_table[broker->topics.back().name] = broker->topics.size() - 1;
+	resolve_topic(broker, &broker->topics.back());
+	return broker->topics.size() - 1;
+}
+
+// helper, update the cached matches of the topics matched by a pattern that was (un)subscribed
+static void resolve_pattern(struct broker *broker, string_view pattern) {
+	deque <struct topic>::iterator iter;
+
+	for (iter = broker->topics.begin(); iter != broker->topics.end(); iter++) {
+		if (pattern_matches(pattern, (*iter).name))
+			resolve_topic(broker, &(*iter));
 	}
-	return result;
 }
 
-// helper, print a float number in the required format
-void print_float(uint32_t initial, u_int8_t exponent, u_int8_t sign) {
-	uint32_t pow = power_of_ten(exponent), before_dot, after_dot;
-	char after_dot_string[10];
-	
-	before_dot = initial / pow;
-	after_dot = initial % pow;
+/**
+	@brief Function that finds the topic of an encoded (v1) PUBLISH message.
 
-	if (sign)
-		printf("-");
-	printf("%u", before_dot);
+	@param frame The encoded message.
+	@return string_view The topic, in place.
+**/
+string_view frame_topic(struct msg_buf *frame) {
+	struct TCP_msg *msg = (struct TCP_msg *) frame->data;
+	int topic_length = frame->length - HEADER_SIZE < TOPIC_SIZE ? frame->length - HEADER_SIZE : TOPIC_SIZE;
 
-	// don't print "." if we have an intege
-	if (after_dot == 0) {
-		printf("\n");
+	return string_view(msg->payload, strnlen(msg->payload, topic_length));
+}
+
+// helper, keep a message queued for a resumable client, until it was sent and left the resume window
+static void remember_frame(struct broker *broker, Subscriber subscriber, struct msg_buf *frame, u_int32_t topic) {
+	subscriber->resume_window.push_back(resume_frame());
+	subscriber->resume_window.back().frame = hold_msg(frame);
+	subscriber->resume_window.back().queue_seq = last_seq(&subscriber->queue);
+	subscriber->resume_window.back().topic = topic;
+	subscriber->resume_bytes += frame->length;
+	subscriber->sequence++;
+
+	// the window is counted in v1 bytes, whatever the protocol; the messages still waiting in the send queue are always kept
+	while (subscriber->resume_bytes > broker->resume_bytes
+			&& subscriber->resume_window.front().queue_seq < subscriber->queue.first_seq) {
+		subscriber->resume_bytes -= subscriber->resume_window.front().frame->length;
+		release_msg(subscriber->resume_window.front().frame);
+		subscriber->resume_window.pop_front();
+	}
+}
+
+// helper, order the resume window by the position of the frames in the send queue
+static bool before_queue_seq(const struct resume_frame &entry, u_int64_t queue_seq) {
+	return entry.queue_seq < queue_seq;
+}
+
+// helper, replace the kept message of a frame of the send queue that was conflated in place
+static void replace_remembered(Subscriber subscriber, u_int64_t queue_seq, struct msg_buf *frame) {
+	deque <struct resume_frame>::iterator iter = lower_bound(subscriber->resume_window.begin(),
+								subscriber->resume_window.end(), queue_seq, before_queue_seq);
+
+	if (iter == subscriber->resume_window.end() || (*iter).queue_seq != queue_seq)
+		return;
+	subscriber->resume_bytes += frame->length;
+	subscriber->resume_bytes -= (*iter).frame->length;
+	release_msg((*iter).frame);
+	(*iter).frame = hold_msg(frame);
+}
+
+// helper, drop the messages kept for a client that does not resume (or whose session is released)
+static void forget_frames(Subscriber subscriber) {
+	deque <struct resume_frame>::iterator iter;
+
+	for (iter = subscriber->resume_window.begin(); iter != subscriber->resume_window.end(); iter++)
+		release_msg((*iter).frame);
+	subscriber->resume_window.clear();
+	subscriber->resume_bytes = 0;
+}
+
+/**
+	@brief Function that queues a PUBLISH message in the protocol of the
+		   subscriber. v2 subscribers get the alias of the topic (its handle
+		   plus one) announced before its first message on the connection.
+
+	@param broker The broker state.
+	@param subscriber The destination subscriber.
+	@param frame The v1 frame of the message.
+	@param topic Handle of the topic, NO_HANDLE if the topic is not interned.
+	@param v2_frame The v2 frame of the message, encoded by the first v2
+					subscriber and shared by the next ones (NULL before).
+**/
+static void push_publish(struct broker *broker, Subscriber subscriber, struct msg_buf *frame,
+						u_int32_t topic, struct msg_buf **v2_frame) {
+	struct msg_buf *announcement;
+
+	if (subscriber->protocol == PROTOCOL_V1) {
+		push_frame(&subscriber->queue, frame);
+		if (subscriber->resumable)
+			remember_frame(broker, subscriber, frame, topic);
 		return;
 	}
-	else {
-		printf(".");
-		sprintf(after_dot_string, "%u", after_dot);
-		int i = 0;
-		while (i < exponent - strlen(after_dot_string)) {
-			printf("0");
-			i++;
+
+	if (topic != NO_HANDLE) {
+		if (topic >= subscriber->announced.size())
+			subscriber->announced.resize(topic + 1, false);
+		if (!subscriber->announced[topic]) {
+			announcement = encode_v2_alias(topic + 1, broker->topics[topic].name);
+			push_frame(&subscriber->queue, announcement);
+			release_msg(announcement);
+			subscriber->announced[topic] = true;
 		}
-		printf("%u\n", after_dot);
-	}    
+	}
+
+	if (*v2_frame == NULL)
+		*v2_frame = encode_v2_publish(frame, topic == NO_HANDLE ? NO_ALIAS : topic + 1);
+	push_frame(&subscriber->queue, *v2_frame);
+	if (subscriber->resumable)
+		remember_frame(broker, subscriber, frame, topic);
+}
+
+// helper, true if the client of a socket runs on the same host as the broker
+static bool is_local_peer(int socket) {
+	struct sockaddr_in local, peer;
+	socklen_t local_length = sizeof(local), peer_length = sizeof(peer);
+
+	if (getsockname(socket, (struct sockaddr *) &local, &local_length) == -1
+			|| getpeername(socket, (struct sockaddr *) &peer, &peer_length) == -1)
+		return false;
+	return local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+// helper, give a local subscriber a slot in the shared memory ring of the broker (created on first use)
+static void attach_shared_memory(struct broker *broker, Subscriber subscriber) {
+	if (broker->shm_bytes == 0 || !is_local_peer(subscriber->socket))
+		return;
+	if (broker->shm == NULL && (broker->shm = create_shm_ring(broker->shm_bytes)) == NULL) {
+		WARNING(1, "Shared memory ring: CREATE error, using the sockets\n");
+		broker->shm_bytes = 0;
+		return;
+	}
+	subscriber->shm_slot = attach_reader(broker->shm);
+	if (subscriber->shm_slot != NO_SHM_SLOT)
+		broker->shm_readers[subscriber->shm_slot] = subscriber;
+}
+
+// helper, keep in the resume window only the messages a reconnecting client did not receive
+static void rewind_window(Subscriber subscriber, u_int64_t resume) {
+	u_int64_t first = subscriber->sequence - subscriber->resume_window.size();
+
+	// a new client continues the numbers of the session
+	if (resume == NO_RESUME) {
+		forget_frames(subscriber);
+		return;
+	}
+
+	// the broker does not know the messages of the client (it was restarted), the client keeps its numbers
+	if (resume >= subscriber->sequence) {
+		forget_frames(subscriber);
+		subscriber->sequence = resume;
+		return;
+	}
+
+	// older messages were received; the next ones are numbered again when they are queued
+	for (; first < resume; first++) {
+		subscriber->resume_bytes -= subscriber->resume_window.front().frame->length;
+		release_msg(subscriber->resume_window.front().frame);
+		subscriber->resume_window.pop_front();
+	}
+	subscriber->sequence = first;
 }
 
 /**
-	@brief Function that creates a subscribe message (used by clients).
+	@brief Function that sets the protocol and the transport of a connection,
+		   as requested in the ID message of the client. A v2 client gets an
+		   ID message (in the v1 framing) with the accepted version, then only
+		   v2 frames. A client that asks for shared memory also gets the
+		   transport granted and, for TRANSPORT_SHM, its slot and the name of
+		   the ring. A client that numbers its messages gets the number of
+		   the next one, then the messages of its previous connection that it
+		   did not receive (as far as the resume window goes back), before
+		   its SF backlog; NO_RESUME if it reads the shared memory ring,
+		   whose records are not numbered. Other v1 clients do not get an
+		   answer.
 
-	@param SF 1 for store-and-forward activated, 0 otherwise.
-	@param id The ID of the client that generates this message. 
-	@param topic Name of the subscribed topic.
-	@param msg Pointer to the structure that will store this message.
-**/ 
-void create_subscribe_msg(u_int8_t SF, char *id, char* topic, struct TCP_msg *msg) {
-	memset(msg, 0, sizeof(struct TCP_msg));
-	msg->length = htonl(HEADER_SIZE + strlen(topic));
-	if (SF == 0)
-		msg->type = SUBSCRIBE;
-	else
-		msg->type = SUBSCRIBE_SF;
-	memcpy(msg->id, id, strlen(id));
-	memcpy(msg->payload, topic, strlen(topic));
+	@param broker The broker state.
+	@param subscriber The subscriber, already connected.
+	@param msg The ID message.
+**/
+static void accept_protocol(struct broker *broker, Subscriber subscriber, struct TCP_msg *msg) {
+	u_int32_t length = ntohl(msg->length), answer_length = HEADER_SIZE + 1, name = ANSWER_SEQUENCE;
+	bool shared = length >= HEADER_SIZE + 2 && msg->payload[1] == TRANSPORT_SHM;
+	bool numbered = length >= HEADER_SIZE + RESUME_OFFSET + sizeof(u_int64_t);
+	deque <struct resume_frame> replay;
+	deque <struct resume_frame>::iterator iter;
+	struct msg_buf *answer, *v2_frame;
+	struct TCP_msg *answer_msg;
+	u_int64_t resume;
+
+	subscriber->announced.clear();
+	subscriber->protocol = length > HEADER_SIZE && (u_int8_t) msg->payload[0] >= PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+	if (shared)
+		attach_shared_memory(broker, subscriber);
+
+	// the records of the shared memory ring are not numbered, a client that reads them does not resume
+	subscriber->resumable = numbered && subscriber->shm_slot == NO_SHM_SLOT;
+	if (subscriber->resumable) {
+		memcpy(&resume, msg->payload + RESUME_OFFSET, sizeof(resume));
+		rewind_window(subscriber, be64toh(resume));
+		replay.swap(subscriber->resume_window);
+		subscriber->resume_bytes = 0;
+	} else {
+		forget_frames(subscriber);
+	}
+	if (subscriber->protocol == PROTOCOL_V1 && !shared && !numbered)
+		return;
+
+	if (shared || numbered)
+		answer_length++;
+	if (subscriber->shm_slot != NO_SHM_SLOT || numbered)
+		answer_length++;
+	if (numbered)
+		answer_length += sizeof(resume);
+	if (subscriber->shm_slot != NO_SHM_SLOT)
+		answer_length += strlen(broker->shm->name) + 1;
+	answer = alloc_msg(answer_length);
+	answer_msg = (struct TCP_msg *) answer->data;
+	memset(answer_msg, 0, answer_length);
+	answer_msg->length = htonl(answer_length);
+	answer_msg->type = ID;
+	answer_msg->payload[0] = subscriber->protocol;
+	if (shared || numbered)
+		answer_msg->payload[1] = subscriber->shm_slot == NO_SHM_SLOT ? TRANSPORT_TCP : TRANSPORT_SHM;
+	if (subscriber->shm_slot != NO_SHM_SLOT)
+		answer_msg->payload[2] = subscriber->shm_slot;
+	if (numbered) {
+		resume = htobe64(subscriber->resumable ? subscriber->sequence : NO_RESUME);
+		memcpy(answer_msg->payload + ANSWER_SEQUENCE, &resume, sizeof(resume));
+		name += sizeof(resume);
+	}
+	if (subscriber->shm_slot != NO_SHM_SLOT)
+		strcpy(answer_msg->payload + name, broker->shm->name);
+	push_frame(&subscriber->queue, answer);
+	release_msg(answer);
+
+	// the kept messages are queued again, in order, with the numbers they had
+	for (iter = replay.begin(); iter != replay.end(); iter++) {
+		v2_frame = NULL;
+		push_publish(broker, subscriber, (*iter).frame, (*iter).topic, &v2_frame);
+		if (v2_frame != NULL)
+			release_msg(v2_frame);
+		release_msg((*iter).frame);
+	}
+}
+
+// helper, keep the newest message of a conflated topic for a subscriber that cannot get it yet
+static void hold_back(Subscriber subscriber, struct msg_buf *msg, u_int32_t topic) {
+	struct msg_buf *&held = subscriber->conflated_backlog[topic];
+
+	if (held != NULL)
+		release_msg(held);
+	held = hold_msg(msg);
+}
+
+// helper, drop the messages held back for a subscriber whose session is released
+static void drop_held_back(Subscriber subscriber) {
+	unordered_map <u_int32_t, struct msg_buf *>::iterator iter;
+
+	for (iter = subscriber->conflated_backlog.begin(); iter != subscriber->conflated_backlog.end(); iter++)
+		release_msg((*iter).second);
+	subscriber->conflated_backlog.clear();
 }
 
 /**
-	@brief Function that creates a subscribe message (used by clients).
+	@brief Function that conflates a message of a topic for a subscriber: an
+		   older message of the same topic, held back or still waiting in the
+		   send queue (and not being written yet), is replaced in place.
 
-	@param id The ID of the client that generates this message. 
-	@param topic Name of the subscribed topic.
-	@param msg Pointer to the structure that will store this message.
-**/ 
-void create_unsubscribe_msg(char *id, char* topic, struct TCP_msg *msg) {
-	memset(msg, 0, sizeof(struct TCP_msg));
-	msg->length = htonl(HEADER_SIZE + strlen(topic));
-	msg->type = UNSUBSCRIBE;
-	memcpy(msg->id, id, strlen(id));
-	memcpy(msg->payload, topic, strlen(topic));
+	@param subscriber The destination subscriber.
+	@param msg The (shared) encoded message.
+	@param topic Handle of the topic of the message.
+	@param v2_frame The shared v2 frame of the message (see push_publish()).
+
+	@return bool True if the message replaced an older one.
+**/
+static bool conflate_message(Subscriber subscriber, struct msg_buf *msg, u_int32_t topic,
+							struct msg_buf **v2_frame) {
+	unordered_map <u_int32_t, struct msg_buf *>::iterator held = subscriber->conflated_backlog.find(topic);
+	unordered_map <u_int32_t, u_int64_t>::iterator queued;
+	struct msg_buf *frame = msg;
+
+	if (held != subscriber->conflated_backlog.end()) {
+		release_msg((*held).second);
+		(*held).second = hold_msg(msg);
+		return true;
+	}
+
+	queued = subscriber->conflated_frames.find(topic);
+	if (queued == subscriber->conflated_frames.end())
+		return false;
+
+	// the alias of the topic was announced with the older message
+	if (subscriber->protocol == PROTOCOL_V2) {
+		if (*v2_frame == NULL)
+			*v2_frame = encode_v2_publish(msg, topic + 1);
+		frame = *v2_frame;
+	}
+	if (replace_frame(&subscriber->queue, (*queued).second,
+					subscriber->sending == NULL ? 0 : subscriber->sending->nr_frames, frame)) {
+		if (subscriber->resumable)
+			replace_remembered(subscriber, (*queued).second, msg);
+		return true;
+	}
+
+	// the older message was sent (or is being sent)
+	subscriber->conflated_frames.erase(queued);
+	return false;
 }
 
 /**
-	@brief Function that creates an ID type message (used by clients
-		   imediately after connecting to a server).
-	
-	@param id The ID of the client that generates this message. 
-	@param msg Pointer to the structure that will store this message.
-**/ 
-void create_id_msg(char *id, struct TCP_msg *msg) {
-	msg->length = htonl(18);
-	msg->type = ID;
-	memcpy(msg->id, id, strlen(id));
+	@brief Function that registers the socket of a newly identified subscriber
+		   in the event loop of the broker.
+
+	@param broker The broker state.
+	@param subscriber The subscriber that owns the socket.
+	@param socket The socket.
+**/
+static void register_client_socket(struct broker *broker, Subscriber subscriber, int socket) {
+	attach_socket(&broker->sessions, subscriber, socket);
+	subscriber->connected = true;
+	subscriber->closing = false;
+	subscriber->output_mode = OUTPUT_LATENCY;
+	subscriber->shm_overrun = false;
+	watch_fd(broker->epoll_fd, socket, EPOLLIN);
+	count_stat(&broker->stats, STAT_SUBSCRIBERS, 1);
 }
 
 /**
-	@brief Function for sending a message on the specified socket, using TCP.
-	
-	@param socket The socket used for message sending.
-	@param msg Pointer to the structure containing the message to be sent.
+	@brief Function that closes a subscriber socket, removing it from the event
+		   loop and dropping the messages still waiting in its send queue. The
+		   session of a subscriber without subscriptions is released.
+
+	@param broker The broker state.
+	@param socket The socket to be closed.
 **/
-void send_msg(int socket, struct TCP_msg *msg) {
-	int total_sent = 0, bytes_sent;
+void close_client_socket(struct broker *broker, int socket) {
+	Subscriber subscriber = session_by_fd(&broker->sessions, socket);
 
-	// make sure we send exactly the required number of bytes
-	while (total_sent < ntohl(msg->length)) {
-		bytes_sent = send(socket, msg + total_sent, ntohl(msg->length) - total_sent, 0);
-		total_sent += bytes_sent;
+	if (subscriber != NULL) {
+		count_stat(&broker->stats, STAT_SUBSCRIBERS, (u_int64_t) -1);
+		subscriber->connected = false;
+		subscriber->want_write = false;
+		subscriber->lingering = false;
+		subscriber->conflated_frames.clear();
+		if (subscriber->shm_slot != NO_SHM_SLOT) {
+			// records the reader did not claim are lost, like the send queue
+			detach_reader(broker->shm, subscriber->shm_slot);
+			broker->shm_readers[subscriber->shm_slot] = NULL;
+			broker->shm_recipients &= ~(1ULL << subscriber->shm_slot);
+			subscriber->shm_slot = NO_SHM_SLOT;
+		}
+		if (subscriber->sending != NULL) {
+			// the write in flight keeps its frames until it completes
+			subscriber->sending->subscriber = NULL;
+			subscriber->sending = NULL;
+		}
+		clear_queue(&subscriber->queue);
+		free_reader(&subscriber->reader);
+		detach_socket(&broker->sessions, socket);
+		if (subscriber->nr_subscriptions == 0) {
+			drop_held_back(subscriber);
+			forget_frames(subscriber);
+			release_session(&broker->sessions, subscriber);
+		}
 	}
+	unwatch_fd(broker->epoll_fd, socket);
+	close(socket);
 }
 
 /**
-	@brief Function for printing a message. Used by client when receiving
-		   PUBLISH type messages from the server,
-	
-	@param msg Pointer to the structure containing the message to be printed.
+	@brief Function that moves messages from the SF backlog (stored in the SF
+		   log) of a connected subscriber to its send queue, without exceeding
+		   the queue limit. Once the log is replayed, the messages held back
+		   for its conflated topics follow.
+
+	@return int Number of messages moved.
 **/
-void print_message(struct TCP_msg *msg) {
-	char topic[50], data_type, content[1500];
+static int refill_from_backlog(struct broker *broker, Subscriber subscriber) {
+	unordered_map <u_int32_t, struct msg_buf *>::iterator held;
+	struct msg_buf *buf, *v2_frame;
+	u_int32_t topic;
+	int moved = 0;
 
-	// Print address and port of the UDP client that generated this message.
-	printf("%s:%d - ", inet_ntoa(msg->UDP_addr), ntohs(msg->UDP_port));
+	while (subscriber->queue.bytes + sizeof(struct TCP_msg) <= broker->queue_limit
+			&& (buf = next_backlog_msg(broker->sf_log, subscriber->id)) != NULL) {
+		topic = subscriber->protocol == PROTOCOL_V1 ? NO_HANDLE : intern_topic(broker, frame_topic(buf), false);
+		v2_frame = NULL;
+		push_publish(broker, subscriber, buf, topic, &v2_frame);
 
-	// Parse and print message content in the specified format.
-	strcpy(topic, msg->payload);
-	memcpy(&data_type, msg->payload + 50, 1);
+		// the send queue holds its own references
+		if (v2_frame != NULL)
+			release_msg(v2_frame);
+		release_msg(buf);
+		moved++;
+	}
+	if (moved > 0)
+		set_stat(&broker->stats, STAT_SF_BYTES, broker->sf_log->total_bytes);
 
-	switch (data_type) {
-		case(0):
-			uint32_t received_uint;
+	if (subscriber->conflated_backlog.empty() || has_backlog(broker->sf_log, subscriber->id))
+		return moved;
+	held = subscriber->conflated_backlog.begin();
+	while (held != subscriber->conflated_backlog.end()
+			&& subscriber->queue.bytes + sizeof(struct TCP_msg) <= broker->queue_limit) {
+		v2_frame = NULL;
+		push_publish(broker, subscriber, (*held).second, (*held).first, &v2_frame);
+		subscriber->conflated_frames[(*held).first] = last_seq(&subscriber->queue);
+		if (v2_frame != NULL)
+			release_msg(v2_frame);
+		release_msg((*held).second);
+		held = subscriber->conflated_backlog.erase(held);
+		moved++;
+	}
+	return moved;
+}
 
-			memcpy(&received_uint, msg->payload + 52 , 4);
-			if (*(msg->payload + 51) == 0)
-				printf("%s - INT - %d\n", topic, ntohl(received_uint));
-			else
-				printf("%s - INT - %d\n", topic, -ntohl(received_uint));
-				break;
-		case(1):
-			printf("%s - SHORT_REAL - ", topic);
-			uint16_t received_short;
-			char string_number[10];
-			char before_dot[10], after_dot[10];
-
-			memcpy(&received_short, msg->payload + 51, 2);
-			received_short = ntohs(received_short);
-			print_float(received_short, 2, 0);
+// helper, hand the send queue of a subscriber (refilled from its SF backlog) to the io_uring of the broker
+static void submit_subscriber(struct broker *broker, Subscriber subscriber) {
+	if (subscriber->queue.frames.empty())
+		refill_from_backlog(broker, subscriber);
+	if (subscriber->queue.frames.empty())
+		return;
+
+	// a single write is in flight per socket, the next one starts when it completes
+	subscriber->sending = send_queue(broker->ring, subscriber->socket, &subscriber->queue);
+	subscriber->sending->subscriber = subscriber;
+	subscriber->want_write = true;
+}
+
+/**
+	@brief Function that writes the send queue of a subscriber on its socket.
+		   When the socket is full, EPOLLOUT is armed and the queue is flushed
+		   again once the socket becomes writable. A drained queue is refilled
+		   from the SF backlog of the subscriber, REPLAY_REFILLS times at most:
+		   the rest of a long backlog waits for the next EPOLLOUT. With io_uring, the queue is
+		   submitted as a write instead, continued by complete_send().
+
+	@param broker The broker state.
+	@param subscriber A connected subscriber.
+**/
+void flush_subscriber(struct broker *broker, Subscriber subscriber) {
+	int ret, refills = 0;
+
+	record_value(&broker->stats, HIST_QUEUE_DEPTH, subscriber->queue.bytes);
+	if (broker->ring != NULL) {
+		if (subscriber->sending != NULL)
+			return;
+		if (subscriber->want_write) {
+			rewatch_fd(broker->epoll_fd, subscriber->socket, EPOLLIN);
+			subscriber->want_write = false;
+		}
+		submit_subscriber(broker, subscriber);
+		return;
+	}
+
+	while (1) {
+		ret = flush_queue(subscriber->socket, &subscriber->queue, &broker->stats);
+		if (ret == QUEUE_ERROR) {
+			printf("Client %s disconnected.\n", subscriber->id);
+			close_client_socket(broker, subscriber->socket);
+			return;
+		}
+		if (ret == QUEUE_PENDING) {
+			if (!subscriber->want_write) {
+				rewatch_fd(broker->epoll_fd, subscriber->socket, EPOLLIN | EPOLLOUT);
+				subscriber->want_write = true;
+			}
+			return;
+		}
+
+		// a long backlog is replayed a few queues at a time, the other sockets get their turn in between
+		if (refills == REPLAY_REFILLS && has_backlog(broker->sf_log, subscriber->id)) {
+			if (!subscriber->want_write) {
+				rewatch_fd(broker->epoll_fd, subscriber->socket, EPOLLIN | EPOLLOUT);
+				subscriber->want_write = true;
+			}
+			return;
+		}
+		if (refill_from_backlog(broker, subscriber) == 0)
 			break;
-		case(2):
-			printf("%s - FLOAT - ", topic);
-			uint32_t received_int;
-			uint8_t power, sign;
-
-			memcpy(&received_int, msg->payload + 52, 4);
-			received_int = ntohl(received_int);
-			memcpy(&power, msg->payload + 56, 1);
-			sign = *(msg->payload + 51);
-			print_float(received_int, power, sign);
+		refills++;
+	}
+
+	if (subscriber->want_write) {
+		rewatch_fd(broker->epoll_fd, subscriber->socket, EPOLLIN);
+		subscriber->want_write = false;
+	}
+}
+
+/**
+	@brief Function that handles the completion of an io_uring write: the
+		   bytes sent leave the send queue and the rest of the queue (or of
+		   the SF backlog) is submitted. A socket that is full arms EPOLLOUT,
+		   as in flush_subscriber().
+
+	@param broker The broker state.
+	@param send The completed write.
+	@param result Bytes written, or a negative error code.
+**/
+void complete_send(struct broker *broker, struct uring_send *send, int result) {
+	Subscriber subscriber = send->subscriber;
+
+	release_send(broker->ring, send);
+	// the subscriber disconnected while the write was in flight
+	if (subscriber == NULL)
+		return;
+
+	subscriber->sending = NULL;
+	subscriber->want_write = false;
+	if (result == -EAGAIN || result == -EINTR) {
+		rewatch_fd(broker->epoll_fd, subscriber->socket, EPOLLIN | EPOLLOUT);
+		subscriber->want_write = true;
+		return;
+	}
+	if (result < 0) {
+		printf("Client %s disconnected.\n", subscriber->id);
+		close_client_socket(broker, subscriber->socket);
+		return;
+	}
+
+	consume_queue(&subscriber->queue, result, &broker->stats);
+	submit_subscriber(broker, subscriber);
+}
+
+/**
+	@brief Function that queues a message for a connected subscriber. If the
+		   send queue of the subscriber is full, the overflow policy of the
+		   broker decides if the message is dropped, diverted to the SF backlog
+		   or if the subscriber is disconnected.
+
+	@param broker The broker state.
+	@param subscriber The destination subscriber.
+	@param fs True if the subscription has store-and-forward enabled.
+	@param conflate True if the subscription keeps only the newest waiting
+					message of the topic.
+	@param msg The (shared) encoded message to be sent.
+	@param topic Handle of the topic of the message, NO_HANDLE if it is not interned.
+	@param v2_frame The shared v2 frame of the message (see push_publish()).
+
+	@return bool True if the message has to be stored in the SF backlog of the
+				 subscriber instead.
+**/
+static bool queue_message(struct broker *broker, Subscriber subscriber, bool fs, bool conflate,
+						struct msg_buf *msg, u_int32_t topic, struct msg_buf **v2_frame) {
+	bool backlog;
+
+	// a subscriber that is being disconnected only keeps its SF messages, as if it was not connected
+	if (subscriber->closing) {
+		if (!fs || !conflate || topic == NO_HANDLE)
+			return fs;
+		hold_back(subscriber, msg, topic);
+		return false;
+	}
+
+	/*
+	 * a reader of the shared memory ring is only marked, the message is
+	 * written once for all of them; SF messages still wait behind the backlog
+	 */
+	if (subscriber->shm_slot != NO_SHM_SLOT && !(fs && has_backlog(broker->sf_log, subscriber->id))) {
+		broker->shm_recipients |= 1ULL << subscriber->shm_slot;
+		count_stat(&broker->stats, STAT_DELIVERIES, 1);
+		return false;
+	}
+
+	// a conflated topic has at most one waiting message, whatever the size of the queue
+	conflate = conflate && topic != NO_HANDLE;
+	if (conflate && conflate_message(subscriber, msg, topic, v2_frame))
+		return false;
+
+	/*
+	 * messages of SF subscriptions (and all those of a reader whose ring was
+	 * taken back) wait behind the backlog that is still being replayed, so
+	 * that they are delivered in order; conflated ones
+	 * are held back instead of being added to the SF log
+	 */
+	backlog = (fs || subscriber->shm_overrun) && has_backlog(broker->sf_log, subscriber->id);
+
+	if (!backlog && subscriber->queue.bytes + msg->length > broker->queue_limit) {
+		if (broker->overflow_policy == OVERFLOW_DISCONNECT) {
+			/*
+			 * the socket is closed once the message is delivered to every
+			 * subscriber, by flush_dirty_subscribers()
+			 */
+			count_stat(&broker->stats, STAT_OVERFLOW_DISCONNECTS, 1);
+			printf("Client %s disconnected (send queue full).\n", subscriber->id);
+			subscriber->closing = true;
+			if (!subscriber->dirty) {
+				subscriber->dirty = true;
+				broker->dirty_subscribers.push_back(subscriber);
+			}
+			backlog = fs;
+		} else {
+			if (broker->overflow_policy != OVERFLOW_SF || !fs)
+				count_stat(&broker->stats, STAT_DROPPED, 1);
+			backlog = broker->overflow_policy == OVERFLOW_SF && fs;
+		}
+		if (!backlog)
+			return false;
+	}
+
+	if (backlog) {
+		if (!conflate)
+			return true;
+		hold_back(subscriber, msg, topic);
+		return false;
+	}
+
+	/*
+	 * the queue is written after the whole batch of messages is routed,
+	 * unless the socket is already waiting to become writable
+	 */
+	push_publish(broker, subscriber, msg, topic, v2_frame);
+	if (conflate)
+		subscriber->conflated_frames[topic] = last_seq(&subscriber->queue);
+	count_stat(&broker->stats, STAT_DELIVERIES, 1);
+	if (!subscriber->want_write && !subscriber->dirty) {
+		subscriber->dirty = true;
+		broker->dirty_subscribers.push_back(subscriber);
+	}
+	return false;
+}
+
+/**
+	@brief Function that takes back the slot of a reader that fell a whole
+		   ring behind, before its records are overwritten. The records it
+		   did not claim are moved to its SF backlog, which is replayed on its
+		   socket, like every next message of the connection.
+
+	@param broker The broker state.
+	@param subscriber The reader.
+	@param current The message being written in the ring, NULL if the reader
+				   is not one of its recipients.
+**/
+static void overrun_reader(struct broker *broker, Subscriber subscriber, struct msg_buf *current) {
+	vector <const char *> recipient(1, subscriber->id);
+	u_int64_t position = detach_reader(broker->shm, subscriber->shm_slot);
+	struct msg_buf *buf;
+	const char *frame;
+	u_int32_t length;
+
+	while (position != SHM_DETACHED && next_record(broker->shm, &position, subscriber->shm_slot, &frame, &length)) {
+		buf = alloc_msg(length);
+		memcpy(buf->data, frame, length);
+		append_sf_record(broker->sf_log, recipient, buf);
+		release_msg(buf);
+	}
+	if (current != NULL)
+		append_sf_record(broker->sf_log, recipient, current);
+	set_stat(&broker->stats, STAT_SF_BYTES, broker->sf_log->total_bytes);
+	count_stat(&broker->stats, STAT_SHM_OVERRUNS, 1);
+
+	broker->shm_readers[subscriber->shm_slot] = NULL;
+	subscriber->shm_slot = NO_SHM_SLOT;
+	subscriber->shm_overrun = true;
+	if (!subscriber->want_write && !subscriber->dirty) {
+		subscriber->dirty = true;
+		broker->dirty_subscribers.push_back(subscriber);
+	}
+}
+
+/**
+	@brief Function that writes a message in the shared memory ring, once for
+		   all the readers marked by queue_message(). Readers whose unread
+		   records would be overwritten are taken back first.
+
+	@param broker The broker state.
+	@param buf The encoded message.
+**/
+static void publish_shm(struct broker *broker, struct msg_buf *buf) {
+	u_int64_t lagging = lagging_readers(broker->shm, buf->length), recipients = broker->shm_recipients;
+	int slot;
+
+	broker->shm_recipients = 0;
+	while (lagging != 0) {
+		slot = __builtin_ctzll(lagging);
+		lagging &= lagging - 1;
+		overrun_reader(broker, broker->shm_readers[slot], recipients & (1ULL << slot) ? buf : NULL);
+		recipients &= ~(1ULL << slot);
+	}
+	if (recipients != 0) {
+		write_record(broker->shm, buf->data, buf->length, recipients);
+		count_stat(&broker->stats, STAT_SHM_RECORDS, 1);
+	}
+}
+
+// helper, queue a copy of the retained message of a topic, so its age does not count as a delay of the broker
+static void queue_retained(struct broker *broker, Subscriber subscriber, u_int32_t topic,
+						const struct subscription *subscription) {
+	struct msg_buf *retained = broker->topics[topic].retained, *copy, *v2_frame = NULL;
+	struct filter_value value;
+
+	read_filter_value(((struct TCP_msg *) retained->data)->payload, retained->length - HEADER_SIZE, &value);
+	if (!filter_matches(&subscription->filter, &value))
+		return;
+
+	copy = alloc_msg(retained->length);
+	memcpy(copy->data, retained->data, retained->length);
+	queue_message(broker, subscriber, false, subscription->conflate, copy, topic, &v2_frame);
+	if (broker->shm_recipients != 0)
+		publish_shm(broker, copy);
+	if (v2_frame != NULL)
+		release_msg(v2_frame);
+	release_msg(copy);
+}
+
+/**
+	@brief Function that sends the retained messages matched by a new
+		   subscription: the one of the subscribed topic, or those of every
+		   topic matched by a pattern, oldest first.
+
+	@param broker The broker state.
+	@param subscriber The subscriber, connected.
+	@param name The subscribed topic or pattern.
+	@param subscription The options of the subscription.
+**/
+static void send_retained(struct broker *broker, Subscriber subscriber, string_view name,
+						const struct subscription *subscription) {
+	struct topic *topic;
+	u_int32_t handle;
+
+	if (!is_pattern(name)) {
+		handle = intern_topic(broker, name, false);
+		if (handle != NO_HANDLE && broker->topics[handle].retained != NULL)
+			queue_retained(broker, subscriber, handle, subscription);
+	} else {
+		for (topic = broker->oldest_retained; topic != NULL && subscriber->connected; topic = topic->newer) {
+			if (pattern_matches(name, topic->name))
+				queue_retained(broker, subscriber, intern_topic(broker, topic->name, false), subscription);
+		}
+	}
+	flush_dirty_subscribers(broker);
+
+	// the topics may only have subscribers on other shards, which retain them
+	if (broker->sharded && subscriber->connected) {
+		broker->retain_requests.push_back(retain_request());
+		broker->retain_requests.back().name.assign(name);
+		broker->retain_requests.back().subscriber = subscriber->handle;
+	}
+}
+
+/**
+	@brief Function that finds the retained messages matched by a topic or
+		   a pattern (to answer a new subscription of another shard).
+
+	@param broker The broker state.
+	@param name The subscribed topic or pattern.
+	@param found Where the messages are added (without taking references).
+**/
+void find_retained(struct broker *broker, string_view name, vector <struct msg_buf *> &found) {
+	struct topic *topic;
+	u_int32_t handle;
+
+	if (!is_pattern(name)) {
+		handle = intern_topic(broker, name, false);
+		if (handle != NO_HANDLE && broker->topics[handle].retained != NULL)
+			found.push_back(broker->topics[handle].retained);
+		return;
+	}
+	for (topic = broker->oldest_retained; topic != NULL; topic = topic->newer) {
+		if (pattern_matches(name, topic->name))
+			found.push_back(topic->retained);
+	}
+}
+
+/**
+	@brief Function that sends a retained message found by another shard to
+		   the new subscription that asked for it. The message is dropped if
+		   the topic got a newer one here in the meantime (or already had
+		   one, sent when the subscription was made). Otherwise this shard
+		   retains it too, since the topic has a subscriber here now.
+
+	@param broker The broker state.
+	@param handle Handle of the subscriber.
+	@param buf The retained message.
+**/
+void adopt_retained(struct broker *broker, u_int32_t handle, struct msg_buf *buf) {
+	Subscriber subscriber = handle < broker->sessions.by_handle.size() ? broker->sessions.by_handle[handle] : NULL;
+	u_int32_t topic = intern_topic(broker, frame_topic(buf), broker->patterns.nr_patterns > 0);
+	vector <struct subscription>::iterator iter;
+
+	if (subscriber == NULL || !subscriber->connected || topic == NO_HANDLE || broker->topics[topic].retained != NULL)
+		return;
+
+	// the subscription may have been removed meanwhile
+	vector <struct subscription> &matches = broker->topics[topic].matches;
+	for (iter = matches.begin(); iter != matches.end(); iter++) {
+		if ((*iter).subscriber == handle)
 			break;
-		case(3):
-			printf("%s - STRING - %s\n", topic, msg->payload + 51);
-		default: break;
 	}
+	if (iter == matches.end())
+		return;
+
+	retain_message(broker, &broker->topics[topic], buf);
+	queue_retained(broker, subscriber, topic, &(*iter));
+}
+
+// helper, set the linger timer to the first deadline, if it is earlier than the one already set
+static void arm_linger_timer(struct broker *broker, u_int64_t deadline) {
+	if (broker->linger_armed != 0 && broker->linger_armed <= deadline)
+		return;
+	broker->linger_armed = deadline;
+	arm_timer(broker->linger_fd, deadline);
+}
+
+/**
+	@brief Function that flushes, once, every subscriber that got messages
+		   since the last call (used after routing a batch of messages).
+		   Subscribers in throughput mode are written only when they have at
+		   least coalesce_bytes queued; otherwise they linger, so that the
+		   next batches are sent with the same write, at most linger_us later.
+		   Subscribers whose send queue overflowed with OVERFLOW_DISCONNECT
+		   are disconnected here, after the messages are routed.
+
+	@param broker The broker state.
+**/
+void flush_dirty_subscribers(struct broker *broker) {
+	vector <Subscriber>::iterator iter;
+
+	for (iter = broker->dirty_subscribers.begin(); iter != broker->dirty_subscribers.end(); iter++) {
+		(*iter)->dirty = false;
+		if ((*iter)->connected && (*iter)->closing) {
+			close_client_socket(broker, (*iter)->socket);
+			continue;
+		}
+		if (!(*iter)->connected || (*iter)->want_write)
+			continue;
+
+		if ((*iter)->output_mode == OUTPUT_LATENCY || broker->linger_us == 0
+				|| (*iter)->queue.bytes >= broker->coalesce_bytes) {
+			(*iter)->lingering = false;
+			flush_subscriber(broker, *iter);
+		} else if (!(*iter)->lingering) {
+			(*iter)->lingering = true;
+			(*iter)->linger_deadline = monotonic_us() + broker->linger_us;
+			broker->lingering_subscribers.push_back(*iter);
+			arm_linger_timer(broker, (*iter)->linger_deadline);
+		}
+	}
+	broker->dirty_subscribers.clear();
+
+	// readers of the shared memory ring that got messages and went to sleep
+	if (broker->shm != NULL && broker->shm->pending_bells != 0)
+		ring_doorbells(broker->shm);
+}
+
+/**
+	@brief Function that flushes the lingering subscribers whose deadline
+		   passed (called when the linger timer expires).
+
+	@param broker The broker state.
+**/
+void flush_lingering_subscribers(struct broker *broker) {
+	vector <Subscriber> &lingering = broker->lingering_subscribers;
+	u_int64_t expirations, now = monotonic_us(), next = 0;
+	size_t i, kept = 0;
+
+	// reset the readiness of the timer
+	while (read(broker->linger_fd, &expirations, sizeof(expirations)) > 0);
+	broker->linger_armed = 0;
+
+	for (i = 0; i < lingering.size(); i++) {
+		Subscriber subscriber = lingering[i];
+
+		// subscribers flushed or disconnected in the meantime leave the list
+		if (!subscriber->lingering)
+			continue;
+		if (subscriber->linger_deadline > now) {
+			lingering[kept++] = subscriber;
+			if (next == 0 || subscriber->linger_deadline < next)
+				next = subscriber->linger_deadline;
+			continue;
+		}
+
+		subscriber->lingering = false;
+		if (subscriber->connected && !subscriber->want_write)
+			flush_subscriber(broker, subscriber);
+	}
+	lingering.resize(kept);
+
+	if (next != 0)
+		arm_linger_timer(broker, next);
+}
+
+// helper, log a subscription that is new or whose options changed (repeating one is not logged)
+static void log_subscription(struct broker *broker, Subscriber sender, string_view name,
+							const struct subscription *existing, const struct subscription *request) {
+	if (broker->state_log == NULL)
+		return;
+	if (existing != NULL && existing->fs == request->fs && existing->conflate == request->conflate
+			&& same_filter(&existing->filter, &request->filter))
+		return;
+	log_subscribe(broker->state_log, sender->id, name, request);
 }
 
 /**
@@ -163,179 +1023,460 @@ void print_message(struct TCP_msg *msg) {
 		   according to it's type.
 
 	@param msg The message to be interpreted.
-	@param topics_table Topics hashtable. Used to register new subscriptions when needed.
-	@param clients_table Subscribers hashtable.
-	@param unsent_table Unsent messages hashtable (the key is the id of each subscriber).
+	@param broker The broker state (topics and clients tables, SF log).
+	@param socket The socket where this message was received.
 
-	@return int DUPLICATE_CLIENT if a duplicate connection is identified, 0 otherwise.
+	@return int DUPLICATE_CLIENT if a duplicate connection is identified (its
+				socket, not registered, is left to the caller), 0 otherwise.
 **/ 
-int interpret_message(struct TCP_msg *msg, unordered_map <string, list <Subscription>> &topics_table,
-	unordered_map <string, Subscriber> &clients_table, unordered_map <string, list<struct TCP_msg *>> &unsent_table, int socket) {
+int interpret_message(struct TCP_msg *msg, struct broker *broker, int socket) {
+	Subscriber sender = session_by_fd(&broker->sessions, socket), subscriber;
+	string_view name(msg->payload, strnlen(msg->payload, TOPIC_SIZE));
+	vector <struct subscription>::iterator iter;
+	struct subscription request;
+	u_int32_t topic, start;
+	u_int8_t options = 0;
 
 	if (msg->type == SUBSCRIBE || msg->type == SUBSCRIBE_SF) {
-		// add a new subscription to the corresponding topic in the topics table
-		Subscription new_subscription = (Subscription) malloc(sizeof(struct subscription));
-		if (msg->type == SUBSCRIBE) {
-			new_subscription->fs = false;
+		/*
+		 * add a new subscription to the topic; the subscriber is the owner of
+		 * the socket, whatever ID the message carries
+		 */
+		if (sender == NULL)
+			return 0;
+		// the options follow the terminator of the name, if the client sent any
+		if (ntohl(msg->length) >= HEADER_SIZE + name.size() + 2)
+			options = msg->payload[name.size() + 1];
+		request.subscriber = sender->handle;
+		request.fs = msg->type == SUBSCRIBE_SF;
+		request.conflate = options & SUBSCRIBE_CONFLATE;
+		request.filter.data_type = NO_DATA_TYPE;
+
+		// the filter is compiled once; a subscription with an invalid filter is ignored
+		if (options & SUBSCRIBE_FILTER) {
+			start = name.size() + 2;
+			string_view filter(msg->payload + start, strnlen(msg->payload + start,
+								min(ntohl(msg->length) - HEADER_SIZE - start, (u_int32_t) FILTER_SIZE)));
+			if (!compile_filter(filter, &request.filter))
+				return 0;
+		}
+
+		if (is_pattern(name)) {
+			log_subscription(broker, sender, name, find_pattern(&broker->patterns, name, sender->handle), &request);
+			if (add_pattern(&broker->patterns, name, sender->handle, request.fs, request.conflate, &request.filter)) {
+				sender->nr_subscriptions++;
+				note_interest(broker, INTEREST_ADD, name);
+			}
+			resolve_pattern(broker, name);
+			send_retained(broker, sender, name, &request);
+			return 0;
+		}
+		topic = intern_topic(broker, name, true);
+		vector <struct subscription> &subscriptions = broker->topics[topic].subscriptions;
+		for (iter = subscriptions.begin(); iter != subscriptions.end(); iter++) {
+			if ((*iter).subscriber == sender->handle)
+				break;
+		}
+
+		// subscribing again only changes the options
+		log_subscription(broker, sender, name, iter == subscriptions.end() ? NULL : &*iter, &request);
+		if (iter == subscriptions.end()) {
+			subscriptions.push_back(request);
+			sender->nr_subscriptions++;
+			note_interest(broker, INTEREST_ADD, name);
 		} else {
-			new_subscription->fs = true;
+			*iter = request;
 		}
-		strcpy(new_subscription->subscriber_id, msg->id);
-		std:: string topic_name(msg->payload);
-		topics_table[topic_name].push_front(new_subscription);
+		resolve_topic(broker, &broker->topics[topic]);
+		send_retained(broker, sender, name, &request);
 	} else if (msg->type == UNSUBSCRIBE) {
-		// find and remove the corresponding topic subscription in the topics table
-		std:: string topic_name(msg->payload);
-		list<Subscription>:: iterator iter;
-		for (iter = topics_table[topic_name].begin(); iter != topics_table[topic_name].end(); iter++) {
-			if (strcmp((*iter)->subscriber_id, msg->id) == 0) {
-				topics_table[topic_name].erase(iter);
+		// find and remove the corresponding topic subscription
+		if (sender == NULL)
+			return 0;
+		if (is_pattern(name)) {
+			if (remove_pattern(&broker->patterns, name, sender->handle)) {
+				sender->nr_subscriptions--;
+				note_interest(broker, INTEREST_REMOVE, name);
+				if (broker->state_log != NULL)
+					log_unsubscribe(broker->state_log, sender->id, name);
+				resolve_pattern(broker, name);
+			}
+			return 0;
+		}
+		if ((topic = intern_topic(broker, name, false)) == NO_HANDLE)
+			return 0;
+		vector <struct subscription> &subscriptions = broker->topics[topic].subscriptions;
+		for (iter = subscriptions.begin(); iter != subscriptions.end(); iter++) {
+			if ((*iter).subscriber == sender->handle) {
+				*iter = subscriptions.back();
+				subscriptions.pop_back();
+				sender->nr_subscriptions--;
+				note_interest(broker, INTEREST_REMOVE, name);
+				if (broker->state_log != NULL)
+					log_unsubscribe(broker->state_log, sender->id, name);
+				resolve_topic(broker, &broker->topics[topic]);
 				break;
-			}         
+			}
 		}
+	} else if (msg->type == OUTPUT_MODE) {
+		// latency or throughput, for the rest of the connection
+		if (sender != NULL)
+			sender->output_mode = msg->payload[0] == OUTPUT_THROUGHPUT ? OUTPUT_THROUGHPUT : OUTPUT_LATENCY;
 	} else if (msg->type == ID){ // ID message received by server immediately after client connection
-		string s(msg->id);
-		if (clients_table.find(s) == clients_table.end()) {
+		subscriber = find_session(&broker->sessions, msg->id);
+		if (subscriber == NULL) {
 			/*
-			 * if the subscriber with this id wasn't connected before, we need
-			 * to add it to the subscribers table
+			 * if the subscriber with this id wasn't connected before (or has
+			 * no subscriptions left), a new session is created
 			 */
-			Subscriber new_subscriber = (Subscriber) calloc(1, sizeof(struct subscriber));
-			new_subscriber->connected = true;
-			new_subscriber->socket = socket;
-			clients_table[s] = new_subscriber;
-		} else if (clients_table[s]->connected == 0) {
+			subscriber = create_session(&broker->sessions, msg->id);
+			register_client_socket(broker, subscriber, socket);
+			accept_protocol(broker, subscriber, msg);
+
+			// a backlog may be left in the SF log by a previous session
+			flush_subscriber(broker, subscriber);
+		} else if (!subscriber->connected) {
 			// modify a subscriber that was connected before
-			clients_table[s]->socket = socket;
-			clients_table[s]->connected = 1;
-
-			// send sf subscribed topics lost while this subscriber was disconnected
-			while (!unsent_table[s].empty()) {
-				send_msg(socket, unsent_table[s].front());
-				free(unsent_table[s].front()); // free message memory
-				unsent_table[s].pop_front();
-			}
+			register_client_socket(broker, subscriber, socket);
+			accept_protocol(broker, subscriber, msg);
+
+			/*
+			 * send sf subscribed topics lost while this subscriber was
+			 * disconnected; the backlog is moved to the send queue as the
+			 * socket becomes writable
+			 */
+			flush_subscriber(broker, subscriber);
 		} else {
-			// duplicate connection found
+			// duplicate connection found, its socket is closed by the caller
 			printf("Client %s already connected.\n", msg->id);
-			close(socket);
 			return DUPLICATE_CLIENT;
 		}
 	}
-	else if (msg->type == PUBLISH) {
-		print_message(msg);
+	return 0;
+}
+
+/**
+	@brief Function that rebuilds the subscriptions saved by a previous run
+		   of the broker, before any client connects. The sessions of their
+		   clients are created disconnected, so a client that comes back finds
+		   its subscriptions and its SF backlog without subscribing again. The
+		   loaded state is then written as the new snapshot.
+
+	@param broker The broker state.
+	@param entries The subscriptions loaded by open_state_log().
+**/
+void restore_subscriptions(struct broker *broker, vector <struct state_entry> &entries) {
+	deque <struct topic>::iterator iter;
+	struct subscription *request;
+	Subscriber subscriber;
+	u_int32_t topic;
+	size_t i;
+
+	for (i = 0; i < entries.size(); i++) {
+		subscriber = find_session(&broker->sessions, entries[i].id.c_str());
+		if (subscriber == NULL)
+			subscriber = create_session(&broker->sessions, entries[i].id.c_str());
+		request = &entries[i].subscription;
+		request->subscriber = subscriber->handle;
+
+		if (is_pattern(entries[i].name)) {
+			add_pattern(&broker->patterns, entries[i].name, subscriber->handle, request->fs, request->conflate,
+						&request->filter);
+		} else {
+			topic = intern_topic(broker, entries[i].name, true);
+			broker->topics[topic].subscriptions.push_back(*request);
+		}
+		subscriber->nr_subscriptions++;
+		note_interest(broker, INTEREST_ADD, entries[i].name);
+	}
+
+	// the matches are cached once every pattern is known
+	for (iter = broker->topics.begin(); iter != broker->topics.end(); iter++)
+		resolve_topic(broker, &(*iter));
+	write_state_snapshot(broker->state_log, entries);
+}
+
+/**
+	@brief Function that writes a snapshot of every subscription of the
+		   broker, replacing the change log (when it grew too long, and when
+		   the server stops).
+
+	@param broker The broker state.
+	@param background True to write it on a thread (compaction from the
+					  event loop), false to return once it is written.
+**/
+void save_subscriptions(struct broker *broker, bool background) {
+	vector <struct state_entry> entries;
+	vector <struct subscription> subscriptions;
+	vector <string> patterns;
+	deque <struct topic>::iterator iter;
+	size_t i;
+
+	for (iter = broker->topics.begin(); iter != broker->topics.end(); iter++) {
+		for (i = 0; i < (*iter).subscriptions.size(); i++) {
+			entries.push_back(state_entry());
+			entries.back().id = broker->sessions.by_handle[(*iter).subscriptions[i].subscriber]->id;
+			entries.back().name = (*iter).name;
+			entries.back().subscription = (*iter).subscriptions[i];
+		}
+	}
+	list_patterns(&broker->patterns, patterns, subscriptions);
+	for (i = 0; i < patterns.size(); i++) {
+		entries.push_back(state_entry());
+		entries.back().id = broker->sessions.by_handle[subscriptions[i].subscriber]->id;
+		entries.back().name = patterns[i];
+		entries.back().subscription = subscriptions[i];
+	}
+	if (background)
+		compact_state_log(broker->state_log, entries);
+	else
+		write_state_snapshot(broker->state_log, entries);
+}
+
+/**
+	@brief Function that decodes and interprets every complete message waiting
+		   in the receive buffer of a subscriber. A partial message is kept in
+		   the buffer until the rest of it is received.
+
+	@param broker The broker state (topics and clients tables, SF log).
+	@param subscriber The subscriber that sent the messages.
+
+	@return int SOCKET_CLOSED if an invalid message is found, 0 otherwise
+				(the connection may have been closed meanwhile).
+**/
+int interpret_frames(struct broker *broker, Subscriber subscriber) {
+	struct TCP_msg msg;
+	int ret;
+
+	while ((ret = next_frame(&subscriber->reader, &msg)) == FRAME_READY) {
+		// the ID of a subscriber is only accepted in the handshake
+		if (msg.type != ID)
+			interpret_message(&msg, broker, subscriber->socket);
+
+		// a write of the retained messages of a subscription may have closed the connection
+		if (!subscriber->connected)
+			return 0;
+	}
+
+	if (ret == FRAME_INVALID) {
+		printf("Client %s sent an invalid message.\n", subscriber->id);
+		return SOCKET_CLOSED;
 	}
 	return 0;
 }
 
 /**
-	@brief Function that reads a message over the TCP protocol,
-		   making sure that the message is complete and correct.
+	@brief Function that receives the messages sent by a subscriber. All the
+		   bytes available on the socket are read with a single call, then all
+		   the complete messages are interpreted.
 
-	@param socket The socket where this message is received.
-	@param msg Pointer to the structure that will store the new message
-	@param topics_table Topics hashtable.
-	@param clients_table Subscribers hashtable.
-	@param unsent_table Unsent messages hashtable (the key is the id of each subscriber).
+	@param broker The broker state (topics and clients tables, SF log).
+	@param subscriber The subscriber whose socket is readable.
 
-	@return int SOCKET if a closed connection is detected, 0 otherwise.
+	@return int SOCKET_CLOSED if the connection was closed (or is not valid
+				anymore), 0 otherwise.
 **/ 
-int receive_msg(int socket, struct TCP_msg *msg, unordered_map <string, list <Subscription>> &topics_table,
-			unordered_map <string, Subscriber> &clients_table, unordered_map <string, list<struct TCP_msg *>> &unsent_table) {
-	
-	char buffer[BUFLEN];
-	int bytes_received, iter = 0, length, total_bytes = 0;
-	int ret = 0;
-
-	// first, receive the length of this message
-	memset(buffer, 0, BUFLEN);
-	bytes_received = recv(socket, buffer, 4, 0);
-	ABORT(bytes_received == -1, "RECEIVE error\n");
-
-	// check if the client has been disconnected
-	if (bytes_received == 0) {
-		/*
-		 * search the closed client by socket in the clients_table (so that we
-		 * can print it's ID)
-		 */
-		unordered_map <string, Subscriber>::iterator iter;
-		for (iter = clients_table.begin(); iter != clients_table.end(); iter++) {
-			if ((*iter).second->socket == socket) {
-				close(socket);
-				printf("Client %s disconnected.\n", (*iter).first.c_str());
-				(*iter).second->connected = 0;
-			}
-		}
+int receive_messages(struct broker *broker, Subscriber subscriber) {
+	int ret = fill_reader(subscriber->socket, &subscriber->reader);
+
+	if (ret == READ_AGAIN)
+		return 0;
+	if (ret == READ_CLOSED) {
+		printf("Client %s disconnected.\n", subscriber->id);
 		return SOCKET_CLOSED;
 	}
 
+	return interpret_frames(broker, subscriber);
+}
 
-	memset(msg, 0, sizeof(struct TCP_msg));
-	memcpy(msg, buffer, 4);
-	total_bytes = 4;
-	/*
-	 * Read the whole message (with exact number of bytes). We will stay in this
-	 * loop until we have received the whole message, being sure this will happen
-	 * soon because we've already received it's first part (length)
-	 */
-	while (total_bytes < ntohl(msg->length)) {
-		memset(buffer, 0, BUFLEN);
-		bytes_received = recv(socket, buffer, ntohl(msg->length) - total_bytes, 0);
-		memcpy(&(msg->type) + total_bytes - 4, buffer, bytes_received);
-		total_bytes += bytes_received;
+/**
+	@brief Function that starts the session of a client that sent its ID
+		   message. The subscriber takes over the receive buffer, where the
+		   client may have already pipelined its first messages after the ID.
+
+	@param broker The broker state.
+	@param socket The socket of the client.
+	@param reader Receive buffer of the connection (released if the client is rejected).
+	@param msg The ID message.
+	@param addr Address and port of the client.
+
+	@return int The socket of the client, -1 if the client was rejected.
+**/
+int admit_client(struct broker *broker, int socket, struct frame_reader *reader,
+				struct TCP_msg *msg, struct sockaddr_in *addr) {
+	Subscriber subscriber;
+	char address[INET_ADDRSTRLEN];
+
+	if (interpret_message(msg, broker, socket) == DUPLICATE_CLIENT) {
+		// the socket was never watched by the event loop, nothing else refers to it
+		free_reader(reader);
+		close(socket);
+		return -1;
 	}
 
-	// perform specific actions acoording to the message type and content
-	ret = interpret_message(msg, topics_table, clients_table, unsent_table, socket);
+	// inet_ntop() instead of inet_ntoa(), clients are admitted by several shards at once
+	inet_ntop(AF_INET, &addr->sin_addr, address, sizeof(address));
+	printf("New client %s connected from %s:%d\n", msg->id, address, addr->sin_port);
 
-	return ret;
+	// the connection may have been closed while sending the SF backlog
+	subscriber = session_by_fd(&broker->sessions, socket);
+	if (subscriber == NULL) {
+		free_reader(reader);
+		return -1;
+	}
+	subscriber->reader = *reader;
+	if (interpret_frames(broker, subscriber) == SOCKET_CLOSED) {
+		close_client_socket(broker, socket);
+		return -1;
+	}
+
+	return socket;
 }
 
 /**
-	@brief Function that takes the content of an UDP message, creates a message
-		   corresponding to our protocol and sends it to all of the interested
-		   subscribers.
+	@brief Function that takes the content of an UDP message and encodes it,
+		   once, as a PUBLISH message of our protocol in a shared buffer.
 
 	@param content The content received on the UDP connection.
 	@param content_size Number of conent bytes.
-	@param clients_table Subscribers hashtable.
-	@param topics_table Topics hashtable.
-	@param unsent_table Unsent messages hashtable (the key is the id of each subscriber).
 	@param UDP_cli_addr Address and port of the UDP client that generated this message.
-**/ 
-void publish_message(char *content, int content_size, unordered_map <string, Subscriber> &clients_table,
-					unordered_map <string, list <Subscription>> &topics_table, unordered_map <string, list<struct TCP_msg *>> &unsent_table,
-					struct sockaddr_in UDP_cli_addr) {
-	char topic[51];
-	TCP_msg msg;
+
+	@return struct msg_buf* The encoded message (the caller owns the reference).
+**/
+struct msg_buf *encode_publish(char *content, int content_size, struct sockaddr_in UDP_cli_addr) {
+	struct msg_buf *buf;
+	struct TCP_msg *msg;
+
+	if (content_size > (int) sizeof(msg->payload))
+		content_size = sizeof(msg->payload);
 
 	// create a PUBLISH message according to our TCP-resistent protocol
-	memset(&msg, 0, sizeof(msg));
-	msg.length = htonl(HEADER_SIZE + content_size);
-	msg.type = PUBLISH;
-	memcpy(&(msg.UDP_addr), &UDP_cli_addr.sin_addr, sizeof(UDP_cli_addr.sin_addr));
-	msg.UDP_port = UDP_cli_addr.sin_port;
-	memcpy(msg.payload, content, content_size);
+	buf = alloc_msg(HEADER_SIZE + content_size);
+	msg = (struct TCP_msg *) buf->data;
+	msg->length = htonl(HEADER_SIZE + content_size);
+	msg->type = PUBLISH;
+	memset(msg->id, 0, sizeof(msg->id));
+	memcpy(&(msg->UDP_addr), &UDP_cli_addr.sin_addr, sizeof(UDP_cli_addr.sin_addr));
+	msg->UDP_port = UDP_cli_addr.sin_port;
+	memcpy(msg->payload, content, content_size);
+
+	return buf;
+}
+
+/**
+	@brief Function that queues an encoded PUBLISH message for all of the
+		   interested subscribers. Send queues only keep references to the
+		   shared message.
+
+	@param buf The encoded message.
+	@param broker The broker state (clients and topics tables, SF log).
+**/
+void deliver_message(struct msg_buf *buf, struct broker *broker) {
+	vector <const char *> &recipients = broker->sf_recipients;
+	string_view name = frame_topic(buf);
+	unordered_map <string_view, u_int32_t>::iterator found;
+	vector <struct subscription> *matches;
+	struct msg_buf *v2_frame = NULL;
+	struct filter_value value;
+	bool decoded = false;
+	u_int32_t topic = NO_HANDLE;
+	u_int64_t routed = broker->stats.counters[STAT_ROUTED].load(memory_order_relaxed), start = 0;
+	size_t i;
+
+	// one message in ROUTE_SAMPLE is timed, the clock is not free
+	count_stat(&broker->stats, STAT_ROUTED, 1);
+	if (routed % ROUTE_SAMPLE == 0)
+		start = monotonic_ns();
+
+	// the topic is looked up in place, its matches are cached in the topic
+	found = broker->topics_table.find(name);
+	if (found != broker->topics_table.end()) {
+		topic = (*found).second;
+		matches = &broker->topics[topic].matches;
+	} else if (broker->patterns.nr_patterns == 0) {
+		// no subscriber at all for this topic
+		return;
+	} else if (broker->topics.size() < TOPIC_CACHE_LIMIT) {
+		topic = intern_topic(broker, name, true);
+		matches = &broker->topics[topic].matches;
+	} else {
+		// too many topics are cached, the trie is walked for every message
+		matches = &broker->uncached_matches;
+		matches->clear();
+		match_topic(&broker->patterns, name, *matches);
+		merge_subscriptions(*matches);
+	}
+
+	// the last message of a topic with subscribers is kept for the next subscriptions
+	if (topic != NO_HANDLE && !matches->empty() && broker->retain_max_bytes > 0)
+		retain_message(broker, &broker->topics[topic], buf);
 
 	// iterate trough all subscribers that subscribed to the topic of this message
-	sscanf(content, "%s", topic);
-	std::string s(topic);
-	list<Subscription>::iterator iter;
-	for (iter = topics_table[s].begin(); iter != topics_table[s].end(); iter++) {
-		if (clients_table[(*iter)->subscriber_id]->connected) {
-			// send the message, if the current subscriber is connected
-			send_msg(clients_table[(*iter)->subscriber_id]->socket, &msg);
-		} else if ((*iter)->fs) {
+	vector <struct subscription> &subscriptions = *matches;
+	recipients.clear();
+	for (i = 0; i < subscriptions.size(); i++) {
+		Subscriber subscriber = broker->sessions.by_handle[subscriptions[i].subscriber];
+
+		// the value is decoded once, for the first filtered subscription
+		if (subscriptions[i].filter.data_type != NO_DATA_TYPE) {
+			if (!decoded) {
+				read_filter_value(((struct TCP_msg *) buf->data)->payload, buf->length - HEADER_SIZE, &value);
+				decoded = true;
+			}
+			if (!filter_matches(&subscriptions[i].filter, &value)) {
+				count_stat(&broker->stats, STAT_FILTERED, 1);
+				continue;
+			}
+		}
+
+		if (subscriber->connected) {
+			// queue the message, if the current subscriber is connected
+			if (queue_message(broker, subscriber, subscriptions[i].fs, subscriptions[i].conflate,
+							buf, topic, &v2_frame))
+				recipients.push_back(subscriber->id);
+		} else if (subscriptions[i].fs) {
 			/*
 			 * if the current subscriber is not connected, but has subscribed
-			 * to this topic with sf, buffer this message in it's entry from
-			 * the unsent_messages table
+			 * to this topic with sf, the message goes to it's backlog (only
+			 * the newest one of a conflated topic is kept, in memory)
 			 */
-			string s1((*iter)->subscriber_id);
-			TCP_msg *new_msg =  (TCP_msg*) malloc(sizeof (struct TCP_msg));
-			memcpy(new_msg, &msg, ntohl(msg.length));
-			unsent_table[s1].push_front(new_msg);
+			if (subscriptions[i].conflate && topic != NO_HANDLE)
+				hold_back(subscriber, buf, topic);
+			else
+				recipients.push_back(subscriber->id);
 		}
 	}
+
+	// the message is written in the shared memory ring once, for all its local readers
+	if (broker->shm_recipients != 0)
+		publish_shm(broker, buf);
+
+	// the message is written in the SF log once, for all it's recipients
+	if (!recipients.empty()) {
+		append_sf_record(broker->sf_log, recipients, buf);
+		count_stat(&broker->stats, STAT_SF_RECORDS, 1);
+		set_stat(&broker->stats, STAT_SF_BYTES, broker->sf_log->total_bytes);
+	}
+	if (v2_frame != NULL)
+		release_msg(v2_frame);
+	if (start != 0)
+		record_value(&broker->stats, HIST_ROUTE_NS, monotonic_ns() - start);
 }
 
+/**
+	@brief Function that takes the content of an UDP message, creates a message
+		   corresponding to our protocol and queues it for all of the interested
+		   subscribers.
+
+	@param content The content received on the UDP connection.
+	@param content_size Number of conent bytes.
+	@param broker The broker state (clients and topics tables, SF log).
+	@param UDP_cli_addr Address and port of the UDP client that generated this message.
+**/ 
+void publish_message(char *content, int content_size, struct broker *broker, struct sockaddr_in UDP_cli_addr) {
+	struct msg_buf *buf = encode_publish(content, content_size, UDP_cli_addr);
+
+	buf->time = broker->receive_time;
+	deliver_message(buf, broker);
+	release_msg(buf);
+}
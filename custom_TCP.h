@@ -11,8 +11,21 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <iterator>
-#include <list>
+#include <deque>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
+#include "out_queue.h"
+#include "frame_reader.h"
+#include "sf_log.h"
+#include "topic_trie.h"
+#include "session_registry.h"
+#include "protocol_v2.h"
+#include "stats.h"
+#include "shm_ring.h"
+#include "federation.h"
+#include "state_log.h"
 
 using namespace std;
 
@@ -23,10 +36,59 @@ using namespace std;
 #define UNSUBSCRIBE 2
 #define PUBLISH 3
 #define ID 4
+#define TOPIC_ALIAS 5	// v2 protocol only
+#define OUTPUT_MODE 6
+#define PEER_HELLO 7	// first message of a link between brokers, with the ID of the broker
+#define PEER_INTEREST 8	// a broker (un)subscribed a topic or pattern, for its peers
+
+// transports of the messages sent to a client (requested in its ID message, after the protocol version)
+#define TRANSPORT_TCP 0
+#define TRANSPORT_SHM 1	// shared memory ring of the broker, for clients on the same host
+
+/*
+ * A client that numbers the messages it gets sends, after the transport, the
+ * number of the next message it expects (8 bytes, network order, NO_RESUME
+ * if it has none). The answer
+ * then holds the protocol, the transport, the reader slot and the number of
+ * the first message that follows (8 bytes, NO_RESUME if the client reads the
+ * ring, whose records are not numbered), before the name of the ring.
+ */
+#define RESUME_OFFSET 2		// of the resume number in the payload of the ID message
+#define ANSWER_SEQUENCE 3	// of the next number in the payload of the answer
+#define NO_RESUME ((u_int64_t) -1)	// first connection of a client, nothing is sent again
+
+// options of a SUBSCRIBE message (a byte after the terminator of the topic name)
+#define SUBSCRIBE_CONFLATE 0x01	// keep only the newest waiting message of every topic
+#define SUBSCRIBE_FILTER 0x02	// a content filter (text, with its terminator) follows the options
 
 #define SOCKET_CLOSED 0x10
 #define DUPLICATE_CLIENT 0x11
 
+// what happens to a message for a subscriber whose send queue is full
+#define OVERFLOW_DROP 0
+#define OVERFLOW_DISCONNECT 1
+#define OVERFLOW_SF 2
+
+#define DEFAULT_QUEUE_LIMIT (4 * 1024 * 1024)
+
+// output modes of a subscriber (payload of an OUTPUT_MODE message)
+#define OUTPUT_LATENCY 0	// written at the end of every event loop iteration
+#define OUTPUT_THROUGHPUT 1	// coalesced for up to the linger window
+
+#define DEFAULT_RETAIN_BYTES (16 * 1024 * 1024)
+
+#define DEFAULT_RESUME_BYTES (1024 * 1024)
+#define REPLAY_REFILLS 4	// send queues refilled from the SF backlog in a flush, before the other sockets
+
+#define DEFAULT_LINGER_US 1000
+#define DEFAULT_COALESCE_BYTES (64 * 1024)
+
+// handle of a client or topic that was never interned
+#define NO_HANDLE ((u_int32_t) -1)
+
+// published topics without subscriptions cached for wildcard matching
+#define TOPIC_CACHE_LIMIT 65536
+
 
 #define ABORT(condition, message) \
 	if (condition) { \
@@ -39,6 +101,9 @@ using namespace std;
 		fprintf(stderr, "%s", message); \
 	}
 
+struct uring;
+struct uring_send;
+
 struct TCP_msg {
 	u_int32_t length;
 	u_int8_t type;
@@ -48,27 +113,146 @@ struct TCP_msg {
 	char payload[1556];
 };
 
+// message sent to a client that may resume its connection
+struct resume_frame {
+	struct msg_buf *frame;	// v1 frame
+	u_int64_t queue_seq;	// number of its frame in the send queue
+	u_int32_t topic;		// handle of its topic, NO_HANDLE if it is not interned
+};
+
 typedef struct subscriber {
+	char id[13];
+	u_int32_t handle;	// index of the session in the registry of the broker
+	u_int32_t nr_subscriptions;	// topics and patterns, the session is released without any
 	int socket;
 	bool connected;
+	bool want_write;	// EPOLLOUT is armed for this socket, or a write is in flight (io_uring)
+	bool dirty;		// messages were queued since the last flush
+	bool closing;	// its send queue overflowed, it is disconnected by the next flush
+	u_int8_t protocol;	// of the messages sent to the subscriber
+	u_int8_t output_mode;
+	bool lingering;		// waits in the linger list of the broker
+	u_int64_t linger_deadline;	// monotonic time (us) when its queue must be written
+	vector <bool> announced;	// topic aliases announced on the connection (v2), by topic handle
+	struct out_queue queue;
+	unordered_map <u_int32_t, u_int64_t> conflated_frames;	// topic handle -> number of its waiting frame
+	unordered_map <u_int32_t, struct msg_buf *> conflated_backlog;	// topic handle -> newest v1 frame held back
+	struct uring_send *sending;	// write in flight on the io_uring of the broker, NULL if none
+	int shm_slot;		// reader slot in the shared memory ring of the broker, NO_SHM_SLOT if none
+	bool shm_overrun;	// the ring was taken back, every message waits behind the replayed records
+	struct frame_reader reader;
+	bool resumable;		// the client numbers its messages, the last ones are kept for its next connection
+	u_int64_t sequence;	// number of the next message queued for a resumable client
+	deque <struct resume_frame> resume_window;	// last messages queued, the newest one has number sequence - 1
+	size_t resume_bytes;	// of the (v1) frames in the window
 } *Subscriber;
 
-typedef struct subscription {
-	char subscriber_id[13];
-	bool fs;
-} *Subscription;
+/*
+ * A topic interned by the broker. Besides its own subscriptions, it caches
+ * the subscribers matched by the topic or by a wildcard pattern, one entry per
+ * subscriber, which is the array walked when a message is routed. While it
+ * has subscribers, it also retains its last message, for new subscriptions.
+ */
+struct topic {
+	string name;
+	vector <struct subscription> subscriptions;
+	vector <struct subscription> matches;
+	struct msg_buf *retained;	// last v1 frame, NULL if there is none
+	struct topic *older, *newer;	// neighbours in the retained list of the broker
+};
+
+// first subscription of a shard added to a topic or pattern, or its last one removed, for the other shards and the peer brokers
+struct interest_change {
+	string name;
+	u_int8_t op;		// INTEREST_ADD or INTEREST_REMOVE
+};
+
+// retained messages a new subscription asks from the other shards
+struct retain_request {
+	string name;		// subscribed topic or pattern
+	u_int32_t subscriber;	// handle of the subscriber
+};
+
+/*
+ * State of the broker: the tables used for routing messages, the SF log, the
+ * event loop that watches the subscriber sockets and the configuration.
+ *
+ * Client IDs and topic names are interned to dense handles when a client
+ * connects or subscribes, so routing a message only hashes its topic once and
+ * then walks the array of subscriptions of the topic.
+ */
+struct broker {
+	int epoll_fd;
+	struct uring *ring;	// io_uring backend, NULL if the sockets are written by the event loop
+	struct session_registry sessions;
+	unordered_map <string_view, u_int32_t> topics_table;	// name -> handle (keys point to topic names)
+	deque <struct topic> topics;	// a deque never moves its elements (and their names)
+	struct topic_trie patterns;	// wildcard subscriptions
+	vector <struct subscription> uncached_matches;	// reused by deliver_message()
+	vector <const char *> sf_recipients;	// reused by deliver_message()
+	struct sf_log *sf_log;
+	struct state_log *state_log;	// subscriptions kept across restarts, NULL with a temporary SF log
+	vector <Subscriber> dirty_subscribers;
+	vector <Subscriber> lingering_subscribers;	// throughput mode subscribers with unsent messages
+	struct topic *oldest_retained, *newest_retained;	// topics with a retained message, by update time
+	size_t retained_bytes;
+	size_t retain_max_bytes;	// 0 disables the retained messages
+	size_t resume_bytes;	// v1 bytes of the messages kept for a client that reconnects (more if they are still queued)
+	bool sharded;		// other shards retain the topics of their own subscribers
+	vector <struct retain_request> retain_requests;	// for the other shards
+	struct shm_ring *shm;	// created for the first local client that asks for it, NULL before
+	Subscriber shm_readers[SHM_MAX_READERS];	// by slot
+	u_int64_t shm_recipients;	// slots of the readers of the message being routed
+	size_t shm_bytes;		// capacity of the ring, 0 disables it
+	bool federated;		// the broker has peers, its subscriptions are counted by shard 0
+	unordered_map <string, u_int32_t> interest;	// subscriptions by topic or pattern, when others are told
+	vector <struct interest_change> interest_changes;	// for the other shards and shard 0
+	struct peer_interest peer_interest;	// topics and patterns subscribed on the peer brokers
+	struct peer_interest shard_interest;	// topics (owned by this shard) and patterns subscribed on the other shards
+	int linger_fd;		// timer for the first linger deadline
+	u_int64_t linger_armed;	// deadline the timer is set to, 0 if it is not set
+	u_int64_t receive_time;	// monotonic time (ns) of the UDP batch being routed
+	struct broker_stats stats;
+	size_t queue_limit;
+	u_int8_t overflow_policy;
+	u_int32_t linger_us;
+	size_t coalesce_bytes;
+	const char *sf_dir;
+	const char *stats_socket;	// path of the UNIX socket for statistics, NULL if there is none
+	int listen_backlog;		// of the TCP socket for connections
+	u_int32_t handshake_ms;	// time a new connection has to send its ID
+	size_t sf_max_bytes;
+	time_t sf_max_age;
+};
+
 
+// messages of the clients, in client_msg.cpp (linked without the broker)
+void create_unsubscribe_msg(const char *id, const char *topic, struct TCP_msg *msg);
+void create_subscribe_msg(u_int8_t SF, u_int8_t options, const char *id, const char *topic, const char *filter,
+						struct TCP_msg *msg);
+void create_id_msg(const char *id, u_int8_t version, u_int8_t transport, u_int64_t resume, struct TCP_msg *msg);
+void create_mode_msg(const char *id, u_int8_t mode, struct TCP_msg *msg);
 
-void create_unsubscribe_msg(char *id, char* topic, struct TCP_msg *msg);
-void create_subscribe_msg(u_int8_t SF, char* id, char* topic, struct TCP_msg *msg);
-void create_id_msg(char *id, struct TCP_msg *msg);
+int send_msg(int socket, struct TCP_msg *msg);
 
-void send_msg(int socket, struct TCP_msg *msg);
-int receive_msg(int socket, struct TCP_msg *msg, unordered_map <string, list <Subscription>> &topics_table,
-			unordered_map <string, Subscriber> &clients_table, unordered_map <string, list<struct TCP_msg *>> &unsent_table);
-void publish_message(char *content, int content_size, unordered_map <string, Subscriber> &clients_table,
-		 unordered_map <string, list <Subscription>> &topics_table, unordered_map <string, list<struct TCP_msg *>> &unsent_table,
-		 struct sockaddr_in UDP_cli_addr);
+int interpret_message(struct TCP_msg *msg, struct broker *broker, int socket);
+int interpret_frames(struct broker *broker, Subscriber subscriber);
+int receive_messages(struct broker *broker, Subscriber subscriber);
+int admit_client(struct broker *broker, int socket, struct frame_reader *reader,
+				struct TCP_msg *msg, struct sockaddr_in *addr);
+string_view frame_topic(struct msg_buf *frame);
+struct msg_buf *encode_publish(char *content, int content_size, struct sockaddr_in UDP_cli_addr);
+void deliver_message(struct msg_buf *buf, struct broker *broker);
+void publish_message(char *content, int content_size, struct broker *broker, struct sockaddr_in UDP_cli_addr);
+void flush_subscriber(struct broker *broker, Subscriber subscriber);
+void flush_dirty_subscribers(struct broker *broker);
+void flush_lingering_subscribers(struct broker *broker);
+void complete_send(struct broker *broker, struct uring_send *send, int result);
+void close_client_socket(struct broker *broker, int socket);
+void restore_subscriptions(struct broker *broker, vector <struct state_entry> &entries);
+void save_subscriptions(struct broker *broker, bool background);
+void find_retained(struct broker *broker, string_view name, vector <struct msg_buf *> &found);
+void adopt_retained(struct broker *broker, u_int32_t handle, struct msg_buf *buf);
 
 #endif
 
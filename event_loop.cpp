@@ -0,0 +1,111 @@
+#include <fcntl.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "event_loop.h"
+#include "custom_TCP.h"
+
+/**
+	@brief Function that creates the epoll instance used by the server loop.
+
+	@return int The epoll file descriptor.
+**/
+int create_event_loop() {
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	ABORT(epoll_fd == -1, "Event loop: CREATE error\n");
+
+	return epoll_fd;
+}
+
+/**
+	@brief Function that registers a file descriptor in the event loop.
+
+	@param epoll_fd The event loop.
+	@param fd The descriptor to be watched (also stored as the event data).
+	@param events Mask of epoll events (EPOLLIN, EPOLLOUT, EPOLLET...).
+**/
+void watch_fd(int epoll_fd, int fd, uint32_t events) {
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.fd = fd;
+	ABORT(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1, "Event loop: ADD error\n");
+}
+
+/**
+	@brief Function that changes the events watched for an already registered
+		   file descriptor.
+
+	@param epoll_fd The event loop.
+	@param fd The watched descriptor.
+	@param events The new mask of epoll events.
+**/
+void rewatch_fd(int epoll_fd, int fd, uint32_t events) {
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.fd = fd;
+	WARNING(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1, "Event loop: MODIFY error\n");
+}
+
+/**
+	@brief Function that removes a file descriptor from the event loop. Must be
+		   called before closing the descriptor.
+
+	@param epoll_fd The event loop.
+	@param fd The descriptor to be removed.
+**/
+void unwatch_fd(int epoll_fd, int fd) {
+	WARNING(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1, "Event loop: DELETE error\n");
+}
+
+// helper, switch a descriptor to non-blocking mode (needed for edge-triggered events)
+void set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	ABORT(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1, "SET NONBLOCKING error\n");
+}
+
+/**
+	@brief Function that creates a (non-blocking) timer, to be watched by the
+		   event loop like any other descriptor.
+
+	@return int The timer file descriptor.
+**/
+int create_timer() {
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ABORT(timer_fd == -1, "Event loop: TIMER error\n");
+
+	return timer_fd;
+}
+
+/**
+	@brief Function that sets the expiration time of a timer, replacing the
+		   previous one.
+
+	@param timer_fd The timer.
+	@param deadline Expiration time, in microseconds on the monotonic clock
+					(see monotonic_us()); 0 disarms the timer.
+**/
+void arm_timer(int timer_fd, uint64_t deadline) {
+	struct itimerspec spec = {};
+
+	spec.it_value.tv_sec = deadline / 1000000;
+	spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	WARNING(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1, "Event loop: TIMER error\n");
+}
+
+// helper, current time on the monotonic clock, in microseconds
+uint64_t monotonic_us() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// helper, current time on the monotonic clock, in nanoseconds
+uint64_t monotonic_ns() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,19 @@
+#ifndef _EVENT_LOOP_H
+#define _EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 256
+
+int create_event_loop();
+void watch_fd(int epoll_fd, int fd, uint32_t events);
+void rewatch_fd(int epoll_fd, int fd, uint32_t events);
+void unwatch_fd(int epoll_fd, int fd);
+void set_nonblocking(int fd);
+int create_timer();
+void arm_timer(int timer_fd, uint64_t deadline);
+uint64_t monotonic_us();
+uint64_t monotonic_ns();
+
+#endif
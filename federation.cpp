@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <random>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include "federation.h"
+#include "shards.h"
+#include "event_loop.h"
+
+/**
+	@brief Function that applies a change of the interest of a peer broker
+		   (a topic or pattern it subscribed or unsubscribed).
+
+	@param interest The interest of the peers, as known by a shard.
+	@param peer Index of the link of the peer (or of the other shard).
+	@param op INTEREST_ADD, INTEREST_REMOVE or INTEREST_CLEAR (every topic
+			  and pattern of the peer, whose link was lost).
+	@param name The topic or pattern (ignored by INTEREST_CLEAR).
+**/
+void update_peer_interest(struct peer_interest *interest, int peer, u_int8_t op, string_view name) {
+	unordered_map <string, u_int64_t>::iterator iter;
+	struct content_filter everything;
+	u_int64_t bit = (u_int64_t) 1 << peer;
+	bool pattern = is_pattern(name);
+	unordered_map <string, u_int64_t> &table = pattern ? interest->patterns : interest->topics;
+
+	if (op == INTEREST_CLEAR) {
+		for (iter = interest->topics.begin(); iter != interest->topics.end();) {
+			(*iter).second &= ~bit;
+			iter = (*iter).second == 0 ? interest->topics.erase(iter) : next(iter);
+		}
+		for (iter = interest->patterns.begin(); iter != interest->patterns.end();) {
+			if ((*iter).second & bit)
+				remove_pattern(&interest->trie, (*iter).first, peer);
+			(*iter).second &= ~bit;
+			iter = (*iter).second == 0 ? interest->patterns.erase(iter) : next(iter);
+		}
+		interest->peers &= ~bit;
+		return;
+	}
+
+	iter = table.find(string(name));
+	if (op == INTEREST_ADD) {
+		if (iter == table.end())
+			iter = table.emplace(string(name), 0).first;
+		if (pattern && !((*iter).second & bit)) {
+			// peers get every message of their topics, their own subscribers are filtered there
+			everything.data_type = NO_DATA_TYPE;
+			add_pattern(&interest->trie, name, peer, false, false, &everything);
+		}
+		(*iter).second |= bit;
+		interest->peers |= bit;
+	} else if (iter != table.end() && ((*iter).second & bit)) {
+		if (pattern)
+			remove_pattern(&interest->trie, name, peer);
+		(*iter).second &= ~bit;
+		if ((*iter).second == 0)
+			table.erase(iter);
+	}
+}
+
+/**
+	@brief Function that finds the peer brokers that want the messages of a
+		   topic (subscribed by name or by a pattern that matches it).
+
+	@param interest The interest of the peers, as known by a shard.
+	@param topic The topic of a message.
+
+	@return u_int64_t The peers, one bit per link (or per shard).
+**/
+u_int64_t interested_peers(struct peer_interest *interest, string_view topic) {
+	unordered_map <string, u_int64_t>::iterator found;
+	u_int64_t peers = 0;
+	size_t i;
+
+	if (interest->peers == 0)
+		return 0;
+
+	if (!interest->topics.empty()) {
+		interest->lookup.assign(topic);
+		found = interest->topics.find(interest->lookup);
+		if (found != interest->topics.end())
+			peers = (*found).second;
+	}
+	if (interest->trie.nr_patterns > 0) {
+		interest->matches.clear();
+		match_topic(&interest->trie, topic, interest->matches);
+		for (i = 0; i < interest->matches.size(); i++)
+			peers |= (u_int64_t) 1 << interest->matches[i].subscriber;
+	}
+	return peers;
+}
+
+// helper, encode a frame for a link (with the header of the v1 protocol)
+static struct msg_buf *encode_peer_frame(u_int8_t type, const char *payload, u_int32_t length) {
+	struct msg_buf *buf = alloc_msg(HEADER_SIZE + length);
+	struct TCP_msg *msg = (struct TCP_msg *) buf->data;
+
+	memset(msg, 0, HEADER_SIZE);
+	msg->length = htonl(HEADER_SIZE + length);
+	msg->type = type;
+	memcpy(msg->payload, payload, length);
+	return buf;
+}
+
+// helper, queue a frame on a link, written at the end of the event loop iteration
+static void push_peer_frame(struct federation *federation, int peer, struct msg_buf *frame) {
+	push_frame(&federation->links[peer].queue, frame);
+	federation->dirty |= 1u << peer;
+}
+
+// helper, queue the hello of this broker (its ID) on a link
+static void send_hello(struct federation *federation, int peer) {
+	u_int64_t node = htobe64(federation->node);
+	struct msg_buf *frame = encode_peer_frame(PEER_HELLO, (char *) &node, sizeof(node));
+
+	push_peer_frame(federation, peer, frame);
+	release_msg(frame);
+}
+
+// helper, queue a change of the interest of this broker on a link
+static void send_interest(struct federation *federation, int peer, u_int8_t op, string_view name) {
+	char payload[TOPIC_SIZE + 2];
+	struct msg_buf *frame;
+
+	payload[0] = op;
+	memcpy(payload + 1, name.data(), name.size());
+	payload[name.size() + 1] = '\0';
+	frame = encode_peer_frame(PEER_INTEREST, payload, name.size() + 2);
+	push_peer_frame(federation, peer, frame);
+	release_msg(frame);
+}
+
+// helper, take a free link for a socket, NO_PEER if every link is in use
+static int open_link(struct federation *federation, int socket, int address, struct sockaddr_in *addr) {
+	char ip[INET_ADDRSTRLEN];
+	struct peer_link *link;
+	int peer;
+
+	for (peer = 0; peer < MAX_PEERS && (federation->active & (1u << peer)); peer++);
+	if (peer == MAX_PEERS)
+		return NO_PEER;
+
+	link = &federation->links[peer];
+	link->socket = socket;
+	link->established = false;
+	link->want_write = false;
+	link->address = address;
+	link->node = 0;
+	inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+	snprintf(link->name, sizeof(link->name), "%s:%d", ip, ntohs(addr->sin_port));
+	federation->active |= 1u << peer;
+	return peer;
+}
+
+/**
+	@brief Function that closes a link. The shards forget the interest of its
+		   peer and the configured peers are connected again after a delay.
+
+	@param set The shards of the broker.
+	@param peer Index of the link.
+**/
+static void close_link(struct shard_set *set, int peer) {
+	struct federation *federation = set->federation;
+	struct peer_link *link = &federation->links[peer];
+
+	if (link->established) {
+		printf("Peer broker %s disconnected.\n", link->name);
+		broadcast_peer_interest(set, peer, INTEREST_CLEAR, string_view());
+	}
+	if (link->address != NO_PEER)
+		federation->addresses[link->address].link = NO_PEER;
+	if (!federation->addresses.empty())
+		arm_timer(federation->retry_fd, monotonic_us() + PEER_RETRY_US);
+
+	unwatch_fd(federation->epoll_fd, link->socket);
+	close(link->socket);
+	clear_queue(&link->queue);
+	free_reader(&link->reader);
+	federation->active &= ~(1u << peer);
+	federation->dirty &= ~(1u << peer);
+}
+
+// helper, write the send queue of a link; EPOLLOUT is armed while the socket is full
+static bool write_link(struct shard_set *set, int peer) {
+	struct federation *federation = set->federation;
+	struct peer_link *link = &federation->links[peer];
+	int ret = flush_queue(link->socket, &link->queue, &set->shards[0].broker.stats);
+
+	if (ret == QUEUE_ERROR) {
+		close_link(set, peer);
+		return false;
+	}
+	if ((ret == QUEUE_PENDING) != link->want_write) {
+		link->want_write = ret == QUEUE_PENDING;
+		rewatch_fd(federation->epoll_fd, link->socket, link->want_write ? EPOLLIN | EPOLLOUT : EPOLLIN);
+	}
+	return true;
+}
+
+// helper, the broker that opened a link
+static u_int64_t link_initiator(struct federation *federation, int peer) {
+	return federation->links[peer].address != NO_PEER ? federation->node : federation->links[peer].node;
+}
+
+// helper, the established link to a broker, NO_PEER if there is none
+static int linked_peer(struct federation *federation, u_int64_t node) {
+	int peer;
+
+	for (peer = 0; peer < MAX_PEERS; peer++) {
+		if ((federation->active & (1u << peer)) && federation->links[peer].established
+				&& federation->links[peer].node == node)
+			return peer;
+	}
+	return NO_PEER;
+}
+
+/**
+	@brief Function that identifies the peer of a link from its hello and
+		   sends it the interest of this broker. Links to this same broker are
+		   closed; when two brokers connected to each other, both keep the
+		   link opened by the broker with the smaller ID.
+
+	@param set The shards of the broker.
+	@param peer Index of the link.
+	@param msg The hello of the peer.
+
+	@return bool False if the link was closed.
+**/
+static bool establish_link(struct shard_set *set, int peer, struct TCP_msg *msg) {
+	struct federation *federation = set->federation;
+	struct peer_link *link = &federation->links[peer];
+	unordered_map <string, u_int32_t>::iterator iter;
+	u_int64_t node, first;
+	int other;
+
+	if (ntohl(msg->length) < HEADER_SIZE + sizeof(node)) {
+		close_link(set, peer);
+		return false;
+	}
+	memcpy(&node, msg->payload, sizeof(node));
+	link->node = be64toh(node);
+	if (link->address != NO_PEER)
+		federation->addresses[link->address].node = link->node;
+
+	if (link->node == federation->node) {
+		WARNING(1, "Peer broker is this broker.\n");
+		close_link(set, peer);
+		return false;
+	}
+	if ((other = linked_peer(federation, link->node)) != NO_PEER) {
+		first = min(federation->node, link->node);
+		if (link_initiator(federation, peer) != first || link_initiator(federation, other) == first) {
+			close_link(set, peer);
+			return false;
+		}
+		close_link(set, other);
+	}
+
+	link->established = true;
+	printf("Peer broker %s connected.\n", link->name);
+	for (iter = federation->interest.begin(); iter != federation->interest.end(); iter++)
+		send_interest(federation, peer, INTEREST_ADD, (*iter).first);
+	return true;
+}
+
+/**
+	@brief Function that handles the frames received on a link: the hello of
+		   the peer, then changes of its interest and the messages it
+		   forwards, which are delivered to the local subscribers only.
+
+	@param set The shards of the broker.
+	@param peer Index of the link.
+**/
+static void interpret_peer_frames(struct shard_set *set, int peer) {
+	struct peer_link *link = &set->federation->links[peer];
+	struct broker *broker = &set->shards[0].broker;
+	struct msg_buf *buf;
+	struct TCP_msg msg;
+	u_int32_t length;
+	int ret;
+
+	broker->receive_time = monotonic_ns();
+	while ((ret = next_frame(&link->reader, &msg)) == FRAME_READY) {
+		length = ntohl(msg.length);
+		if (!link->established) {
+			if (msg.type != PEER_HELLO) {
+				ret = FRAME_INVALID;
+				break;
+			}
+			if (!establish_link(set, peer, &msg))
+				return;
+		} else if (msg.type == PEER_INTEREST && length > HEADER_SIZE && (u_int8_t) msg.payload[0] <= INTEREST_ADD) {
+			broadcast_peer_interest(set, peer, msg.payload[0], string_view(msg.payload + 1,
+									strnlen(msg.payload + 1, min(length - HEADER_SIZE - 1, (u_int32_t) TOPIC_SIZE))));
+		} else if (msg.type == PUBLISH) {
+			// the frame is the one the peer sent to its own v1 subscribers
+			buf = alloc_msg(length);
+			memcpy(buf->data, &msg, length);
+			buf->time = broker->receive_time;
+			count_stat(&broker->stats, STAT_PEER_RELAYS, 1);
+			relay_message(set, 0, buf);
+			release_msg(buf);
+		} else {
+			ret = FRAME_INVALID;
+			break;
+		}
+	}
+
+	if (ret == FRAME_INVALID) {
+		printf("Peer broker %s sent an invalid message.\n", link->name);
+		close_link(set, peer);
+	}
+	flush_dirty_subscribers(broker);
+	wake_shards(set, 0);
+}
+
+// helper, connect (without blocking) to a configured peer; its hello is queued until the connection completes
+static void connect_peer(struct shard_set *set, int address) {
+	struct federation *federation = set->federation;
+	struct peer_address *target = &federation->addresses[address];
+	int new_socket, enable = 1, peer;
+
+	new_socket = socket(PF_INET, SOCK_STREAM, 0);
+	ABORT(new_socket == -1, "Peer socket: CREATE error\n");
+	ABORT(setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) == -1,
+		"Peer socket: SET SOCKET OPTIONS error\n");
+	set_nonblocking(new_socket);
+	if (connect(new_socket, (struct sockaddr *) &target->addr, sizeof(target->addr)) == -1 && errno != EINPROGRESS) {
+		close(new_socket);
+		arm_timer(federation->retry_fd, monotonic_us() + PEER_RETRY_US);
+		return;
+	}
+
+	peer = open_link(federation, new_socket, address, &target->addr);
+	if (peer == NO_PEER) {
+		WARNING(1, "Too many peer brokers.\n");
+		close(new_socket);
+		return;
+	}
+	target->link = peer;
+	init_reader(&federation->links[peer].reader);
+	federation->links[peer].want_write = true;
+	watch_fd(federation->epoll_fd, new_socket, EPOLLIN | EPOLLOUT);
+	send_hello(federation, peer);
+}
+
+/**
+	@brief Function that creates the federation state of a broker and starts
+		   connecting to its configured peers.
+
+	@param addresses Addresses of the peer brokers to connect to.
+	@param epoll_fd Event loop of shard 0, which handles the links.
+	@param queue_limit Bytes of messages a link may hold before it drops them.
+
+	@return struct federation* The federation state.
+**/
+struct federation *create_federation(vector <struct sockaddr_in> &addresses, int epoll_fd, size_t queue_limit) {
+	struct federation *federation = new struct federation();
+	random_device device;
+	size_t i;
+
+	do {
+		federation->node = ((u_int64_t) device() << 32) | device();
+	} while (federation->node == 0);
+	federation->epoll_fd = epoll_fd;
+	federation->queue_limit = queue_limit;
+	federation->retry_fd = create_timer();
+	watch_fd(epoll_fd, federation->retry_fd, EPOLLIN);
+
+	federation->addresses.resize(addresses.size());
+	for (i = 0; i < addresses.size(); i++) {
+		federation->addresses[i].addr = addresses[i];
+		federation->addresses[i].node = 0;
+		federation->addresses[i].link = NO_PEER;
+	}
+
+	// the first attempts are made once the event loop runs
+	if (!addresses.empty())
+		arm_timer(federation->retry_fd, monotonic_us());
+	return federation;
+}
+
+/**
+	@brief Function that closes every link of a broker that stops.
+
+	@param federation The federation state.
+**/
+void close_federation(struct federation *federation) {
+	int peer;
+
+	for (peer = 0; peer < MAX_PEERS; peer++) {
+		if (!(federation->active & (1u << peer)))
+			continue;
+		close(federation->links[peer].socket);
+		clear_queue(&federation->links[peer].queue);
+		free_reader(&federation->links[peer].reader);
+	}
+	close(federation->retry_fd);
+	delete federation;
+}
+
+/**
+	@brief Function that finds the link connected on a socket.
+
+	@return int Index of the link, NO_PEER if the socket is not a link.
+**/
+int peer_by_fd(struct federation *federation, int fd) {
+	int peer;
+
+	for (peer = 0; peer < MAX_PEERS; peer++) {
+		if ((federation->active & (1u << peer)) && federation->links[peer].socket == fd)
+			return peer;
+	}
+	return NO_PEER;
+}
+
+/**
+	@brief Function that starts a link accepted on the TCP socket of the
+		   broker, whose first message was the hello of a peer broker.
+
+	@param set The shards of the broker.
+	@param socket The socket of the connection.
+	@param reader Receive buffer of the connection (taken over by the link).
+	@param msg The hello of the peer.
+	@param addr Address and port of the peer.
+**/
+void accept_peer(struct shard_set *set, int socket, struct frame_reader *reader, struct TCP_msg *msg,
+				struct sockaddr_in *addr) {
+	struct federation *federation = set->federation;
+	int peer = open_link(federation, socket, NO_PEER, addr);
+
+	if (peer == NO_PEER) {
+		WARNING(1, "Too many peer brokers.\n");
+		free_reader(reader);
+		close(socket);
+		return;
+	}
+	federation->links[peer].reader = *reader;
+	watch_fd(federation->epoll_fd, socket, EPOLLIN);
+
+	// the hello is answered before anything else, even if the link is closed below
+	send_hello(federation, peer);
+	if (!write_link(set, peer) || !establish_link(set, peer, msg))
+		return;
+	interpret_peer_frames(set, peer);
+}
+
+/**
+	@brief Function that handles the events of the socket of a link.
+
+	@param set The shards of the broker.
+	@param peer Index of the link.
+	@param events The events reported by the event loop.
+**/
+void handle_peer_event(struct shard_set *set, int peer, u_int32_t events) {
+	struct peer_link *link = &set->federation->links[peer];
+	int ret;
+
+	if ((events & EPOLLOUT) && !write_link(set, peer))
+		return;
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	ret = fill_reader(link->socket, &link->reader);
+	if (ret == READ_AGAIN)
+		return;
+	if (ret == READ_CLOSED) {
+		close_link(set, peer);
+		return;
+	}
+	interpret_peer_frames(set, peer);
+}
+
+/**
+	@brief Function that counts a subscription added to or removed from a
+		   topic or pattern, on any shard. The peers are told when the first
+		   subscription is added and when the last one is removed.
+
+	@param federation The federation state.
+	@param op INTEREST_ADD or INTEREST_REMOVE.
+	@param name The topic or pattern.
+**/
+void count_interest(struct federation *federation, u_int8_t op, string_view name) {
+	unordered_map <string, u_int32_t>::iterator iter = federation->interest.find(string(name));
+	int peer;
+
+	if (op == INTEREST_ADD) {
+		if (iter != federation->interest.end()) {
+			(*iter).second++;
+			return;
+		}
+		federation->interest[string(name)] = 1;
+	} else {
+		if (iter == federation->interest.end() || --(*iter).second > 0)
+			return;
+		federation->interest.erase(iter);
+	}
+
+	for (peer = 0; peer < MAX_PEERS; peer++) {
+		if ((federation->active & (1u << peer)) && federation->links[peer].established)
+			send_interest(federation, peer, op, name);
+	}
+}
+
+/**
+	@brief Function that queues a message on the links of the peers that want
+		   it. The v1 frame of the message is shared by the links, it is never
+		   encoded again. A link that holds too many bytes drops the message.
+
+	@param set The shards of the broker.
+	@param buf The encoded message.
+	@param peers The peers that want it, one bit per link.
+**/
+void forward_to_peers(struct shard_set *set, struct msg_buf *buf, u_int32_t peers) {
+	struct federation *federation = set->federation;
+	struct broker_stats *stats = &set->shards[0].broker.stats;
+	int peer;
+
+	for (peer = 0; peer < MAX_PEERS; peer++) {
+		if (!(peers & federation->active & (1u << peer)) || !federation->links[peer].established)
+			continue;
+		if (federation->links[peer].queue.bytes + buf->length > federation->queue_limit) {
+			count_stat(stats, STAT_DROPPED, 1);
+			continue;
+		}
+		push_peer_frame(federation, peer, buf);
+		count_stat(stats, STAT_PEER_FORWARDS, 1);
+	}
+}
+
+/**
+	@brief Function that writes the links that got frames during the event
+		   loop iteration (those waiting for EPOLLOUT are written then).
+
+	@param set The shards of the broker.
+**/
+void flush_peers(struct shard_set *set) {
+	struct federation *federation = set->federation;
+	int peer;
+
+	for (peer = 0; peer < MAX_PEERS; peer++) {
+		if ((federation->dirty & (1u << peer)) && !federation->links[peer].want_write)
+			write_link(set, peer);
+	}
+	federation->dirty = 0;
+}
+
+/**
+	@brief Function that connects again to the configured peers that are not
+		   linked to this broker, when the retry timer expires.
+
+	@param set The shards of the broker.
+**/
+void retry_peers(struct shard_set *set) {
+	struct federation *federation = set->federation;
+	u_int64_t expirations;
+	size_t i;
+
+	read(federation->retry_fd, &expirations, sizeof(expirations));
+	for (i = 0; i < federation->addresses.size(); i++) {
+		// a peer may be linked trough a connection it opened itself
+		if (federation->addresses[i].link != NO_PEER || federation->addresses[i].node == federation->node
+				|| (federation->addresses[i].node != 0 && linked_peer(federation, federation->addresses[i].node) != NO_PEER))
+			continue;
+		connect_peer(set, i);
+	}
+}
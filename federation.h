@@ -0,0 +1,96 @@
+#ifndef _FEDERATION_H
+#define _FEDERATION_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "out_queue.h"
+#include "frame_reader.h"
+#include "topic_trie.h"
+
+using namespace std;
+
+#define MAX_PEERS 32			// links of a broker (bits of a peer mask)
+#define NO_PEER -1
+#define PEER_RETRY_US 1000000	// delay before connecting again to a configured peer
+
+// operations of a PEER_INTEREST message (first payload byte, the topic or pattern follows)
+#define INTEREST_REMOVE 0
+#define INTEREST_ADD 1
+#define INTEREST_CLEAR 2		// between shards only: every interest of a lost peer
+
+struct shard_set;
+struct msg_buf;
+struct TCP_msg;
+
+/*
+ * Topics and patterns subscribed on the peer brokers (or on the other shards),
+ * as known by a shard. The peers that want a message are found from its topic
+ * as its local subscribers are, with the index of the peer in place of a
+ * subscriber.
+ */
+struct peer_interest {
+	unordered_map <string, u_int64_t> topics;	// name -> peers that subscribed it
+	unordered_map <string, u_int64_t> patterns;	// wildcard pattern -> peers that subscribed it
+	struct topic_trie trie;	// the patterns, one subscription per peer
+	u_int64_t peers;		// peers that may want messages, 0 if none does
+	string lookup;			// reused by interested_peers()
+	vector <struct subscription> matches;	// reused by interested_peers()
+};
+
+// peer broker given with --peer, connected again while its link is down
+struct peer_address {
+	struct sockaddr_in addr;
+	u_int64_t node;		// ID of the broker found at this address, 0 before its hello
+	int link;			// index of its link, NO_PEER if it is not connected
+};
+
+// TCP connection to a peer broker
+struct peer_link {
+	int socket;
+	bool connecting;	// the (non-blocking) connect did not complete yet
+	bool established;	// the hello of the peer was received
+	bool want_write;	// EPOLLOUT is armed for the socket
+	int address;		// index of the configured address, NO_PEER for accepted links
+	u_int64_t node;		// ID of the peer broker
+	char name[INET_ADDRSTRLEN + 8];	// address:port, for the messages of the server
+	struct frame_reader reader;
+	struct out_queue queue;
+};
+
+/*
+ * Links of a broker to its peers, handled by shard 0. Every broker announces
+ * the topics and patterns its subscribers subscribed (on all its shards) and
+ * receives the messages of the peers that match them. Messages received from
+ * a peer are only delivered locally, so peers must form a full mesh.
+ */
+struct federation {
+	u_int64_t node;		// random ID of this broker
+	int epoll_fd;		// event loop of shard 0
+	int retry_fd;		// timer for connecting again to the configured peers
+	size_t queue_limit;	// of the send queue of a link
+	struct peer_link links[MAX_PEERS];
+	u_int32_t active;	// links in use
+	u_int32_t dirty;	// links that got frames since they were written
+	vector <struct peer_address> addresses;
+	unordered_map <string, u_int32_t> interest;	// local subscriptions, by topic or pattern
+};
+
+void update_peer_interest(struct peer_interest *interest, int peer, u_int8_t op, string_view name);
+u_int64_t interested_peers(struct peer_interest *interest, string_view topic);
+
+struct federation *create_federation(vector <struct sockaddr_in> &addresses, int epoll_fd, size_t queue_limit);
+void close_federation(struct federation *federation);
+int peer_by_fd(struct federation *federation, int fd);
+void accept_peer(struct shard_set *set, int socket, struct frame_reader *reader, struct TCP_msg *msg,
+				struct sockaddr_in *addr);
+void handle_peer_event(struct shard_set *set, int peer, u_int32_t events);
+void count_interest(struct federation *federation, u_int8_t op, string_view name);
+void forward_to_peers(struct shard_set *set, struct msg_buf *buf, u_int32_t peers);
+void flush_peers(struct shard_set *set);
+void retry_peers(struct shard_set *set);
+
+#endif
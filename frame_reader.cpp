@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "frame_reader.h"
+#include "custom_TCP.h"
+
+/**
+	@brief Function that allocates the receive buffer of a connection.
+
+	@param reader The reader to be initialized.
+	@param capacity Size of the buffer; a larger buffer lets a client decode
+					more frames for every read.
+**/
+void init_reader(struct frame_reader *reader, u_int32_t capacity) {
+	reader->buffer = (char *) malloc(capacity);
+	reader->capacity = capacity;
+	reader->start = 0;
+	reader->end = 0;
+}
+
+/**
+	@brief Function that releases the receive buffer of a connection.
+
+	@param reader The reader to be released.
+**/
+void free_reader(struct frame_reader *reader) {
+	free(reader->buffer);
+	reader->buffer = NULL;
+	reader->start = 0;
+	reader->end = 0;
+}
+
+/**
+	@brief Function that reads as many bytes as are available on a socket
+		   (and fit in the buffer) with a single recv() call. The partial
+		   frame left from a previous call is first moved to the beginning
+		   of the buffer.
+
+	@param socket The socket of the connection.
+	@param reader The receive buffer of the connection.
+
+	@return int Number of bytes read, READ_AGAIN if there was nothing to read
+				or READ_CLOSED if the connection was closed or broken.
+**/
+int fill_reader(int socket, struct frame_reader *reader) {
+	ssize_t bytes_received;
+
+	if (reader->start > 0) {
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+
+	do {
+		bytes_received = recv(socket, reader->buffer + reader->end, reader->capacity - reader->end, 0);
+	} while (bytes_received == -1 && errno == EINTR);
+
+	if (bytes_received == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? READ_AGAIN : READ_CLOSED;
+	if (bytes_received == 0)
+		return READ_CLOSED;
+
+	reader->end += bytes_received;
+	return bytes_received;
+}
+
+/**
+	@brief Function that finds the next complete v1 frame in a receive buffer,
+		   without copying it. The frame stays valid until the buffer is
+		   filled again.
+
+	@param reader The receive buffer of the connection.
+	@param frame Where the address of the frame is stored.
+	@param length Where the length of the frame is stored.
+
+	@return int FRAME_READY, FRAME_INCOMPLETE or FRAME_INVALID.
+**/
+int peek_frame(struct frame_reader *reader, const char **frame, u_int32_t *length) {
+	u_int32_t available = reader->end - reader->start;
+
+	if (available < sizeof(*length))
+		return FRAME_INCOMPLETE;
+
+	memcpy(length, reader->buffer + reader->start, sizeof(*length));
+	*length = ntohl(*length);
+	if (*length < MIN_FRAME_SIZE || *length > sizeof(struct TCP_msg))
+		return FRAME_INVALID;
+	if (available < *length)
+		return FRAME_INCOMPLETE;
+
+	*frame = reader->buffer + reader->start;
+	reader->start += *length;
+	return FRAME_READY;
+}
+
+/**
+	@brief Function that decodes the next complete frame from a receive buffer.
+		   Only the bytes of the frame are copied; the payload is terminated
+		   with a null byte, so that it can be used as a string.
+
+	@param reader The receive buffer of the connection.
+	@param msg Pointer to the structure that will store the decoded message.
+
+	@return int FRAME_READY if a message was decoded, FRAME_INCOMPLETE if the
+				buffer holds only a part of the next frame and FRAME_INVALID
+				if the length of the next frame is not valid.
+**/
+int next_frame(struct frame_reader *reader, struct TCP_msg *msg) {
+	const char *frame;
+	u_int32_t length;
+	int ret;
+
+	if ((ret = peek_frame(reader, &frame, &length)) != FRAME_READY)
+		return ret;
+
+	// a frame shorter than the header has no payload, none of the previous frame may be left in place
+	if (length < HEADER_SIZE)
+		memset((char *) msg + length, 0, HEADER_SIZE + 1 - length);
+	memcpy(msg, frame, length);
+	if (length < sizeof(struct TCP_msg))
+		((char *) msg)[length] = '\0';
+	else
+		msg->payload[sizeof(msg->payload) - 1] = '\0';
+
+	return FRAME_READY;
+}
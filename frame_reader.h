@@ -0,0 +1,38 @@
+#ifndef _FRAME_READER_H
+#define _FRAME_READER_H
+
+#include <sys/types.h>
+
+#define READ_BUFFER_SIZE 8192
+#define MIN_FRAME_SIZE 5	// length + type
+
+// results of fill_reader()
+#define READ_CLOSED 0
+#define READ_AGAIN -1
+
+// results of next_frame()
+#define FRAME_READY 0
+#define FRAME_INCOMPLETE 1
+#define FRAME_INVALID 2
+
+struct TCP_msg;
+
+/*
+ * Receive buffer of a connection. Bytes between start and end were received
+ * but not decoded yet; they always begin at a frame boundary, so a partial
+ * frame is simply kept until the rest of it arrives.
+ */
+struct frame_reader {
+	char *buffer;
+	u_int32_t capacity;
+	u_int32_t start;
+	u_int32_t end;
+};
+
+void init_reader(struct frame_reader *reader, u_int32_t capacity = READ_BUFFER_SIZE);
+void free_reader(struct frame_reader *reader);
+int fill_reader(int socket, struct frame_reader *reader);
+int peek_frame(struct frame_reader *reader, const char **frame, u_int32_t *length);
+int next_frame(struct frame_reader *reader, struct TCP_msg *msg);
+
+#endif
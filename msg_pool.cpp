@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <new>
+#include "msg_pool.h"
+#include "custom_TCP.h"
+
+// capacity of every size class; the largest one fits a whole TCP_msg
+static const u_int32_t class_capacity[NR_SIZE_CLASSES] = {64, 128, 256, 512, 1024, sizeof(struct TCP_msg)};
+
+// pool of the current thread (every shard sets its own)
+static thread_local struct msg_pool *thread_pool = NULL;
+
+// helper, size of a buffer of a size class, rounded up to keep data aligned
+static size_t buffer_size(int size_class) {
+	return (offsetof(struct msg_buf, data) + class_capacity[size_class] + 7) & ~(size_t) 7;
+}
+
+/**
+	@brief Function that creates an empty pool of message buffers.
+
+	@return struct msg_pool* The new pool.
+**/
+struct msg_pool *create_msg_pool() {
+	struct msg_pool *pool = new struct msg_pool;
+	int i;
+
+	for (i = 0; i < NR_SIZE_CLASSES; i++)
+		pool->free_lists[i] = NULL;
+	pool->remote_free.store(NULL);
+	pool->slab_bytes = 0;
+
+	return pool;
+}
+
+/**
+	@brief Function that selects the pool used by alloc_msg() on the calling thread.
+
+	@param pool The pool of the thread.
+**/
+void set_thread_pool(struct msg_pool *pool) {
+	thread_pool = pool;
+}
+
+// helper, carve a new slab into free buffers of a size class
+static void grow_pool(struct msg_pool *pool, int size_class) {
+	size_t size = buffer_size(size_class);
+	char *slab = (char *) malloc(size * SLAB_BUFFERS);
+	int i;
+
+	ABORT(slab == NULL, "Message pool: ALLOCATION error\n");
+	for (i = 0; i < SLAB_BUFFERS; i++) {
+		struct msg_buf *buf = (struct msg_buf *) (slab + i * size);
+
+		new (&buf->refs) std::atomic <u_int32_t>(0);
+		buf->size_class = size_class;
+		buf->pool = pool;
+		buf->next = pool->free_lists[size_class];
+		pool->free_lists[size_class] = buf;
+	}
+	pool->slab_bytes += size * SLAB_BUFFERS;
+}
+
+// helper, move the buffers released by other threads to the local free lists
+static void collect_remote(struct msg_pool *pool) {
+	struct msg_buf *buf = pool->remote_free.exchange(NULL, std::memory_order_acquire), *next;
+
+	while (buf != NULL) {
+		next = buf->next;
+		buf->next = pool->free_lists[buf->size_class];
+		pool->free_lists[buf->size_class] = buf;
+		buf = next;
+	}
+}
+
+/**
+	@brief Function that takes a buffer from the pool of the calling thread.
+		   The caller owns the only reference.
+
+	@param length Number of bytes needed (at most sizeof(struct TCP_msg)).
+	@return struct msg_buf* The buffer, with length already set.
+**/
+struct msg_buf *alloc_msg(u_int32_t length) {
+	struct msg_pool *pool = thread_pool;
+	struct msg_buf *buf;
+	int size_class = 0;
+
+	while (class_capacity[size_class] < length)
+		size_class++;
+
+	if (pool->free_lists[size_class] == NULL) {
+		collect_remote(pool);
+		if (pool->free_lists[size_class] == NULL)
+			grow_pool(pool, size_class);
+	}
+
+	buf = pool->free_lists[size_class];
+	pool->free_lists[size_class] = buf->next;
+	buf->refs.store(1, std::memory_order_relaxed);
+	buf->length = length;
+	buf->time = 0;
+
+	return buf;
+}
+
+/**
+	@brief Function that drops a reference to a buffer. The last reference
+		   returns the buffer to the pool that allocated it.
+
+	@param buf The buffer.
+**/
+void release_msg(struct msg_buf *buf) {
+	struct msg_pool *pool = buf->pool;
+	struct msg_buf *head;
+
+	if (buf->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	if (pool == thread_pool) {
+		buf->next = pool->free_lists[buf->size_class];
+		pool->free_lists[buf->size_class] = buf;
+		return;
+	}
+
+	head = pool->remote_free.load(std::memory_order_relaxed);
+	do {
+		buf->next = head;
+	} while (!pool->remote_free.compare_exchange_weak(head, buf, std::memory_order_release,
+													std::memory_order_relaxed));
+}
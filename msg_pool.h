@@ -0,0 +1,49 @@
+#ifndef _MSG_POOL_H
+#define _MSG_POOL_H
+
+#include <sys/types.h>
+#include <atomic>
+
+#define NR_SIZE_CLASSES 6
+#define SLAB_BUFFERS 64		// buffers carved from every slab
+
+struct msg_pool;
+
+/*
+ * Encoded message shared by every send queue and SF backlog that holds it.
+ * It returns to the pool of the thread that allocated it when the last
+ * reference is released.
+ */
+struct msg_buf {
+	std::atomic <u_int32_t> refs;
+	u_int32_t length;		// bytes used in data
+	u_int64_t time;		// monotonic time (ns) the message was received, 0 if unknown
+	u_int8_t size_class;
+	struct msg_pool *pool;
+	struct msg_buf *next;	// link in the free lists
+	alignas(8) char data[];
+};
+
+/*
+ * Free buffers of a thread, one list per size class. Buffers released by
+ * other threads are pushed on a lock-free list and collected by the owner
+ * when its local lists are empty.
+ */
+struct msg_pool {
+	struct msg_buf *free_lists[NR_SIZE_CLASSES];
+	std::atomic <struct msg_buf *> remote_free;
+	size_t slab_bytes;
+};
+
+struct msg_pool *create_msg_pool();
+void set_thread_pool(struct msg_pool *pool);
+struct msg_buf *alloc_msg(u_int32_t length);
+void release_msg(struct msg_buf *buf);
+
+// take one more reference to a buffer
+static inline struct msg_buf *hold_msg(struct msg_buf *buf) {
+	buf->refs.fetch_add(1, std::memory_order_relaxed);
+	return buf;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <sys/uio.h>
+#include "out_queue.h"
+#include "event_loop.h"
+
+/**
+	@brief Function that appends a frame to an outbound queue. The queue takes
+		   its own reference to the frame.
+
+	@param queue The queue of the destination connection.
+	@param frame The encoded frame.
+**/
+void push_frame(struct out_queue *queue, struct msg_buf *frame) {
+	queue->frames.push_back(hold_msg(frame));
+	queue->bytes += frame->length;
+}
+
+/**
+	@brief Function that writes as much as possible from an outbound queue,
+		   gathering up to MAX_IOV frames in every writev() call.
+
+	@param socket The non-blocking socket of the connection.
+	@param queue The queue to be flushed.
+	@param stats Where the writes, the bytes sent and the delay of every sent
+				 message are counted.
+
+	@return int QUEUE_EMPTY if everything was sent, QUEUE_PENDING if the socket
+				is full and QUEUE_ERROR if the connection is broken.
+**/
+int flush_queue(int socket, struct out_queue *queue, struct broker_stats *stats) {
+	struct iovec iov[MAX_IOV];
+	int nr_iov;
+	ssize_t bytes_sent;
+
+	while (!queue->frames.empty()) {
+		nr_iov = gather_queue(queue, iov);
+		bytes_sent = writev(socket, iov, nr_iov);
+		if (bytes_sent == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return QUEUE_PENDING;
+			return QUEUE_ERROR;
+		}
+		consume_queue(queue, bytes_sent, stats);
+	}
+
+	return QUEUE_EMPTY;
+}
+
+/**
+	@brief Function that describes the first MAX_IOV frames of an outbound
+		   queue (minus the part of the first frame that was already sent).
+
+	@param queue A queue that is not empty.
+	@param iov Where the frames are described (MAX_IOV entries).
+
+	@return int Number of entries filled.
+**/
+int gather_queue(struct out_queue *queue, struct iovec *iov) {
+	int nr_iov;
+	deque<struct msg_buf *>::iterator iter;
+
+	nr_iov = 0;
+	for (iter = queue->frames.begin(); iter != queue->frames.end() && nr_iov < MAX_IOV; iter++, nr_iov++) {
+		iov[nr_iov].iov_base = (*iter)->data;
+		iov[nr_iov].iov_len = (*iter)->length;
+	}
+	iov[0].iov_base = (char *) iov[0].iov_base + queue->head_sent;
+	iov[0].iov_len -= queue->head_sent;
+
+	return nr_iov;
+}
+
+/**
+	@brief Function that removes the bytes written by one write from the front
+		   of an outbound queue, releasing the frames that were completely sent.
+
+	@param queue The queue that was written.
+	@param bytes_sent Number of bytes written.
+	@param stats Where the write, the bytes sent and the delay of every sent
+				 message are counted.
+**/
+void consume_queue(struct out_queue *queue, size_t bytes_sent, struct broker_stats *stats) {
+	u_int64_t now = 0;
+
+	count_stat(stats, STAT_WRITES, 1);
+	count_stat(stats, STAT_BYTES_SENT, bytes_sent);
+
+	queue->bytes -= bytes_sent;
+	while (bytes_sent > 0) {
+		struct msg_buf *front = queue->frames.front();
+		u_int32_t remaining = front->length - queue->head_sent;
+
+		if (bytes_sent < remaining) {
+			queue->head_sent += bytes_sent;
+			break;
+		}
+		bytes_sent -= remaining;
+		if (front->time != 0) {
+			if (now == 0)
+				now = monotonic_ns();
+			record_value(stats, HIST_PUBLISH_TO_SEND_NS, now - front->time);
+		}
+		release_msg(front);
+		queue->frames.pop_front();
+		queue->first_seq++;
+		queue->head_sent = 0;
+	}
+}
+
+/**
+	@brief Function that drops every frame of an outbound queue (used when the
+		   connection is closed).
+
+	@param queue The queue to be cleared.
+**/
+void clear_queue(struct out_queue *queue) {
+	while (!queue->frames.empty()) {
+		release_msg(queue->frames.front());
+		queue->frames.pop_front();
+		queue->first_seq++;
+	}
+	queue->head_sent = 0;
+	queue->bytes = 0;
+}
+
+/**
+	@brief Function that replaces a frame that is still waiting in an
+		   outbound queue by a newer one (used to conflate messages).
+
+	@param queue The queue.
+	@param seq Number of the frame to be replaced.
+	@param locked Number of frames at the front of the queue that may not be
+				  replaced anymore (being written or partially sent).
+	@param frame The new frame; the queue takes its own reference to it.
+
+	@return bool False if the frame already left the queue or is locked.
+**/
+bool replace_frame(struct out_queue *queue, u_int64_t seq, u_int32_t locked, struct msg_buf *frame) {
+	struct msg_buf **slot;
+
+	if (queue->head_sent > 0 && locked == 0)
+		locked = 1;
+	if (seq < queue->first_seq + locked || seq >= queue->first_seq + queue->frames.size())
+		return false;
+
+	slot = &queue->frames[seq - queue->first_seq];
+	queue->bytes += frame->length;
+	queue->bytes -= (*slot)->length;
+	release_msg(*slot);
+	*slot = hold_msg(frame);
+	return true;
+}
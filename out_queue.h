@@ -0,0 +1,43 @@
+#ifndef _OUT_QUEUE_H
+#define _OUT_QUEUE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
+#include "msg_pool.h"
+#include "stats.h"
+
+using namespace std;
+
+#define MAX_IOV 64
+
+#define QUEUE_EMPTY 0
+#define QUEUE_PENDING 1
+#define QUEUE_ERROR -1
+
+/*
+ * Outbound frames of a non-blocking connection, in sending order. The queue
+ * holds a reference to every (shared) frame. The first frame may be partially
+ * sent (head_sent bytes already written). Frames are numbered in the order
+ * they are pushed, so a frame can be found again while it waits.
+ */
+struct out_queue {
+	deque<struct msg_buf *> frames;
+	u_int32_t head_sent;
+	size_t bytes;
+	u_int64_t first_seq;	// number of the first frame
+};
+
+void push_frame(struct out_queue *queue, struct msg_buf *frame);
+int flush_queue(int socket, struct out_queue *queue, struct broker_stats *stats);
+int gather_queue(struct out_queue *queue, struct iovec *iov);
+void consume_queue(struct out_queue *queue, size_t bytes_sent, struct broker_stats *stats);
+void clear_queue(struct out_queue *queue);
+bool replace_frame(struct out_queue *queue, u_int64_t seq, u_int32_t locked, struct msg_buf *frame);
+
+// number of the last frame pushed
+static inline u_int64_t last_seq(struct out_queue *queue) {
+	return queue->first_seq + queue->frames.size() - 1;
+}
+
+#endif
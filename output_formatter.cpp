@@ -0,0 +1,149 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <charconv>
+#include <arpa/inet.h>
+#include "output_formatter.h"
+#include "broker_client.h"
+
+// helper, append bytes to the line being rendered
+static char *put_text(char *out, const char *text, size_t length) {
+	memcpy(out, text, length);
+	return out + length;
+}
+
+// helper, append a number to the line being rendered
+template <typename T>
+static char *put_number(char *out, T value) {
+	return std::to_chars(out, out + 24, value).ptr;
+}
+
+// helper, append "a.b.c.d:port - "
+static char *put_address(char *out, struct in_addr address, u_int16_t port) {
+	const u_int8_t *bytes = (const u_int8_t *) &address.s_addr;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		out = put_number(out, bytes[i]);
+		*out++ = i < 3 ? '.' : ':';
+	}
+	out = put_number(out, ntohs(port));
+	return put_text(out, " - ", 3);
+}
+
+/*
+ * helper, append value / 10 ^ exponent, without trailing ".0..." for an
+ * integer value; the digits after the dot are padded with zeros to exponent
+ */
+static char *put_real(char *out, u_int32_t value, u_int8_t exponent, bool negative) {
+	u_int64_t power = 1, before_dot, after_dot;
+	char digits[16];
+	char *digits_end;
+	int i;
+
+	// 10 ^ 10 is already larger than any 32 bits value
+	for (i = 0; i < exponent && i < 10; i++)
+		power *= 10;
+	before_dot = value / power;
+	after_dot = value % power;
+
+	if (negative)
+		*out++ = '-';
+	out = put_number(out, before_dot);
+	if (after_dot == 0) {
+		*out++ = '\n';
+		return out;
+	}
+
+	*out++ = '.';
+	digits_end = std::to_chars(digits, digits + sizeof(digits), after_dot).ptr;
+	for (i = digits_end - digits; i < exponent; i++)
+		*out++ = '0';
+	out = put_text(out, digits, digits_end - digits);
+	*out++ = '\n';
+	return out;
+}
+
+/**
+	@brief Function that initializes the output buffer of the subscriber.
+
+	@param output The buffer.
+	@param fd Where the buffer is written (the standard output).
+	@param line_flush True to write every message as soon as it is rendered.
+**/
+void init_output(struct output_buffer *output, int fd, bool line_flush) {
+	output->fd = fd;
+	output->line_flush = line_flush;
+	output->used = 0;
+}
+
+/**
+	@brief Function that renders a PUBLISH message in the output buffer, as
+		   "IP:PORT - TOPIC - TYPE - VALUE".
+
+	@param output The buffer.
+	@param message The message.
+**/
+void format_message(struct output_buffer *output, const struct message_view *message) {
+	char *out;
+	string_view text;
+	u_int32_t value32;
+	u_int16_t value16;
+	u_int8_t exponent;
+	int32_t integer;
+	bool negative;
+
+	if (output->used + MAX_LINE_SIZE > OUTPUT_BUFFER_SIZE)
+		flush_output(output);
+	out = output->data + output->used;
+
+	out = put_address(out, message->UDP_addr, message->UDP_port);
+	if (view_int(message, &integer)) {
+		out = put_text(out, message->topic.data(), message->topic.size());
+		out = put_text(out, " - INT - ", 9);
+		out = put_number(out, integer);
+		*out++ = '\n';
+	} else if (view_short_real(message, &value16)) {
+		out = put_text(out, message->topic.data(), message->topic.size());
+		out = put_text(out, " - SHORT_REAL - ", 16);
+		out = put_real(out, value16, 2, false);
+	} else if (view_float(message, &value32, &exponent, &negative)) {
+		out = put_text(out, message->topic.data(), message->topic.size());
+		out = put_text(out, " - FLOAT - ", 11);
+		out = put_real(out, value32, exponent, negative);
+	} else if (message->data_type == TYPE_STRING) {
+		text = view_string(message);
+		if (text.size() > MAX_LINE_SIZE - 128)
+			text = text.substr(0, MAX_LINE_SIZE - 128);
+		out = put_text(out, message->topic.data(), message->topic.size());
+		out = put_text(out, " - STRING - ", 12);
+		out = put_text(out, text.data(), text.size());
+		*out++ = '\n';
+	}
+	// unknown types (or truncated values) only get the address of the publisher
+
+	output->used = out - output->data;
+	if (output->line_flush)
+		flush_output(output);
+}
+
+/**
+	@brief Function that writes everything rendered in the output buffer.
+
+	@param output The buffer.
+**/
+void flush_output(struct output_buffer *output) {
+	size_t written = 0;
+	ssize_t ret;
+
+	while (written < output->used) {
+		ret = write(output->fd, output->data + written, output->used - written);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += ret;
+	}
+	output->used = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _OUTPUT_FORMATTER_H
+#define _OUTPUT_FORMATTER_H
+
+#include <sys/types.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define MAX_LINE_SIZE 2048	// longest line rendered for a message
+
+struct message_view;
+
+/*
+ * Block buffer where the subscriber renders the received messages. It is
+ * written with a single call when it fills up or when the subscriber has no
+ * more messages to decode; in line flush mode, after every message.
+ */
+struct output_buffer {
+	int fd;
+	bool line_flush;
+	size_t used;
+	char data[OUTPUT_BUFFER_SIZE];
+};
+
+void init_output(struct output_buffer *output, int fd, bool line_flush);
+void format_message(struct output_buffer *output, const struct message_view *message);
+void flush_output(struct output_buffer *output);
+
+#endif
@@ -0,0 +1,153 @@
+#include <string.h>
+#include "protocol_v2.h"
+#include "custom_TCP.h"
+
+/**
+	@brief Function that writes a varint: 7 bits in every byte, starting with
+		   the least significant ones; the high bit is set in every byte but
+		   the last one.
+
+	@param out Where the varint is written (at most MAX_VARINT_SIZE bytes).
+	@param value The value.
+
+	@return int Number of bytes written.
+**/
+int put_varint(char *out, u_int32_t value) {
+	int size = 0;
+
+	while (value >= 0x80) {
+		out[size++] = (char) (value | 0x80);
+		value >>= 7;
+	}
+	out[size++] = (char) value;
+	return size;
+}
+
+/**
+	@brief Function that reads a varint.
+
+	@param in The bytes of the varint.
+	@param available Number of bytes that can be read.
+	@param value Where the value is stored.
+
+	@return int Number of bytes read, VARINT_INCOMPLETE if more bytes are needed
+				or VARINT_INVALID if the varint is too long.
+**/
+int get_varint(const char *in, u_int32_t available, u_int32_t *value) {
+	u_int32_t result = 0;
+	u_int32_t i;
+
+	for (i = 0; i < MAX_VARINT_SIZE; i++) {
+		if (i == available)
+			return VARINT_INCOMPLETE;
+		result |= (u_int32_t) (in[i] & 0x7f) << (7 * i);
+		if ((in[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
+	return VARINT_INVALID;
+}
+
+// helper, put the length in front of the body of a frame
+static struct msg_buf *make_v2_frame(const char *body, u_int32_t body_length) {
+	char length[MAX_VARINT_SIZE];
+	int length_size = put_varint(length, body_length);
+	struct msg_buf *buf = alloc_msg(length_size + body_length);
+
+	memcpy(buf->data, length, length_size);
+	memcpy(buf->data + length_size, body, body_length);
+	return buf;
+}
+
+/**
+	@brief Function that encodes a PUBLISH message in the v2 protocol, from
+		   its v1 frame (the one stored in send queues and in the SF log).
+
+	@param v1_frame The v1 frame.
+	@param alias Alias of the topic, already announced on the connection, or
+				 NO_ALIAS to send the topic inline.
+
+	@return struct msg_buf* The v2 frame (the caller owns the reference).
+**/
+struct msg_buf *encode_v2_publish(struct msg_buf *v1_frame, u_int32_t alias) {
+	const struct TCP_msg *msg = (const struct TCP_msg *) v1_frame->data;
+	u_int32_t payload_length = v1_frame->length - HEADER_SIZE;
+	u_int32_t topic_length = strnlen(msg->payload, payload_length < TOPIC_SIZE ? payload_length : TOPIC_SIZE);
+	u_int32_t content_length = payload_length > TOPIC_SIZE ? payload_length - TOPIC_SIZE : 0;
+	char body[sizeof(struct TCP_msg)];
+	struct msg_buf *frame;
+	u_int32_t size;
+
+	size = put_varint(body, PUBLISH);
+	size += put_varint(body + size, alias);
+	if (alias == NO_ALIAS) {
+		size += put_varint(body + size, topic_length);
+		memcpy(body + size, msg->payload, topic_length);
+		size += topic_length;
+	}
+	memcpy(body + size, &msg->UDP_addr, sizeof(msg->UDP_addr));
+	size += sizeof(msg->UDP_addr);
+	memcpy(body + size, &msg->UDP_port, sizeof(msg->UDP_port));
+	size += sizeof(msg->UDP_port);
+	memcpy(body + size, msg->payload + TOPIC_SIZE, content_length);
+	size += content_length;
+
+	frame = make_v2_frame(body, size);
+	frame->time = v1_frame->time;
+	return frame;
+}
+
+/**
+	@brief Function that encodes the announcement of a topic alias.
+
+	@param alias The alias.
+	@param topic Name of the topic.
+
+	@return struct msg_buf* The v2 frame (the caller owns the reference).
+**/
+struct msg_buf *encode_v2_alias(u_int32_t alias, string_view topic) {
+	char body[2 * MAX_VARINT_SIZE + TOPIC_SIZE];
+	u_int32_t size, topic_length = topic.size() < TOPIC_SIZE ? topic.size() : TOPIC_SIZE;
+
+	size = put_varint(body, TOPIC_ALIAS);
+	size += put_varint(body + size, alias);
+	memcpy(body + size, topic.data(), topic_length);
+	size += topic_length;
+
+	return make_v2_frame(body, size);
+}
+
+/**
+	@brief Function that finds the next complete v2 frame in a receive buffer.
+		   The body is not copied, it stays valid until the buffer is filled
+		   again.
+
+	@param reader The receive buffer of the connection.
+	@param type Where the type of the frame is stored.
+	@param body Where the address of the body is stored.
+	@param body_length Where the length of the body is stored.
+
+	@return int FRAME_READY, FRAME_INCOMPLETE or FRAME_INVALID.
+**/
+int next_v2_frame(struct frame_reader *reader, u_int32_t *type, const char **body, u_int32_t *body_length) {
+	u_int32_t length, available = reader->end - reader->start;
+	const char *frame = reader->buffer + reader->start;
+	int length_size, type_size;
+
+	length_size = get_varint(frame, available, &length);
+	if (length_size == VARINT_INVALID
+			|| (length_size != VARINT_INCOMPLETE && (length == 0 || length > sizeof(struct TCP_msg))))
+		return FRAME_INVALID;
+	if (length_size == VARINT_INCOMPLETE || available < length_size + length)
+		return FRAME_INCOMPLETE;
+
+	type_size = get_varint(frame + length_size, length, type);
+	if (type_size <= 0)
+		return FRAME_INVALID;
+
+	*body = frame + length_size + type_size;
+	*body_length = length - type_size;
+	reader->start += length_size + length;
+	return FRAME_READY;
+}
@@ -0,0 +1,42 @@
+#ifndef _PROTOCOL_V2_H
+#define _PROTOCOL_V2_H
+
+#include <sys/types.h>
+#include <string_view>
+#include "msg_pool.h"
+
+using namespace std;
+
+// protocol versions, requested by the client in its ID message
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+#define MAX_VARINT_SIZE 5
+#define TOPIC_SIZE 50		// topic slot of a v1 PUBLISH payload
+#define NO_ALIAS 0			// the topic is sent inline
+
+// results of get_varint()
+#define VARINT_INCOMPLETE 0
+#define VARINT_INVALID -1
+
+struct frame_reader;
+
+/*
+ * v2 frames (server -> client):
+ *
+ *   varint length (of what follows) | varint type | body
+ *
+ *   TOPIC_ALIAS: varint alias | topic name
+ *   PUBLISH:     varint alias | [varint topic length | topic, if alias is NO_ALIAS]
+ *                | UDP_addr (4) | UDP_port (2) | data type | value
+ *
+ * An alias is announced once per connection, before its first PUBLISH.
+ */
+
+int put_varint(char *out, u_int32_t value);
+int get_varint(const char *in, u_int32_t available, u_int32_t *value);
+struct msg_buf *encode_v2_publish(struct msg_buf *v1_frame, u_int32_t alias);
+struct msg_buf *encode_v2_alias(u_int32_t alias, string_view topic);
+int next_v2_frame(struct frame_reader *reader, u_int32_t *type, const char **body, u_int32_t *body_length);
+
+#endif
@@ -4,20 +4,32 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <unordered_map>
 #include <iterator>
 #include "custom_TCP.h"
+#include "event_loop.h"
+#include "udp_ingest.h"
+#include "shards.h"
+#include "uring.h"
+#include "admission.h"
 
 using namespace std;
 
 #define MAX_QUEUE_CLIENTS 10
-#define TCP_CONNECT_IDX 0
-#define UDP_IDX 1
-#define STDIN_IDX 2
+#define USAGE "Invalid number of arguments.\n \
+					./server <PORT> [--queue-limit <BYTES>] [--overflow drop|disconnect|sf] [--threads <N>]\n \
+					[--sf-dir <DIR>] [--sf-max-bytes <BYTES>] [--sf-max-age <SECONDS>]\n \
+					[--linger-us <US>] [--coalesce-bytes <BYTES>] [--stats-socket <PATH>] [--io-uring]\n \
+					[--retain-bytes <BYTES>] [--shm-bytes <BYTES>] [--resume-bytes <BYTES>]\n \
+					[--listen-backlog <N>] [--handshake-ms <MS>] [--federate] [--peer <IP>:<PORT>]...\n"
 
 /**
 	@brief Function that creates a new socket for UDP communication.
@@ -49,9 +61,10 @@ int create_UDP_socket(char *port) {
 	@brief Function that creates a new socket that will listen for new TCP connections.
 
 	@param port Port for TCP listening.
+	@param backlog Connections the kernel queues until they are accepted.
 	@return int The socket created.
 **/ 
-int create_TCP_passive_socket(char *port) {
+int create_TCP_passive_socket(char *port, int backlog) {
 	int socket_TCP, errors;
 	struct sockaddr_in TCP_addr;
 	int enable = 1;
@@ -66,7 +79,7 @@ int create_TCP_passive_socket(char *port) {
 	TCP_addr.sin_port = htons(atoi(port));
 	errors = bind(socket_TCP, (struct sockaddr *) &TCP_addr, sizeof(TCP_addr));
 	ABORT(errors == -1, "TCP socket: BIND error\n");
-	errors = listen(socket_TCP, MAX_QUEUE_CLIENTS);
+	errors = listen(socket_TCP, backlog);
 	ABORT(errors == -1, "TCP socket: LISTEN error\n");
 
 	return socket_TCP;
@@ -74,132 +87,530 @@ int create_TCP_passive_socket(char *port) {
 
 
 /**
-	@brief Function that creates a new socket for communication with a TCP client.
+	@brief Function that creates the UNIX socket where the statistics of the
+		   broker can be read (a stale socket file is replaced).
 
-	@param socket_TCP The TCP passive socket that detected the connection request.
-	@param clients_table Subscribers hashtable. Used to register the new client.
-	@param unsent_table Unsent messages table. If the an old client connects again,
-						we will use this table to send the messages he lost while
-						being disconnected.
+	@param path Path of the socket.
 	@return int The socket created.
+**/
+int create_stats_socket(const char *path) {
+	int socket_stats, errors;
+	struct sockaddr_un stats_addr;
+
+	ABORT(strlen(path) >= sizeof(stats_addr.sun_path), "Stats socket: path too long\n");
+	socket_stats = socket(AF_UNIX, SOCK_STREAM, 0);
+	ABORT(socket_stats == -1, "Stats socket: CREATE error\n");
+	memset((char *) &stats_addr, 0, sizeof(stats_addr));
+	stats_addr.sun_family = AF_UNIX;
+	strcpy(stats_addr.sun_path, path);
+	unlink(path);
+	errors = bind(socket_stats, (struct sockaddr *) &stats_addr, sizeof(stats_addr));
+	ABORT(errors == -1, "Stats socket: BIND error\n");
+	errors = listen(socket_stats, MAX_QUEUE_CLIENTS);
+	ABORT(errors == -1, "Stats socket: LISTEN error\n");
+
+	return socket_stats;
+}
+
+/**
+	@brief Function that writes a snapshot of the statistics of every shard,
+		   as one line of JSON.
+
+	@param set The shards of the broker.
+	@param fd Where the snapshot is written (stdout or a stats connection).
+**/
+void write_stats(struct shard_set *set, int fd) {
+	static struct stats_snapshot snapshot;
+	string text;
+	size_t written = 0;
+	ssize_t ret;
+	int i;
+
+	clear_snapshot(&snapshot);
+	for (i = 0; i < set->nr_shards; i++)
+		add_to_snapshot(&snapshot, &set->shards[i].broker.stats);
+	format_snapshot(&snapshot, text);
+
+	while (written < text.size()) {
+		ret = write(fd, text.data() + written, text.size() - written);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		written += ret;
+	}
+}
+
+/**
+	@brief Function that answers every pending connection on the stats socket
+		   with a snapshot, then closes it.
+
+	@param set The shards of the broker.
+**/
+void serve_stats(struct shard_set *set) {
+	int connection;
+
+	while ((connection = accept(set->stats_socket, NULL, NULL)) != -1) {
+		write_stats(set, connection);
+		close(connection);
+	}
+	WARNING(errno != EAGAIN && errno != EWOULDBLOCK, "Stats socket: ACCEPT error\n");
+}
+
+/**
+	@brief Function that accepts every pending TCP connection. New clients
+		   (and peer brokers) are admitted once their first frame arrives,
+		   see admit_handshake().
+
+	@param socket_TCP The TCP passive socket that detected the connection requests.
+	@param set The shards of the broker.
 **/ 
-int create_TCP_client_socket(int socket_TCP, unordered_map <string, Subscriber> &clients_table,
-							unordered_map <string, list<struct TCP_msg *>> unsent_table) {
-	int TCP_cli_len, enable, errors, new_socket, check_duplicate;
-	struct sockaddr_in TCP_cli_addr;
-	struct TCP_msg *msg = (struct TCP_msg *) calloc(1, sizeof(struct TCP_msg));
-	Subscriber new_subscriber = (Subscriber) calloc(1, sizeof(struct subscriber));
-
-	// accept connection and disable Neagle algorithm
-	TCP_cli_len = sizeof(TCP_cli_addr);
-	new_socket = accept(socket_TCP, (struct sockaddr*) &TCP_cli_addr, (socklen_t *) &TCP_cli_len);
-	WARNING(new_socket == -1, "TCP client: ACCEPT error\n");
-	enable = 1;
-	errors = setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
-	ABORT(errors == -1, "TCP client: SET SOCKET OPTIONS error\n");
+void accept_clients(int socket_TCP, struct shard_set *set) {
+	int TCP_cli_len, enable, errors, new_socket;
+	struct sockaddr_in addr;
+
+	while (true) {
+		// accept connection (non-blocking, subscriber sockets never block the broker)
+		TCP_cli_len = sizeof(addr);
+		new_socket = accept4(socket_TCP, (struct sockaddr*) &addr, (socklen_t *) &TCP_cli_len,
+							SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_socket == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			WARNING(errno != EAGAIN && errno != EWOULDBLOCK, "TCP client: ACCEPT error\n");
+			return;
+		}
+
+		// disable Neagle algorithm
+		enable = 1;
+		errors = setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+		ABORT(errors == -1, "TCP client: SET SOCKET OPTIONS error\n");
+
+		add_handshake(set->admission, new_socket, &addr);
+	}
+}
+
+/**
+	@brief Function that reads from a connection that did not identify itself
+		   yet. Once its ID message is complete, the client is registered by
+		   the shard that owns its ID (a hello opens the link of a peer
+		   broker); anything else closes the connection.
+
+	@param set The shards of the broker.
+	@param self Index of the shard that accepted the connection.
+	@param handshake The pending connection.
+**/
+void admit_handshake(struct shard_set *set, int self, struct handshake *handshake) {
+	struct handoff client;
+	int owner;
+
+	switch (read_handshake(handshake, &client.msg)) {
+	case FRAME_INCOMPLETE:
+		return;
+	case FRAME_INVALID:
+		drop_handshake(set->admission, handshake);
+		return;
+	}
+
+	// the bytes that followed the ID stay in the receive buffer
+	client.socket = handshake->socket;
+	client.reader = handshake->reader;
+	client.addr = handshake->addr;
+	remove_handshake(set->admission, handshake);
+
+	// another broker of the federation opens a link
+	if (client.msg.type == PEER_HELLO && set->federation != NULL) {
+		accept_peer(set, client.socket, &client.reader, &client.msg, &client.addr);
+		return;
+	}
+	if (client.msg.type != ID) {
+		free_reader(&client.reader);
+		close(client.socket);
+		return;
+	}
 
 	/*
-	 * Receive the ID of the new subscriber. If we have a duplicate (we already
-	 * have a connection with a same-id client), set the new socket to -1
-	 * and print corresponding message.
+	 * If we have a duplicate (we already have a connection with a same-id
+	 * client), the new socket is closed by the owner of the ID.
 	 */
-	unordered_map <string, list <Subscription>> null_table;  // empty table, used for valid receive_msg call
-	
-	check_duplicate = receive_msg(new_socket, msg, null_table, clients_table, unsent_table);
-	if (check_duplicate != DUPLICATE_CLIENT) {
-		printf("New client %s connected from %s:%d\n", msg->id, inet_ntoa(TCP_cli_addr.sin_addr), TCP_cli_addr.sin_port);
-	} else {
-		new_socket = -1;
+	owner = client_owner(set, client.msg.id);
+	if (owner != self) {
+		hand_off_client(set, owner, &client);
+		return;
 	}
 
-	return new_socket;
+	admit_client(&set->shards[self].broker, client.socket, &client.reader, &client.msg, &client.addr);
 }
 
+/**
+	@brief Function that parses the optional arguments of the server.
+
+	@param argc Number of arguments.
+	@param argv The arguments (argv[1] is the port).
+	@param config Broker state, where the send queue configuration is stored.
+	@param nr_threads Where the number of worker threads is stored.
+	@param use_uring Where the choice of the io_uring backend is stored.
+	@param peers Where the addresses of the peer brokers are stored.
+	@param federate Where the choice of accepting peer brokers is stored.
+**/
+void parse_options(int argc, char **argv, struct broker *config, int *nr_threads, bool *use_uring,
+				vector <struct sockaddr_in> *peers, bool *federate) {
+	struct sockaddr_in peer;
+	char *port;
+	int i;
 
-int main(int argc, char **argv) {
-	int errors, bytes_read, enable = 1, i;
-	unsigned int UDP_cli_len;
-	int socket_UDP, socket_TCP, new_socket;
-	int nr_descriptors = 3, descriptors_size = 3000;
-	struct pollfd* descriptors = (struct pollfd*) malloc(descriptors_size * sizeof(struct pollfd));
-	struct sockaddr_in UDP_cli_addr;
-	char buffer[BUFLEN];
-	struct TCP_msg msg, received_msg;
-	unordered_map <string, Subscriber> clients_table;
-	unordered_map <string, list <Subscription>> topics_table;
-	unordered_map <string, list<struct TCP_msg *>> unsent_table;
+	config->queue_limit = DEFAULT_QUEUE_LIMIT;
+	config->overflow_policy = OVERFLOW_DROP;
+	config->sf_dir = NULL;
+	config->sf_max_bytes = 0;
+	config->sf_max_age = 0;
+	config->linger_us = DEFAULT_LINGER_US;
+	config->coalesce_bytes = DEFAULT_COALESCE_BYTES;
+	config->stats_socket = NULL;
+	config->retain_max_bytes = DEFAULT_RETAIN_BYTES;
+	config->shm_bytes = DEFAULT_SHM_BYTES;
+	config->resume_bytes = DEFAULT_RESUME_BYTES;
+	config->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+	config->handshake_ms = DEFAULT_HANDSHAKE_MS;
+	*nr_threads = 1;
+	*use_uring = false;
+	*federate = false;
 
-	ABORT(argc != 2, "Invalid number of arguments.\n \
-					./server <PORT>\n");
+	for (i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--queue-limit") && i + 1 < argc) {
+			config->queue_limit = strtoul(argv[++i], NULL, 10);
+			ABORT(config->queue_limit < BUFLEN, "Invalid queue limit (minimum 1580 bytes).\n");
+		} else if (!strcmp(argv[i], "--overflow") && i + 1 < argc) {
+			i++;
+			if (!strcmp(argv[i], "drop"))
+				config->overflow_policy = OVERFLOW_DROP;
+			else if (!strcmp(argv[i], "disconnect"))
+				config->overflow_policy = OVERFLOW_DISCONNECT;
+			else if (!strcmp(argv[i], "sf"))
+				config->overflow_policy = OVERFLOW_SF;
+			else
+				ABORT(1, "Invalid overflow policy. Use drop, disconnect or sf.\n");
+		} else if (!strcmp(argv[i], "--sf-dir") && i + 1 < argc) {
+			config->sf_dir = argv[++i];
+		} else if (!strcmp(argv[i], "--sf-max-bytes") && i + 1 < argc) {
+			config->sf_max_bytes = strtoull(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--sf-max-age") && i + 1 < argc) {
+			config->sf_max_age = strtol(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--linger-us") && i + 1 < argc) {
+			config->linger_us = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--coalesce-bytes") && i + 1 < argc) {
+			config->coalesce_bytes = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--stats-socket") && i + 1 < argc) {
+			config->stats_socket = argv[++i];
+		} else if (!strcmp(argv[i], "--retain-bytes") && i + 1 < argc) {
+			config->retain_max_bytes = strtoull(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--shm-bytes") && i + 1 < argc) {
+			config->shm_bytes = strtoull(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--resume-bytes") && i + 1 < argc) {
+			config->resume_bytes = strtoull(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--listen-backlog") && i + 1 < argc) {
+			config->listen_backlog = atoi(argv[++i]);
+			ABORT(config->listen_backlog < 1, "Invalid listen backlog.\n");
+		} else if (!strcmp(argv[i], "--handshake-ms") && i + 1 < argc) {
+			config->handshake_ms = strtoul(argv[++i], NULL, 10);
+			ABORT(config->handshake_ms < 1, "Invalid handshake timeout.\n");
+		} else if (!strcmp(argv[i], "--federate")) {
+			*federate = true;
+		} else if (!strcmp(argv[i], "--peer") && i + 1 < argc) {
+			// this broker opens the links to its peers, the others accept them (--federate)
+			port = strrchr(argv[++i], ':');
+			ABORT(port == NULL, "Invalid peer address (use IP:PORT).\n");
+			*port++ = '\0';
+			memset((char *) &peer, 0, sizeof(peer));
+			peer.sin_family = AF_INET;
+			peer.sin_port = htons(atoi(port));
+			ABORT(inet_aton(argv[i], &peer.sin_addr) == 0 || atoi(port) <= 0 || atoi(port) > 65535,
+				"Invalid peer address (use IP:PORT).\n");
+			peers->push_back(peer);
+			*federate = true;
+		} else if (!strcmp(argv[i], "--io-uring")) {
+			*use_uring = true;
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			*nr_threads = atoi(argv[++i]);
+			ABORT(*nr_threads < 1 || *nr_threads > MAX_SHARDS, "Invalid number of threads (1 - 64).\n");
+		} else {
+			ABORT(1, USAGE);
+		}
+	}
+}
 
-	ABORT((atoi(argv[1]) > 65535) || (atoi(argv[1]) < 0), "Invalid port number.\n");
+/**
+	@brief Function that prepares the directory of the SF logs. Without
+		   --sf-dir, a temporary directory is used (and removed at exit). A
+		   persistent directory remembers the number of shards it was created
+		   with, because subscribers are assigned to shards by their ID.
 
+	@param config Broker state holding the configuration.
+	@param set The shards of the broker.
+	@param nr_threads Number of shards.
+**/
+void prepare_sf_dir(struct broker *config, struct shard_set *set, int nr_threads) {
+	static char temporary[] = "/tmp/sf_log.XXXXXX";
+	char path[PATH_MAX];
+	FILE *file;
+	int saved_threads;
 
-	// disable stdout buffering
-	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+	set->temporary_sf_dir = config->sf_dir == NULL;
+	if (set->temporary_sf_dir) {
+		config->sf_dir = mkdtemp(temporary);
+		ABORT(config->sf_dir == NULL, "SF log: CREATE DIRECTORY error\n");
+		return;
+	}
 
-	socket_UDP = create_UDP_socket(argv[1]);
-	socket_TCP = create_TCP_passive_socket(argv[1]); // TCP socket for connections
-	
-	// add stdin, UDP socket and TCP connection socket to the used descriptors set
-	descriptors[0].fd = socket_TCP; descriptors[0].events = POLLIN;
-	descriptors[1].fd = socket_UDP; descriptors[1].events = POLLIN;
-	descriptors[2].fd = STDIN_FILENO; descriptors[2].events = POLLIN;
-
-	char final = 0;
-	memset(&received_msg, 0, sizeof(received_msg));
-	while(!final) {
-		poll(descriptors, nr_descriptors, -1);
-
-		for(i = 0; i < nr_descriptors; i++) {
-			if (descriptors[i].revents & POLLIN) {
-				descriptors[i].revents = 0;
-				if (i == TCP_CONNECT_IDX) {
-					/*
-					 * create a new TCP connection to a subscriber and add the
-					 * new socket to the descriptors set
-					 */
-					new_socket = create_TCP_client_socket(socket_TCP, clients_table, unsent_table);
-					if (nr_descriptors + 1 > descriptors_size) {
-						descriptors = (struct pollfd*) realloc(descriptors, 2 * descriptors_size * sizeof(struct pollfd));
-						descriptors_size = 2 * descriptors_size;
-					}
-					if (new_socket != -1) {
-						descriptors[nr_descriptors].fd = new_socket;
-						descriptors[nr_descriptors].events = POLLIN;
-						nr_descriptors++;
-					}
-				} else if (i == UDP_IDX) {
-					// receive and publish a message from an UDP client
-					memset(buffer, 0, BUFLEN);
-					UDP_cli_len = sizeof(UDP_cli_addr);
-					bytes_read = recvfrom(descriptors[i].fd, buffer, BUFLEN, 0, (struct sockaddr*) &UDP_cli_addr, (socklen_t *) &UDP_cli_len);
-					publish_message(buffer, bytes_read, clients_table, topics_table, unsent_table, UDP_cli_addr);
-					ABORT(bytes_read == -1, "UDP socket: RECEIVE error\n");
-				} else if (i == STDIN_IDX) {
-					// receive exit command from stdin
-					scanf("%s", buffer);
-					if (!strcmp(buffer, "exit")) {
-						final = 1;
-					} else {
-						WARNING(1, "Invalid command. Only exit command allowed on server.\n");
-					}
+	ABORT(mkdir(config->sf_dir, 0755) == -1 && errno != EEXIST, "SF log: CREATE DIRECTORY error\n");
+	snprintf(path, sizeof(path), "%s/shards", config->sf_dir);
+	file = fopen(path, "r");
+	if (file != NULL) {
+		ABORT(fscanf(file, "%d", &saved_threads) != 1 || saved_threads != nr_threads,
+			"SF log: directory created with a different number of threads\n");
+		fclose(file);
+		return;
+	}
+	file = fopen(path, "w");
+	ABORT(file == NULL, "SF log: CREATE DIRECTORY error\n");
+	fprintf(file, "%d\n", nr_threads);
+	fclose(file);
+}
+
+/**
+	@brief Function that runs the event loop of a shard until the server stops.
+		   Shard 0 also accepts the TCP connections and reads the commands
+		   from stdin.
+
+	@param set The shards of the broker.
+	@param self Index of the shard.
+	@param socket_TCP The TCP passive socket (used only by shard 0).
+**/
+void run_shard(struct shard_set *set, int self, int socket_TCP) {
+	struct shard *shard = &set->shards[self];
+	struct broker *broker = &shard->broker;
+	struct epoll_event events[MAX_EVENTS];
+	char buffer[BUFLEN];
+	struct handshake *handshake;
+	Subscriber subscriber;
+	int i, nr_events, fd, peer;
+
+	set_thread_pool(shard->pool);
+
+	// the restored subscriptions are announced to the peer brokers
+	if (!broker->interest_changes.empty())
+		forward_interest(set, self);
+	while (!set->stopping) {
+		nr_events = epoll_wait(broker->epoll_fd, events, MAX_EVENTS, -1);
+		if (nr_events == -1 && errno == EINTR)
+			continue;
+		ABORT(nr_events == -1, "Event loop: WAIT error\n");
+
+		// handle every ready descriptor reported by this wakeup
+		for (i = 0; i < nr_events && !set->stopping; i++) {
+			fd = events[i].data.fd;
+			if (fd == shard->wake_fd) {
+				// messages and clients handed over by other shards
+				drain_inbound(set, self);
+				adopt_clients(set, self);
+			} else if (self == 0 && fd == socket_TCP) {
+				// create new TCP connections, admitted once they send their ID
+				accept_clients(socket_TCP, set);
+			} else if (self == 0 && (handshake = find_handshake(set->admission, fd)) != NULL) {
+				// the ID of a new client, which is handed to the shard that owns it
+				admit_handshake(set, self, handshake);
+				wake_shards(set, self);
+			} else if (self == 0 && fd == set->admission->timer_fd) {
+				// close the connections that did not send their ID in time
+				expire_handshakes(set->admission);
+			} else if (self == 0 && set->federation != NULL && fd == set->federation->retry_fd) {
+				// connect again to the peer brokers that are not linked
+				retry_peers(set);
+			} else if (self == 0 && set->federation != NULL && (peer = peer_by_fd(set->federation, fd)) != NO_PEER) {
+				// messages from a peer broker, or its link became writable
+				handle_peer_event(set, peer, events[i].events);
+			} else if (self == 0 && fd == set->stats_socket) {
+				// a snapshot of the statistics was requested
+				serve_stats(set);
+			} else if (fd == broker->sf_log->sync_fd) {
+				// save the cursors of the SF log that changed
+				sync_sf_cursors(broker->sf_log);
+			} else if (fd == broker->sf_log->compact_fd) {
+				// compact the oldest segments of the SF log, a step at a time
+				compact_sf_log(broker->sf_log);
+			} else if (fd == broker->linger_fd) {
+				// write the queues of the subscribers whose linger window ended
+				flush_lingering_subscribers(broker);
+			} else if (fd == shard->socket_UDP) {
+				// receive and publish all the pending messages from UDP clients
+				ingest_udp(set, self);
+			} else if (broker->ring != NULL && fd == broker->ring->fd) {
+				// datagrams received and writes completed by io_uring
+				ingest_uring(set, self);
+			} else if (self == 0 && fd == STDIN_FILENO) {
+				// receive exit or stats command from stdin
+				if (scanf("%s", buffer) != 1) {
+					// stdin was closed, the server keeps running without commands
+					unwatch_fd(broker->epoll_fd, STDIN_FILENO);
+				} else if (!strcmp(buffer, "exit")) {
+					stop_shards(set);
+				} else if (!strcmp(buffer, "stats")) {
+					write_stats(set, STDOUT_FILENO);
 				} else {
-					// receive message from a TCP client (subscribe / unsubscribe)
-					receive_msg(descriptors[i].fd, &received_msg, topics_table, clients_table, unsent_table);
+					WARNING(1, "Invalid command. Only exit and stats commands allowed on server.\n");
+				}
+			} else {
+				// the socket may have been closed while handling this wakeup
+				if ((subscriber = session_by_fd(&broker->sessions, fd)) == NULL)
+					continue;
+
+				// send the queued messages of a subscriber whose socket became writable
+				if (events[i].events & EPOLLOUT) {
+					flush_subscriber(broker, subscriber);
+					if (session_by_fd(&broker->sessions, fd) == NULL)
+						continue;
+				}
+
+				// receive messages from a TCP client (subscribe / unsubscribe)
+				if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+						&& receive_messages(broker, subscriber) == SOCKET_CLOSED) {
+					close_client_socket(broker, fd);
 				}
-				break;
 			}
 		}
-		if (final)
-			break;
+
+		// new subscriptions ask the other shards for their retained messages
+		if (!broker->retain_requests.empty())
+			forward_retain_requests(set, self);
+
+		// subscriptions are counted by shard 0, which tells the peer brokers
+		if (!broker->interest_changes.empty())
+			forward_interest(set, self);
+		if (self == 0 && set->federation != NULL && set->federation->dirty != 0)
+			flush_peers(set);
+
+		// subscription changes are saved once per iteration, a long log is replaced by a snapshot (by a thread)
+		if (broker->state_log != NULL && !broker->state_log->pending.empty() && flush_state_log(broker->state_log))
+			save_subscriptions(broker, true);
+
+		// the writes prepared during this iteration leave with one system call
+		if (broker->ring != NULL)
+			submit_uring(broker->ring);
+	}
+
+	// the snapshot needs the IDs of the sessions
+	if (broker->state_log != NULL) {
+		save_subscriptions(broker, false);
+		close_state_log(broker->state_log);
 	}
 
 	// close all sockets before exit  
-	for (i = 0; i < nr_descriptors; i++) {
-		close(descriptors[i].fd);
+	for (fd = 0; fd < (int) broker->sessions.by_fd.size(); fd++) {
+		if (broker->sessions.by_fd[fd] != NULL)
+			close_client_socket(broker, fd);
 	}
+	free_session_registry(&broker->sessions);
+	if (broker->ring != NULL)
+		close_uring(broker->ring);
+	if (broker->shm != NULL)
+		close_shm_ring(broker->shm);
+	close(shard->socket_UDP);
+	close(broker->linger_fd);
+	close_sf_log(broker->sf_log, set->temporary_sf_dir);
+}
+
+
+int main(int argc, char **argv) {
+	int i, nr_threads, socket_TCP;
+	bool use_uring, federate;
+	vector <struct sockaddr_in> peers;
+	struct broker config;
+	struct shard_set set;
+
+	ABORT(argc < 2, USAGE);
+
+	ABORT((atoi(argv[1]) > 65535) || (atoi(argv[1]) < 0), "Invalid port number.\n");
+
+	parse_options(argc, argv, &config, &nr_threads, &use_uring, &peers, &federate);
+
+	// disable stdout buffering
+	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+
+	// a subscriber that closes its connection must not kill the broker
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	 * Every shard has its own UDP socket on the same port (SO_REUSEPORT), so
+	 * the kernel spreads the publishers between them. The UDP sockets and the
+	 * TCP connection socket are edge-triggered, so they are drained on every
+	 * wakeup and must not block. Subscriber sockets stay level-triggered:
+	 * receive_messages() reads everything available with a single call and
+	 * leaves the rest for the next wakeup. Until the client sends its ID,
+	 * shard 0 watches its socket as a pending handshake, closed if the ID does
+	 * not arrive within --handshake-ms; the socket is then added to the event
+	 * loop of the shard that owns the ID.
+	 *
+	 * With --io-uring, the event loop of a shard watches its io_uring instead
+	 * of its UDP socket: datagrams arrive through a multishot receive and the
+	 * subscriber queues are written by io_uring. Without kernel support, the
+	 * shard keeps the epoll path.
+	 */
+	prepare_sf_dir(&config, &set, nr_threads);
+	config.federated = federate;
+	init_shards(&set, nr_threads, &config);
+	for (i = 0; i < nr_threads; i++) {
+		set.shards[i].socket_UDP = create_UDP_socket(argv[1]);
+		set_nonblocking(set.shards[i].socket_UDP);
+		if (use_uring) {
+			set.shards[i].broker.ring = create_uring(set.shards[i].socket_UDP);
+			WARNING(set.shards[i].broker.ring == NULL, "io_uring not available, using epoll\n");
+		}
+		if (set.shards[i].broker.ring != NULL) {
+			arm_udp_receive(set.shards[i].broker.ring);
+			submit_uring(set.shards[i].broker.ring);
+			watch_fd(set.shards[i].broker.epoll_fd, set.shards[i].broker.ring->fd, EPOLLIN);
+		} else {
+			watch_fd(set.shards[i].broker.epoll_fd, set.shards[i].socket_UDP, EPOLLIN | EPOLLET);
+		}
+	}
+
+	socket_TCP = create_TCP_passive_socket(argv[1], config.listen_backlog); // TCP socket for connections
+	set_nonblocking(socket_TCP);
+	watch_fd(set.shards[0].broker.epoll_fd, socket_TCP, EPOLLIN | EPOLLET);
+	set.admission = create_admission(set.shards[0].broker.epoll_fd, config.handshake_ms, &set.shards[0].broker.stats);
+	watch_fd(set.shards[0].broker.epoll_fd, STDIN_FILENO, EPOLLIN);
+	set.stats_socket = -1;
+	if (config.stats_socket != NULL) {
+		set.stats_socket = create_stats_socket(config.stats_socket);
+		set_nonblocking(set.stats_socket);
+		watch_fd(set.shards[0].broker.epoll_fd, set.stats_socket, EPOLLIN);
+	}
+
+	/*
+	 * Brokers of a federation are linked over TCP (on the port of the
+	 * subscribers); shard 0 handles the links and every shard forwards the
+	 * messages of the topics it owns to the peers that subscribed them.
+	 */
+	if (federate) {
+		set.federation = create_federation(peers, set.shards[0].broker.epoll_fd, config.queue_limit);
+	}
+
+	// shard 0 runs on the main thread
+	for (i = 1; i < nr_threads; i++)
+		set.shards[i].worker = thread(run_shard, &set, i, socket_TCP);
+	run_shard(&set, 0, socket_TCP);
+	stop_shards(&set);
+
+	close(socket_TCP);
+	close_admission(set.admission);
+	if (set.federation != NULL)
+		close_federation(set.federation);
+	if (set.stats_socket != -1) {
+		close(set.stats_socket);
+		unlink(config.stats_socket);
+	}
+	if (set.temporary_sf_dir)
+		rmdir(config.sf_dir);
 
 	return 0;
 }
-
@@ -0,0 +1,119 @@
+#include "session_registry.h"
+#include "custom_TCP.h"
+
+/**
+	@brief Function that creates the session of a new client, in a free slot
+		   of the slabs.
+
+	@param registry The sessions of the broker.
+	@param id The ID of the client.
+
+	@return struct subscriber* The session, not connected yet.
+**/
+struct subscriber *create_session(struct session_registry *registry, const char *id) {
+	struct subscriber *session;
+	u_int32_t handle;
+
+	if (registry->free_handles.empty()) {
+		handle = registry->by_handle.size();
+		if (handle % SESSION_SLAB == 0)
+			registry->slabs.push_back(new struct subscriber[SESSION_SLAB]());
+		registry->by_handle.push_back(NULL);
+	} else {
+		handle = registry->free_handles.back();
+		registry->free_handles.pop_back();
+	}
+
+	// a released session was left with an empty queue and no receive buffer
+	session = &registry->slabs[handle / SESSION_SLAB][handle % SESSION_SLAB];
+	memset(session->id, 0, sizeof(session->id));
+	strncpy(session->id, id, sizeof(session->id) - 1);
+	session->handle = handle;
+	session->socket = -1;
+	session->connected = false;
+	session->want_write = false;
+	session->dirty = false;
+	session->closing = false;
+	session->lingering = false;
+	session->sending = NULL;
+	session->shm_slot = NO_SHM_SLOT;
+	session->output_mode = OUTPUT_LATENCY;
+	session->nr_subscriptions = 0;
+	session->resumable = false;
+	session->sequence = 0;
+	session->resume_bytes = 0;
+
+	registry->by_handle[handle] = session;
+	registry->by_id[session->id] = handle;
+	return session;
+}
+
+/**
+	@brief Function that releases the session of a disconnected client, which
+		   has no subscriptions left (its SF backlog, kept by ID in the SF log,
+		   is not lost).
+
+	@param registry The sessions of the broker.
+	@param session The session.
+**/
+void release_session(struct session_registry *registry, struct subscriber *session) {
+	registry->by_id.erase(session->id);
+	registry->by_handle[session->handle] = NULL;
+	registry->free_handles.push_back(session->handle);
+}
+
+/**
+	@brief Function that finds the session of a client.
+
+	@param registry The sessions of the broker.
+	@param id The ID of the client.
+
+	@return struct subscriber* The session, NULL if the client is not known.
+**/
+struct subscriber *find_session(struct session_registry *registry, const char *id) {
+	unordered_map <string, u_int32_t>::iterator iter = registry->by_id.find(id);
+
+	return iter == registry->by_id.end() ? NULL : registry->by_handle[(*iter).second];
+}
+
+/**
+	@brief Function that indexes a session by the socket of its connection.
+
+	@param registry The sessions of the broker.
+	@param session The session.
+	@param socket The socket of the client.
+**/
+void attach_socket(struct session_registry *registry, struct subscriber *session, int socket) {
+	if ((size_t) socket >= registry->by_fd.size())
+		registry->by_fd.resize(socket + 1, NULL);
+	registry->by_fd[socket] = session;
+	session->socket = socket;
+}
+
+/**
+	@brief Function that removes the session of a closed socket from the index.
+
+	@param registry The sessions of the broker.
+	@param socket The socket.
+**/
+void detach_socket(struct session_registry *registry, int socket) {
+	if (socket >= 0 && (size_t) socket < registry->by_fd.size())
+		registry->by_fd[socket] = NULL;
+}
+
+/**
+	@brief Function that frees all the sessions (when the broker stops).
+
+	@param registry The sessions of the broker.
+**/
+void free_session_registry(struct session_registry *registry) {
+	vector <struct subscriber *>::iterator iter;
+
+	for (iter = registry->slabs.begin(); iter != registry->slabs.end(); iter++)
+		delete[] *iter;
+	registry->slabs.clear();
+	registry->by_handle.clear();
+	registry->free_handles.clear();
+	registry->by_id.clear();
+	registry->by_fd.clear();
+}
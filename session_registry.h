@@ -0,0 +1,40 @@
+#ifndef _SESSION_REGISTRY_H
+#define _SESSION_REGISTRY_H
+
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#define SESSION_SLAB 256	// sessions allocated at once
+
+struct subscriber;
+
+/*
+ * Sessions of the subscribers of a broker. Sessions are carved from slabs and
+ * identified by dense handles (the handle of a released session is reused),
+ * they are indexed by the ID of the client and by the socket it is connected on.
+ */
+struct session_registry {
+	vector <struct subscriber *> slabs;
+	vector <struct subscriber *> by_handle;	// NULL for free handles
+	vector <u_int32_t> free_handles;
+	unordered_map <string, u_int32_t> by_id;
+	vector <struct subscriber *> by_fd;	// NULL for sockets without a session
+};
+
+struct subscriber *create_session(struct session_registry *registry, const char *id);
+void release_session(struct session_registry *registry, struct subscriber *session);
+struct subscriber *find_session(struct session_registry *registry, const char *id);
+void attach_socket(struct session_registry *registry, struct subscriber *session, int socket);
+void detach_socket(struct session_registry *registry, int socket);
+void free_session_registry(struct session_registry *registry);
+
+// the session connected on a socket, NULL if there is none
+static inline struct subscriber *session_by_fd(struct session_registry *registry, int socket) {
+	return socket >= 0 && (size_t) socket < registry->by_fd.size() ? registry->by_fd[socket] : NULL;
+}
+
+#endif
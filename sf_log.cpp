@@ -0,0 +1,824 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <algorithm>
+#include "sf_log.h"
+#include "custom_TCP.h"
+#include "event_loop.h"
+
+// helper, FNV-1a checksum of the bytes of a record
+static u_int32_t record_checksum(const char *bytes, size_t length) {
+	u_int32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (u_int8_t) bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// helper, compare two positions of the log
+static bool before(struct sf_position first, struct sf_position second) {
+	return first.segment < second.segment
+		|| (first.segment == second.segment && first.offset < second.offset);
+}
+
+// helper, path of a file of the log
+static string log_path(struct sf_log *log, u_int32_t number, const char *suffix) {
+	char name[32];
+
+	snprintf(name, sizeof(name), "seg-%08u.log%s", number, suffix);
+	return log->dir + "/" + name;
+}
+
+// helper, open (or create) a segment and map it for reading
+static struct sf_segment *open_segment(struct sf_log *log, u_int32_t number) {
+	struct sf_segment segment;
+	string path = log_path(log, number, "");
+
+	segment.fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	ABORT(segment.fd == -1, "SF log: OPEN SEGMENT error\n");
+	ABORT(ftruncate(segment.fd, SF_SEGMENT_SIZE) == -1, "SF log: RESIZE SEGMENT error\n");
+	segment.map = (char *) mmap(NULL, SF_SEGMENT_SIZE, PROT_READ, MAP_SHARED, segment.fd, 0);
+	ABORT(segment.map == MAP_FAILED, "SF log: MAP SEGMENT error\n");
+	segment.size = 0;
+	segment.last_time = 0;
+
+	log->segments[number] = segment;
+	return &log->segments[number];
+}
+
+// helper, check the record at an offset of a segment; returns its length, 0 if it is not valid
+static u_int32_t check_record(struct sf_segment *segment, u_int32_t offset) {
+	const struct sf_record *record = (const struct sf_record *) (segment->map + offset);
+
+	if (offset + sizeof(struct sf_record) > SF_SEGMENT_SIZE)
+		return 0;
+	if (record->length < sizeof(struct sf_record) || record->length > SF_MAX_RECORD
+			|| offset + record->length > SF_SEGMENT_SIZE
+			|| sizeof(struct sf_record) + record->nr_recipients * SF_ID_SIZE + record->frame_length > record->length)
+		return 0;
+	if (record_checksum(segment->map + offset + 8, record->length - 8) != record->checksum)
+		return 0;
+
+	return record->length;
+}
+
+// helper, find the end of the records of a segment (a torn record ends the segment)
+static void recover_segment(struct sf_segment *segment) {
+	u_int32_t offset = 0, length;
+
+	while ((length = check_record(segment, offset)) != 0) {
+		segment->last_time = ((const struct sf_record *) (segment->map + offset))->time;
+		offset += length;
+	}
+	segment->size = offset;
+}
+
+// helper, ID of a recipient, as stored in a record (not terminated if it has SF_ID_SIZE bytes)
+static string_view id_key(const char *id) {
+	return string_view(id, strnlen(id, SF_ID_SIZE));
+}
+
+// helper, find the cursor of a subscriber, NULL if it has no backlog
+static struct sf_cursor *find_cursor(struct sf_log *log, const char *id) {
+	unordered_map <string_view, struct sf_cursor *>::iterator iter = log->cursors.find(id_key(id));
+
+	return iter == log->cursors.end() ? NULL : (*iter).second;
+}
+
+// helper, create the cursor of a subscriber
+static struct sf_cursor *add_cursor(struct sf_log *log, const char *id, struct sf_position position, bool indexed) {
+	struct sf_cursor *cursor = new struct sf_cursor;
+
+	memset(cursor->id, 0, sizeof(cursor->id));
+	memcpy(cursor->id, id, id_key(id).size());
+	cursor->position = position;
+	cursor->indexed = indexed;
+	log->cursors[string_view(cursor->id)] = cursor;
+	return cursor;
+}
+
+// helper, remove the cursor of a subscriber that caught up with the log
+static void remove_cursor(struct sf_log *log, struct sf_cursor *cursor) {
+	log->cursors.erase(string_view(cursor->id));
+	delete cursor;
+}
+
+// helper, note that the cursors changed; they are saved when the timer expires
+static void touch_cursors(struct sf_log *log) {
+	if (log->cursors_dirty)
+		return;
+	log->cursors_dirty = true;
+	arm_timer(log->sync_fd, monotonic_us() + SF_CURSORS_SYNC_US);
+}
+
+// helper, write the end of the log and the cursors of the subscribers over the older cursors file
+static void persist_cursors(struct sf_log *log) {
+	unordered_map <string_view, struct sf_cursor *>::iterator iter;
+	char line[96];
+	string text;
+	int fd;
+
+	/*
+	 * a file is rewritten in place (renaming over the old one waits for the
+	 * journal of the file system), the other one stays complete meanwhile
+	 */
+	log->cursors_generation++;
+	snprintf(line, sizeof(line), "generation %u\nend %u %u\ncompacted %u\n", log->cursors_generation,
+		log->segments.rbegin()->first, log->segments.rbegin()->second.size, log->compacted);
+	text = line;
+	for (iter = log->cursors.begin(); iter != log->cursors.end(); iter++) {
+		snprintf(line, sizeof(line), "%s %u %u\n", (*iter).second->id, (*iter).second->position.segment,
+			(*iter).second->position.offset);
+		text += line;
+	}
+	snprintf(line, sizeof(line), "done %u\n", log->cursors_generation);
+	text += line;
+
+	fd = log->cursors_fd[log->cursors_generation % 2];
+	ABORT(pwrite(fd, text.data(), text.size(), 0) != (ssize_t) text.size() || ftruncate(fd, text.size()) == -1,
+		"SF log: WRITE CURSORS error\n");
+
+	if (log->cursors_dirty) {
+		log->cursors_dirty = false;
+		arm_timer(log->sync_fd, 0);
+	}
+}
+
+// helper, read a cursors file; returns false if it is missing or was not completely written
+static bool read_cursors_file(string path, u_int32_t *generation, struct sf_position *end, u_int32_t *compacted,
+							  vector <pair <string, struct sf_position>> *cursors) {
+	FILE *file = fopen(path.c_str(), "r");
+	char id[SF_ID_SIZE + 1];
+	struct sf_position position;
+	int fields;
+
+	if (file == NULL)
+		return false;
+	if (fscanf(file, "generation %u end %u %u compacted %u", generation, &end->segment, &end->offset, compacted) != 4) {
+		fclose(file);
+		return false;
+	}
+	while ((fields = fscanf(file, "%13s %u %u", id, &position.segment, &position.offset)) == 3)
+		cursors->push_back(make_pair(string(id), position));
+	fclose(file);
+
+	// the last line repeats the generation, so a file cut by a crash is not used
+	return fields == 2 && !strcmp(id, "done") && position.segment == *generation;
+}
+
+// helper, read the cursors saved by a previous run of the server; returns false without the end of the log
+static bool load_cursors(struct sf_log *log, struct sf_position *end, u_int32_t *compacted) {
+	vector <pair <string, struct sf_position>> cursors, candidate;
+	struct sf_position candidate_end;
+	u_int32_t generation, candidate_compacted;
+	bool found = false;
+	size_t i;
+	int j;
+
+	// the newest complete file of the two is used
+	log->cursors_generation = 0;
+	end->segment = 0;
+	end->offset = 0;
+	*compacted = SF_NO_SEGMENT;
+	for (j = 0; j < 2; j++) {
+		candidate.clear();
+		if (!read_cursors_file(log->dir + "/cursors." + to_string(j), &generation, &candidate_end,
+							   &candidate_compacted, &candidate)
+				|| (found && generation < log->cursors_generation))
+			continue;
+		found = true;
+		log->cursors_generation = generation;
+		*end = candidate_end;
+		*compacted = candidate_compacted;
+		cursors.swap(candidate);
+	}
+
+	for (i = 0; i < cursors.size(); i++) {
+		if (find_cursor(log, cursors[i].first.c_str()) == NULL)
+			add_cursor(log, cursors[i].first.c_str(), cursors[i].second, false);
+	}
+	return found;
+}
+
+/**
+	@brief Function that gives a cursor to the recipients of the records
+		   appended after the cursors file was written, which had no backlog
+		   then (the server stopped before saving their cursors).
+
+	@param log The SF log.
+	@param end End of the log when the cursors were written.
+**/
+static void recover_cursors(struct sf_log *log, struct sf_position end) {
+	map <u_int32_t, struct sf_segment>::iterator segment;
+	struct sf_position position;
+	int i;
+
+	for (segment = log->segments.lower_bound(end.segment); segment != log->segments.end(); segment++) {
+		position.segment = segment->first;
+		position.offset = segment->first == end.segment ? end.offset : 0;
+		while (position.offset < segment->second.size) {
+			struct sf_record *record = (struct sf_record *) (segment->second.map + position.offset);
+			char *ids = (char *) (record + 1);
+
+			for (i = 0; i < record->nr_recipients; i++) {
+				if (find_cursor(log, ids + i * SF_ID_SIZE) == NULL) {
+					add_cursor(log, ids + i * SF_ID_SIZE, position, false);
+					touch_cursors(log);
+				}
+			}
+			position.offset += record->length;
+		}
+	}
+}
+
+// helper, make the renames of the files of the log durable
+static void sync_directory(struct sf_log *log) {
+	int fd = open(log->dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	ABORT(fd == -1 || fsync(fd) == -1, "SF log: SYNC DIRECTORY error\n");
+	close(fd);
+}
+
+// helper, give up the compaction in progress (its segment is removed, or the log is closed)
+static void cancel_compaction(struct sf_log *log) {
+	struct sf_compaction *compaction = &log->compaction;
+
+	if (compaction->syncer.joinable())
+		compaction->syncer.join();
+	if (compaction->fd != -1) {
+		close(compaction->fd);
+		unlink(log_path(log, compaction->segment, ".compact").c_str());
+		compaction->fd = -1;
+	}
+	compaction->kept.clear();
+	compaction->copied.clear();
+	compaction->state = COMPACT_IDLE;
+}
+
+// helper, remove a segment; cursors pointing into it move to the next one
+static void drop_segment(struct sf_log *log, map <u_int32_t, struct sf_segment>::iterator segment) {
+	map <u_int32_t, struct sf_segment>::iterator next = segment;
+	unordered_map <string_view, struct sf_cursor *>::iterator iter;
+	struct sf_position start;
+
+	if (log->compaction.state != COMPACT_IDLE && log->compaction.segment == segment->first)
+		cancel_compaction(log);
+
+	next++;
+	start.segment = next->first;
+	start.offset = 0;
+	for (iter = log->cursors.begin(); iter != log->cursors.end(); iter++) {
+		struct sf_cursor *cursor = (*iter).second;
+
+		if (cursor->position.segment <= segment->first)
+			cursor->position = start;
+		while (!cursor->records.empty() && cursor->records.front().segment <= segment->first)
+			cursor->records.pop_front();
+	}
+
+	munmap(segment->second.map, SF_SEGMENT_SIZE);
+	close(segment->second.fd);
+	unlink(log_path(log, segment->first, "").c_str());
+	log->total_bytes -= segment->second.size;
+	log->segments.erase(segment);
+	touch_cursors(log);
+}
+
+// helper, check if a recipient of the record at a position still needs it
+static bool is_pending(struct sf_log *log, const char *id, struct sf_position position) {
+	struct sf_cursor *cursor = find_cursor(log, id);
+
+	return cursor != NULL && !before(position, cursor->position);
+}
+
+// helper, compare the old offsets of the records kept by a compaction
+static bool before_offset(const pair <u_int32_t, u_int32_t> &record, u_int32_t offset) {
+	return record.first < offset;
+}
+
+// helper, count the bytes of the records still needed, SF_COMPACT_STEP bytes at a time; true once the whole segment was scanned
+static bool scan_step(struct sf_log *log, struct sf_segment *old) {
+	struct sf_compaction *compaction = &log->compaction;
+	u_int32_t limit = compaction->offset + SF_COMPACT_STEP;
+	struct sf_position position;
+	int i;
+
+	position.segment = compaction->segment;
+	for (; compaction->offset < old->size && compaction->offset < limit;
+		 compaction->offset += ((struct sf_record *) (old->map + compaction->offset))->length) {
+		struct sf_record *record = (struct sf_record *) (old->map + compaction->offset);
+
+		position.offset = compaction->offset;
+		for (i = 0; i < record->nr_recipients; i++) {
+			if (is_pending(log, (char *) (record + 1) + i * SF_ID_SIZE, position)) {
+				compaction->live_bytes += record->length;
+				break;
+			}
+		}
+	}
+	return compaction->offset >= old->size;
+}
+
+// helper, copy the records still needed (and their recipients), SF_COMPACT_STEP bytes of the old segment at a time, with one write
+static bool copy_step(struct sf_log *log, struct sf_segment *old) {
+	static thread_local char record_buffer[SF_MAX_RECORD];
+	struct sf_compaction *compaction = &log->compaction;
+	u_int32_t limit = compaction->offset + SF_COMPACT_STEP, start = compaction->new_size;
+	struct sf_position position;
+	int i;
+
+	position.segment = compaction->segment;
+	compaction->copied.clear();
+	for (; compaction->offset < old->size && compaction->offset < limit;
+		 compaction->offset += ((struct sf_record *) (old->map + compaction->offset))->length) {
+		struct sf_record *record = (struct sf_record *) (old->map + compaction->offset), *copy = (struct sf_record *) record_buffer;
+		char *ids = (char *) (record + 1), *copy_ids = (char *) (copy + 1);
+		u_int16_t nr_pending = 0;
+
+		position.offset = compaction->offset;
+		for (i = 0; i < record->nr_recipients; i++) {
+			if (is_pending(log, ids + i * SF_ID_SIZE, position)) {
+				memcpy(copy_ids + nr_pending * SF_ID_SIZE, ids + i * SF_ID_SIZE, SF_ID_SIZE);
+				nr_pending++;
+			}
+		}
+		compaction->kept.push_back(make_pair(compaction->offset, compaction->new_size));
+		if (nr_pending == 0)
+			continue;
+
+		*copy = *record;
+		copy->nr_recipients = nr_pending;
+		memcpy(copy_ids + nr_pending * SF_ID_SIZE, ids + record->nr_recipients * SF_ID_SIZE, record->frame_length);
+		copy->length = (sizeof(struct sf_record) + nr_pending * SF_ID_SIZE + record->frame_length + 7) & ~7u;
+		copy->checksum = record_checksum(record_buffer + 8, copy->length - 8);
+		compaction->copied.append(record_buffer, copy->length);
+		compaction->new_size += copy->length;
+	}
+
+	ABORT(!compaction->copied.empty() && pwrite(compaction->fd, compaction->copied.data(), compaction->copied.size(), start)
+		  != (ssize_t) compaction->copied.size(), "SF log: COMPACT error\n");
+	return compaction->offset >= old->size;
+}
+
+// helper, body of the thread of a compaction: the copy must be on disk before it replaces the segment
+static void sync_compaction(struct sf_log *log) {
+	ABORT(fsync(log->compaction.fd) == -1, "SF log: COMPACT error\n");
+	log->compaction.synced = true;
+	arm_timer(log->compact_fd, monotonic_us());
+}
+
+// helper, replace a segment with its synced copy; the cursors naming the segment are saved before the rename
+static void replace_segment(struct sf_log *log, map <u_int32_t, struct sf_segment>::iterator segment) {
+	struct sf_compaction *compaction = &log->compaction;
+	struct sf_segment *old = &segment->second;
+	vector <pair <u_int32_t, u_int32_t>> &kept = compaction->kept;
+	unordered_map <string_view, struct sf_cursor *>::iterator iter;
+	deque <struct sf_position>::iterator record;
+	int i;
+
+	compaction->syncer.join();
+
+	// cursors keep pointing to the first record they still need, and to their records
+	for (iter = log->cursors.begin(); iter != log->cursors.end(); iter++) {
+		struct sf_cursor *cursor = (*iter).second;
+
+		for (record = cursor->records.begin(); record != cursor->records.end() && (*record).segment <= segment->first; record++) {
+			if ((*record).segment == segment->first)
+				(*record).offset = lower_bound(kept.begin(), kept.end(), (*record).offset, before_offset)->second;
+		}
+		if (cursor->position.segment != segment->first)
+			continue;
+		u_int32_t new_offset = compaction->new_size;
+		for (i = kept.size() - 1; i >= 0 && kept[i].first >= cursor->position.offset; i--)
+			new_offset = kept[i].second;
+		cursor->position.offset = new_offset;
+	}
+
+	// after a crash, the remapped cursors are only valid with the copy, which then replaces the segment
+	log->compacted = segment->first;
+	persist_cursors(log);
+	ABORT(fdatasync(log->cursors_fd[log->cursors_generation % 2]) == -1, "SF log: COMPACT error\n");
+	ABORT(rename(log_path(log, segment->first, ".compact").c_str(), log_path(log, segment->first, "").c_str()) == -1,
+		  "SF log: COMPACT error\n");
+	sync_directory(log);
+	log->compacted = SF_NO_SEGMENT;
+	touch_cursors(log);
+
+	munmap(old->map, SF_SEGMENT_SIZE);
+	close(old->fd);
+	old->fd = compaction->fd;
+	old->map = (char *) mmap(NULL, SF_SEGMENT_SIZE, PROT_READ, MAP_SHARED, old->fd, 0);
+	ABORT(old->map == MAP_FAILED, "SF log: MAP SEGMENT error\n");
+	log->total_bytes -= old->size - compaction->new_size;
+	old->size = compaction->new_size;
+
+	compaction->fd = -1;
+	kept.clear();
+	compaction->state = COMPACT_IDLE;
+}
+
+/**
+	@brief Function that does the next step of the compaction of the oldest
+		   sealed segments (called when the timer of the compaction expires),
+		   so that the shard keeps routing messages in between. A segment
+		   without records that are still needed is removed; a segment that
+		   is mostly consumed is copied with only the needed records (and
+		   recipients), synced to the disk by a thread, then renamed over
+		   the old one.
+
+	@param log The SF log.
+**/
+void compact_sf_log(struct sf_log *log) {
+	struct sf_compaction *compaction = &log->compaction;
+	map <u_int32_t, struct sf_segment>::iterator segment;
+	u_int64_t expirations;
+
+	// reset the readiness of the timer
+	while (read(log->compact_fd, &expirations, sizeof(expirations)) > 0);
+
+	// the thread sets the timer again once the copy is on the disk
+	if (compaction->state == COMPACT_SYNC && !compaction->synced)
+		return;
+
+	if (compaction->state == COMPACT_IDLE) {
+		// the segment being appended is never compacted
+		segment = log->segments.lower_bound(compaction->segment);
+		if (compaction->segments_left == 0 || segment == log->segments.end() || segment->first == log->segments.rbegin()->first) {
+			compaction->segments_left = 0;
+			return;
+		}
+		compaction->state = COMPACT_SCAN;
+		compaction->segment = segment->first;
+		compaction->offset = 0;
+		compaction->live_bytes = 0;
+		compaction->segments_left--;
+	}
+	segment = log->segments.find(compaction->segment);
+
+	if (compaction->state == COMPACT_SCAN && scan_step(log, &segment->second)) {
+		if (compaction->live_bytes == 0) {
+			drop_segment(log, segment);
+		} else if (compaction->live_bytes > segment->second.size / 2) {
+			compaction->state = COMPACT_IDLE;
+		} else {
+			compaction->fd = open(log_path(log, compaction->segment, ".compact").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			ABORT(compaction->fd == -1 || ftruncate(compaction->fd, SF_SEGMENT_SIZE) == -1, "SF log: COMPACT error\n");
+			compaction->state = COMPACT_COPY;
+			compaction->offset = 0;
+			compaction->new_size = 0;
+		}
+	} else if (compaction->state == COMPACT_COPY && copy_step(log, &segment->second)) {
+		compaction->state = COMPACT_SYNC;
+		compaction->synced = false;
+		compaction->syncer = thread(sync_compaction, log);
+	} else if (compaction->state == COMPACT_SYNC) {
+		replace_segment(log, segment);
+	}
+
+	// the next segment is checked once this one is done
+	if (compaction->state == COMPACT_IDLE)
+		compaction->segment++;
+	if (compaction->state != COMPACT_SYNC && (compaction->state != COMPACT_IDLE || compaction->segments_left > 0))
+		arm_timer(log->compact_fd, monotonic_us());
+}
+
+/**
+	@brief Function that removes the oldest segments while the log is larger
+		   than its size limit or they are older than its age limit. The
+		   segment being appended is never removed.
+
+	@param log The SF log.
+**/
+void enforce_retention(struct sf_log *log) {
+	time_t now = time(NULL);
+
+	while (log->segments.size() > 1) {
+		struct sf_segment *oldest = &log->segments.begin()->second;
+		bool too_big = log->max_bytes != 0 && log->total_bytes > log->max_bytes;
+		bool too_old = log->max_age != 0 && oldest->last_time + log->max_age < now;
+
+		if (!too_big && !too_old)
+			break;
+		drop_segment(log, log->segments.begin());
+	}
+}
+
+/**
+	@brief Function that saves the cursors that changed since they were last
+		   written (called when the timer of the log expires).
+
+	@param log The SF log.
+**/
+void sync_sf_cursors(struct sf_log *log) {
+	u_int64_t expirations;
+
+	// reset the readiness of the timer
+	while (read(log->sync_fd, &expirations, sizeof(expirations)) > 0);
+	if (log->cursors_dirty)
+		persist_cursors(log);
+}
+
+// helper, start a new segment when the current one is full, then save the cursors; the oldest ones are compacted later
+static void roll_segment(struct sf_log *log) {
+	struct sf_compaction *compaction = &log->compaction;
+
+	open_segment(log, log->segments.rbegin()->first + 1);
+	if (compaction->state == COMPACT_IDLE && compaction->segments_left == 0) {
+		compaction->segment = log->segments.begin()->first;
+		compaction->segments_left = SF_COMPACT_SEGMENTS;
+		arm_timer(log->compact_fd, monotonic_us());
+	}
+	enforce_retention(log);
+
+	// the saved end of the log must not point into a segment that may be compacted
+	persist_cursors(log);
+}
+
+/**
+	@brief Function that opens the SF log of a shard, recovering the segments
+		   and the subscriber cursors written by a previous run.
+
+	@param dir Directory of the log (created if needed).
+	@param max_bytes Size limit of the log, 0 for no limit.
+	@param max_age Age limit of the records, in seconds, 0 for no limit.
+
+	@return struct sf_log* The log.
+**/
+struct sf_log *open_sf_log(const char *dir, size_t max_bytes, time_t max_age) {
+	struct sf_log *log = new struct sf_log;
+	unordered_map <string_view, struct sf_cursor *>::iterator iter;
+	map <u_int32_t, struct sf_segment>::iterator segment;
+	struct sf_position end;
+	struct dirent *entry;
+	vector <u_int32_t> numbers;
+	vector <string> copies;
+	u_int32_t number, compacted;
+	bool found;
+	int i;
+	DIR *directory;
+
+	log->dir = dir;
+	log->total_bytes = 0;
+	log->max_bytes = max_bytes;
+	log->max_age = max_age;
+	log->sync_fd = create_timer();
+	log->cursors_dirty = false;
+	log->compact_fd = create_timer();
+	log->compaction.state = COMPACT_IDLE;
+	log->compaction.segment = 0;
+	log->compaction.segments_left = 0;
+	log->compaction.fd = -1;
+	log->compaction.synced = false;
+	log->compacted = SF_NO_SEGMENT;
+
+	ABORT(mkdir(dir, 0755) == -1 && errno != EEXIST, "SF log: CREATE DIRECTORY error\n");
+	log->lock_fd = open((log->dir + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	ABORT(log->lock_fd == -1, "SF log: LOCK error\n");
+	ABORT(flock(log->lock_fd, LOCK_EX | LOCK_NB) == -1, "SF log: directory used by another server\n");
+
+	// the cursors name the segment that was being replaced by its compacted copy, if any
+	found = load_cursors(log, &end, &compacted);
+
+	directory = opendir(dir);
+	ABORT(directory == NULL, "SF log: OPEN DIRECTORY error\n");
+	while ((entry = readdir(directory)) != NULL) {
+		if (sscanf(entry->d_name, "seg-%8u.log", &number) == 1 && strlen(entry->d_name) == 16)
+			numbers.push_back(number);
+		else if (strstr(entry->d_name, ".compact") != NULL)
+			copies.push_back(entry->d_name);
+	}
+	closedir(directory);
+
+	// a synced copy replaces its segment only if the cursors saved for it were written, other copies are incomplete
+	for (i = 0; i < (int) copies.size(); i++) {
+		if (sscanf(copies[i].c_str(), "seg-%8u.log.compact", &number) == 1 && copies[i].size() == 24 && number == compacted) {
+			ABORT(rename((log->dir + "/" + copies[i]).c_str(), log_path(log, number, "").c_str()) == -1, "SF log: COMPACT error\n");
+			sync_directory(log);
+		} else {
+			unlink((log->dir + "/" + copies[i]).c_str());
+		}
+	}
+
+	// recover the segments in order
+	for (i = 0; i < (int) numbers.size(); i++)
+		open_segment(log, numbers[i]);
+	for (segment = log->segments.begin(); segment != log->segments.end(); segment++) {
+		recover_segment(&segment->second);
+		log->total_bytes += segment->second.size;
+	}
+	if (log->segments.empty())
+		open_segment(log, 0);
+
+	// without a cursors file, every record may be needed
+	if (!found) {
+		end.segment = log->segments.begin()->first;
+		end.offset = 0;
+	}
+	for (i = 0; i < 2; i++) {
+		log->cursors_fd[i] = open((log->dir + "/cursors." + to_string(i)).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		ABORT(log->cursors_fd[i] == -1, "SF log: OPEN CURSORS error\n");
+	}
+	recover_cursors(log, end);
+
+	// cursors before the oldest segment move to its start
+	for (iter = log->cursors.begin(); iter != log->cursors.end(); iter++) {
+		if ((*iter).second->position.segment < log->segments.begin()->first) {
+			(*iter).second->position.segment = log->segments.begin()->first;
+			(*iter).second->position.offset = 0;
+		}
+	}
+	enforce_retention(log);
+
+	return log;
+}
+
+/**
+	@brief Function that closes an SF log, saving the cursors of the subscribers.
+
+	@param log The SF log.
+	@param remove_files True to delete the log (temporary logs).
+**/
+void close_sf_log(struct sf_log *log, bool remove_files) {
+	map <u_int32_t, struct sf_segment>::iterator segment;
+	unordered_map <string_view, struct sf_cursor *>::iterator iter;
+
+	cancel_compaction(log);
+	persist_cursors(log);
+	for (iter = log->cursors.begin(); iter != log->cursors.end(); iter++)
+		delete (*iter).second;
+	close(log->sync_fd);
+	close(log->compact_fd);
+	close(log->cursors_fd[0]);
+	close(log->cursors_fd[1]);
+	for (segment = log->segments.begin(); segment != log->segments.end(); segment++) {
+		munmap(segment->second.map, SF_SEGMENT_SIZE);
+		close(segment->second.fd);
+		if (remove_files)
+			unlink(log_path(log, segment->first, "").c_str());
+	}
+	if (remove_files) {
+		unlink((log->dir + "/cursors.0").c_str());
+		unlink((log->dir + "/cursors.1").c_str());
+		unlink((log->dir + "/lock").c_str());
+		rmdir(log->dir.c_str());
+	}
+	close(log->lock_fd);
+	delete log;
+}
+
+/**
+	@brief Function that appends a message to the log, once for all the
+		   subscribers that have to receive it later. Subscribers without a
+		   backlog get a cursor pointing to this record.
+
+	@param log The SF log.
+	@param recipients IDs of the subscribers.
+	@param frame The encoded message.
+**/
+void append_sf_record(struct sf_log *log, vector <const char *> &recipients, struct msg_buf *frame) {
+	static thread_local char record_buffer[SF_MAX_RECORD];
+	struct sf_record *record = (struct sf_record *) record_buffer;
+	char *ids = (char *) (record + 1);
+	size_t per_record = (SF_MAX_RECORD - sizeof(struct sf_record) - frame->length - 8) / SF_ID_SIZE;
+	size_t first, i;
+	struct sf_segment *segment;
+	struct sf_position position;
+	struct sf_cursor *cursor;
+
+	// messages with many recipients are split in several records
+	for (first = 0; first < recipients.size(); first += per_record) {
+		size_t count = recipients.size() - first < per_record ? recipients.size() - first : per_record;
+
+		record->nr_recipients = count;
+		record->frame_length = frame->length;
+		record->reserved = 0;
+		record->time = time(NULL);
+		for (i = 0; i < count; i++)
+			strncpy(ids + i * SF_ID_SIZE, recipients[first + i], SF_ID_SIZE);
+		memcpy(ids + count * SF_ID_SIZE, frame->data, frame->length);
+		record->length = (sizeof(struct sf_record) + count * SF_ID_SIZE + frame->length + 7) & ~7u;
+		memset(record_buffer + sizeof(struct sf_record) + count * SF_ID_SIZE + frame->length, 0,
+			record->length - (sizeof(struct sf_record) + count * SF_ID_SIZE + frame->length));
+		record->checksum = record_checksum(record_buffer + 8, record->length - 8);
+
+		if (log->segments.rbegin()->second.size + record->length > SF_SEGMENT_SIZE)
+			roll_segment(log);
+		position.segment = log->segments.rbegin()->first;
+		segment = &log->segments.rbegin()->second;
+		position.offset = segment->size;
+		ABORT(pwrite(segment->fd, record_buffer, record->length, segment->size) != record->length,
+			"SF log: WRITE error\n");
+		segment->size += record->length;
+		segment->last_time = record->time;
+		log->total_bytes += record->length;
+
+		/*
+		 * a new cursor is saved with the next cursors file; after a crash, it
+		 * is rebuilt from the records that follow the end saved in the file
+		 */
+		for (i = 0; i < count; i++) {
+			cursor = find_cursor(log, recipients[first + i]);
+			if (cursor == NULL) {
+				cursor = add_cursor(log, recipients[first + i], position, true);
+				touch_cursors(log);
+			}
+			if (!cursor->indexed)
+				continue;
+			if (cursor->records.size() < SF_INDEX_MAX) {
+				cursor->records.push_back(position);
+			} else {
+				cursor->indexed = false;
+				cursor->records.clear();
+			}
+		}
+	}
+
+	if (log->max_bytes != 0 && log->total_bytes > log->max_bytes)
+		enforce_retention(log);
+}
+
+/**
+	@brief Function that checks if a subscriber still has messages in the log.
+
+	@param log The SF log.
+	@param id The ID of the subscriber.
+**/
+bool has_backlog(struct sf_log *log, const char *id) {
+	return !log->cursors.empty() && find_cursor(log, id) != NULL;
+}
+
+/**
+	@brief Function that reads (from the mapped segments) the next message of
+		   the backlog of a subscriber and advances its cursor. When the end of
+		   the log is reached, the cursor is removed.
+
+	@param log The SF log.
+	@param id The ID of the subscriber.
+
+	@return struct msg_buf* The message (the caller owns the reference), NULL
+							if the backlog is empty.
+**/
+struct msg_buf *next_backlog_msg(struct sf_log *log, const char *id) {
+	struct sf_cursor *cursor = find_cursor(log, id);
+	map <u_int32_t, struct sf_segment>::iterator segment;
+	struct sf_position position;
+	struct sf_record *record;
+	struct msg_buf *buf;
+	int i;
+
+	if (cursor == NULL)
+		return NULL;
+
+	// an indexed cursor reads its next record directly
+	if (cursor->indexed && !cursor->records.empty()) {
+		position = cursor->records.front();
+		cursor->records.pop_front();
+		record = (struct sf_record *) (log->segments[position.segment].map + position.offset);
+		buf = alloc_msg(record->frame_length);
+		memcpy(buf->data, (char *) (record + 1) + record->nr_recipients * SF_ID_SIZE, record->frame_length);
+		cursor->position.segment = position.segment;
+		cursor->position.offset = position.offset + record->length;
+		return buf;
+	}
+
+	position = cursor->position;
+	while (!cursor->indexed && (segment = log->segments.lower_bound(position.segment)) != log->segments.end()) {
+		if (segment->first != position.segment) {
+			position.segment = segment->first;
+			position.offset = 0;
+		}
+		if (position.offset >= segment->second.size) {
+			position.segment++;
+			position.offset = 0;
+			continue;
+		}
+
+		record = (struct sf_record *) (segment->second.map + position.offset);
+		char *ids = (char *) (record + 1);
+
+		position.offset += record->length;
+		for (i = 0; i < record->nr_recipients; i++) {
+			if (strncmp(ids + i * SF_ID_SIZE, id, SF_ID_SIZE) == 0) {
+				buf = alloc_msg(record->frame_length);
+				memcpy(buf->data, ids + record->nr_recipients * SF_ID_SIZE, record->frame_length);
+				cursor->position = position;
+				return buf;
+			}
+		}
+	}
+
+	// the subscriber caught up with the log
+	remove_cursor(log, cursor);
+	touch_cursors(log);
+	return NULL;
+}
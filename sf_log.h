@@ -0,0 +1,133 @@
+#ifndef _SF_LOG_H
+#define _SF_LOG_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "msg_pool.h"
+
+using namespace std;
+
+#ifndef SF_SEGMENT_SIZE
+#define SF_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+#define SF_MAX_RECORD (64 * 1024)
+#define SF_ID_SIZE 13
+#define SF_INDEX_MAX 65536		// records of a cursor kept in memory, beyond them its backlog is scanned
+#define SF_CURSORS_SYNC_US 1000000	// cursors that changed are saved after at most this delay
+#define SF_COMPACT_SEGMENTS 4		// oldest sealed segments checked when a segment is full
+#define SF_COMPACT_STEP (1024 * 1024)	// bytes of a segment checked or copied by a step of a compaction
+#define SF_NO_SEGMENT ((u_int32_t) -1)
+
+// states of the compaction of a sealed segment
+#define COMPACT_IDLE 0
+#define COMPACT_SCAN 1		// the bytes of the records still needed are counted
+#define COMPACT_COPY 2		// those records are copied to the .compact file
+#define COMPACT_SYNC 3		// a thread writes the .compact file to the disk
+
+// position of a record in the log: segment number, then offset in the segment
+struct sf_position {
+	u_int32_t segment;
+	u_int32_t offset;
+};
+
+/*
+ * Header of a record, followed by nr_recipients IDs (SF_ID_SIZE bytes each)
+ * and by the encoded frame. Records are padded to 8 bytes.
+ */
+struct sf_record {
+	u_int32_t length;		// whole record, with padding
+	u_int32_t checksum;		// of everything after this field
+	u_int64_t time;
+	u_int16_t nr_recipients;
+	u_int16_t frame_length;
+	u_int32_t reserved;
+};
+
+struct sf_segment {
+	int fd;
+	char *map;			// read-only mapping of SF_SEGMENT_SIZE bytes
+	u_int32_t size;		// bytes written
+	time_t last_time;	// time of the newest record
+};
+
+/*
+ * Backlog of a subscriber. While it is indexed, the positions of all its
+ * records (appended since the cursor was created) are kept, so the records
+ * of the other subscribers are skipped without being read; a cursor loaded
+ * at startup, or whose backlog outgrew SF_INDEX_MAX records, scans the log.
+ */
+struct sf_cursor {
+	char id[SF_ID_SIZE + 1];	// key of the cursor in the log
+	struct sf_position position;	// first record it may still need
+	bool indexed;
+	deque <struct sf_position> records;	// its records from position on, if indexed
+};
+
+/*
+ * Compaction of the sealed segments, done from the event loop in steps of
+ * SF_COMPACT_STEP bytes (its timer fires again at once while work is left),
+ * so messages are routed and delivered in between. A record copied while a
+ * cursor still needed it only costs space; the cursors move to the new
+ * offsets when the copy replaces the segment.
+ */
+struct sf_compaction {
+	int state;
+	u_int32_t segment;	// being compacted, or the next one to check
+	int segments_left;	// to be checked before the compaction stops
+	u_int32_t offset;	// of the next record of the segment
+	u_int32_t live_bytes;	// of the records still needed
+	int fd;				// of the .compact file, -1 if none
+	u_int32_t new_size;	// bytes copied
+	vector <pair <u_int32_t, u_int32_t>> kept;	// old offset -> new offset, for every record copied so far
+	string copied;		// records copied by a step, written at once
+	atomic <bool> synced;	// set by the thread once the .compact file is on disk
+	thread syncer;
+};
+
+/*
+ * Store-and-forward log of a shard. Every message for offline SF subscribers
+ * is appended once, together with the IDs of those subscribers. Each subscriber
+ * with a backlog has a cursor, the position of the first record it may still
+ * need (plus, while its backlog is short, the positions of its records). The
+ * cursors are saved at most once per SF_CURSORS_SYNC_US, in turn in two files
+ * (the newest complete one is read back), with the end of the log when they
+ * were written: the cursors of the subscribers first found in the records
+ * after it are rebuilt when the log is recovered. The file saved just before
+ * a compacted segment is renamed also names that segment, so its .compact
+ * file replaces it if the server stopped in between.
+ */
+struct sf_log {
+	string dir;
+	int lock_fd;
+	map <u_int32_t, struct sf_segment> segments;
+	unordered_map <string_view, struct sf_cursor *> cursors;	// by ID (keys point to the cursors)
+	int cursors_fd[2];	// cursors files, written in turn
+	u_int32_t cursors_generation;	// of the newest cursors file
+	int sync_fd;		// timer for saving the cursors that changed
+	bool cursors_dirty;	// the cursors file is not up to date
+	int compact_fd;		// timer for the next step of the compaction
+	struct sf_compaction compaction;
+	u_int32_t compacted;	// segment whose .compact file replaces it, saved with the cursors while it is renamed
+	size_t total_bytes;
+	size_t max_bytes;	// 0 for no limit
+	time_t max_age;		// seconds, 0 for no limit
+};
+
+struct sf_log *open_sf_log(const char *dir, size_t max_bytes, time_t max_age);
+void close_sf_log(struct sf_log *log, bool remove_files);
+void append_sf_record(struct sf_log *log, vector <const char *> &recipients, struct msg_buf *frame);
+bool has_backlog(struct sf_log *log, const char *id);
+struct msg_buf *next_backlog_msg(struct sf_log *log, const char *id);
+void enforce_retention(struct sf_log *log);
+void sync_sf_cursors(struct sf_log *log);
+void compact_sf_log(struct sf_log *log);
+
+#endif
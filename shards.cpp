@@ -0,0 +1,473 @@
+#include <limits.h>
+#include <sys/eventfd.h>
+#include "shards.h"
+#include "event_loop.h"
+#include "udp_ingest.h"
+
+// helper, FNV-1a hash of a byte string
+static u_int32_t hash_bytes(const char *bytes, size_t length) {
+	u_int32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (u_int8_t) bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+	@brief Function that creates the shards of the broker: their event loops,
+		   wakeup descriptors, SF logs (with the subscriptions saved next to
+		   a persistent one) and the queues between every pair of shards. Each shard gets a copy of the configuration and an equal
+		   part of the SF log size limit.
+
+	@param set The shards of the broker.
+	@param nr_shards Number of shards (worker threads).
+	@param config Broker state holding the configuration parsed from arguments.
+**/
+void init_shards(struct shard_set *set, int nr_shards, struct broker *config) {
+	vector <struct state_entry> entries;
+	char path[PATH_MAX];
+	int i, j;
+
+	set->nr_shards = nr_shards;
+	set->shards = new struct shard[nr_shards];
+	set->stopping = false;
+	set->federation = NULL;
+	set->admission = NULL;
+
+	for (i = 0; i < nr_shards; i++) {
+		struct shard *shard = &set->shards[i];
+
+		shard->index = i;
+		shard->broker.epoll_fd = create_event_loop();
+		shard->broker.ring = NULL;
+		shard->broker.queue_limit = config->queue_limit;
+		shard->broker.overflow_policy = config->overflow_policy;
+		shard->broker.linger_us = config->linger_us;
+		shard->broker.coalesce_bytes = config->coalesce_bytes;
+		shard->broker.linger_fd = create_timer();
+		shard->broker.linger_armed = 0;
+		shard->broker.receive_time = 0;
+		shard->broker.oldest_retained = shard->broker.newest_retained = NULL;
+		shard->broker.retained_bytes = 0;
+		shard->broker.retain_max_bytes = config->retain_max_bytes / nr_shards;
+		shard->broker.sharded = nr_shards > 1;
+		shard->broker.shm = NULL;
+		shard->broker.shm_recipients = 0;
+		shard->broker.shm_bytes = config->shm_bytes;
+		shard->broker.resume_bytes = config->resume_bytes;
+		shard->broker.federated = config->federated;
+		shard->broker.peer_interest.peers = 0;
+		shard->broker.peer_interest.trie.nr_patterns = 0;
+		shard->broker.shard_interest.peers = 0;
+		shard->broker.shard_interest.trie.nr_patterns = 0;
+		for (j = 0; j < SHM_MAX_READERS; j++)
+			shard->broker.shm_readers[j] = NULL;
+		init_stats(&shard->broker.stats);
+		watch_fd(shard->broker.epoll_fd, shard->broker.linger_fd, EPOLLIN);
+		shard->broker.patterns.nr_patterns = 0;
+		snprintf(path, sizeof(path), "%s/shard-%d", config->sf_dir, i);
+		shard->broker.sf_log = open_sf_log(path, config->sf_max_bytes / nr_shards, config->sf_max_age);
+		watch_fd(shard->broker.epoll_fd, shard->broker.sf_log->sync_fd, EPOLLIN);
+		watch_fd(shard->broker.epoll_fd, shard->broker.sf_log->compact_fd, EPOLLIN);
+		shard->broker.state_log = NULL;
+		if (!set->temporary_sf_dir) {
+			// the subscriptions of the previous run are back before the first client connects
+			shard->broker.state_log = open_state_log(path, entries);
+			restore_subscriptions(&shard->broker, entries);
+			entries.clear();
+		}
+		shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ABORT(shard->wake_fd == -1, "Shard: EVENTFD error\n");
+		watch_fd(shard->broker.epoll_fd, shard->wake_fd, EPOLLIN);
+		shard->pool = create_msg_pool();
+		shard->UDP_batch = new struct udp_batch;
+		init_udp_batch(shard->UDP_batch);
+
+		shard->inbound.resize(nr_shards, NULL);
+		shard->wake_pending.resize(nr_shards, false);
+		shard->overflow.resize(nr_shards);
+		for (j = 0; j < nr_shards; j++) {
+			shard->overflowed[j] = false;
+			if (j != i)
+				shard->inbound[j] = new spsc_queue<struct shard_msg>(SHARD_QUEUE_SIZE);
+		}
+	}
+}
+
+/**
+	@brief Function that finds the shard that owns a client (its session,
+		   subscriptions and SF backlog).
+
+	@param set The shards of the broker.
+	@param id The ID of the client.
+	@return int Index of the owner shard.
+**/
+int client_owner(struct shard_set *set, const char *id) {
+	return hash_bytes(id, strnlen(id, 13)) % set->nr_shards;
+}
+
+/**
+	@brief Function that finds the shard that orders the messages of a topic.
+		   Every message of a topic goes trough its owner, which forwards it
+		   to the other shards, so all subscribers see the same order.
+
+	@param set The shards of the broker.
+	@param content Content of an UDP message (starting with the topic).
+	@param content_size Number of content bytes.
+	@return int Index of the owner shard.
+**/
+int topic_owner(struct shard_set *set, const char *content, int content_size) {
+	return hash_bytes(content, strnlen(content, content_size < 50 ? content_size : 50)) % set->nr_shards;
+}
+
+// helper, push the messages that did not fit in the queue of a shard, as long as it has room
+static void flush_overflow(struct shard_set *set, int self, int destination) {
+	struct shard *shard = &set->shards[self];
+	deque <struct shard_msg> &pending = shard->overflow[destination];
+
+	while (!pending.empty() && set->shards[destination].inbound[self]->push(pending.front())) {
+		pending.pop_front();
+		shard->wake_pending[destination] = true;
+	}
+	if (pending.empty())
+		shard->overflowed[destination] = false;
+}
+
+/*
+ * helper, hand a reference to a message to another shard. When its queue is
+ * full, the message waits in the overflow of this shard (behind the ones
+ * already there) and the destination wakes this shard once it drained its
+ * queue: no message is lost, even for a shard that is far behind.
+ */
+static void send_to_shard(struct shard_set *set, int self, int destination, u_int8_t kind, struct msg_buf *buf,
+						u_int32_t subscriber) {
+	struct shard *shard = &set->shards[self];
+	struct shard_msg msg;
+
+	msg.kind = kind;
+	msg.subscriber = subscriber;
+	msg.buf = hold_msg(buf);
+	if (shard->overflow[destination].empty() && set->shards[destination].inbound[self]->push(msg)) {
+		shard->wake_pending[destination] = true;
+		return;
+	}
+
+	shard->overflow[destination].push_back(msg);
+	count_stat(&shard->broker.stats, STAT_SHARD_OVERFLOWS, 1);
+	if (!shard->overflowed[destination]) {
+		// the destination may have drained its queue before the flag was set
+		shard->overflowed[destination] = true;
+		flush_overflow(set, self, destination);
+	}
+}
+
+// helper, deliver a message to the local subscribers, to the other shards and to the peers that want it
+static void deliver_everywhere(struct shard_set *set, int self, struct msg_buf *buf, bool relayed) {
+	struct broker *broker = &set->shards[self].broker;
+	string_view topic = frame_topic(buf);
+	u_int64_t shards;
+	u_int32_t peers;
+	int i;
+
+	deliver_message(buf, broker);
+	shards = interested_peers(&broker->shard_interest, topic);
+	for (i = 0; i < set->nr_shards; i++) {
+		if (i != self && (shards & ((u_int64_t) 1 << i)))
+			send_to_shard(set, self, i, SHARD_DELIVER, buf, NO_HANDLE);
+	}
+
+	// a message received from a peer is never forwarded again, so it cannot loop between brokers
+	if (relayed || broker->peer_interest.peers == 0)
+		return;
+	peers = interested_peers(&broker->peer_interest, topic);
+	if (peers == 0)
+		return;
+	if (self == 0)
+		forward_to_peers(set, buf, peers);
+	else
+		send_to_shard(set, self, 0, SHARD_FEDERATE, buf, peers);
+}
+
+/**
+	@brief Function that routes a message received by a shard from an UDP client.
+		   The message is encoded once; the shards only exchange references.
+
+	@param set The shards of the broker.
+	@param self Index of the shard that received the message.
+	@param content The content received on the UDP connection.
+	@param content_size Number of content bytes.
+	@param addr Address and port of the UDP client that generated this message.
+**/
+void route_message(struct shard_set *set, int self, char *content, int content_size, struct sockaddr_in addr) {
+	struct msg_buf *buf;
+	int owner;
+
+	if (set->nr_shards == 1 && set->federation == NULL) {
+		publish_message(content, content_size, &set->shards[self].broker, addr);
+		return;
+	}
+
+	buf = encode_publish(content, content_size, addr);
+	buf->time = set->shards[self].broker.receive_time;
+	owner = topic_owner(set, content, content_size);
+	if (owner == self)
+		deliver_everywhere(set, self, buf, false);
+	else
+		send_to_shard(set, self, owner, SHARD_ROUTE, buf, NO_HANDLE);
+	release_msg(buf);
+}
+
+/**
+	@brief Function that routes a message received from a peer broker, as
+		   route_message() does, except that it is not forwarded to the peers.
+
+	@param set The shards of the broker.
+	@param self Index of the shard that received the message.
+	@param buf The encoded message.
+**/
+void relay_message(struct shard_set *set, int self, struct msg_buf *buf) {
+	int owner = topic_owner(set, ((struct TCP_msg *) buf->data)->payload, buf->length - HEADER_SIZE);
+
+	if (owner == self)
+		deliver_everywhere(set, self, buf, true);
+	else
+		send_to_shard(set, self, owner, SHARD_RELAY, buf, NO_HANDLE);
+}
+
+/**
+	@brief Function that handles the messages handed to a shard by the other
+		   shards, then flushes the subscribers that got messages.
+
+	@param set The shards of the broker.
+	@param self Index of the current shard.
+**/
+void drain_inbound(struct shard_set *set, int self) {
+	struct shard *shard = &set->shards[self];
+	struct shard_msg msg;
+	vector <struct msg_buf *> retained;
+	u_int64_t value;
+	size_t j;
+	int i;
+
+	// reset the wakeup counter first, so that a later push wakes us again
+	read(shard->wake_fd, &value, sizeof(value));
+
+	// the shards woke us because they made room for the messages waiting for them
+	for (i = 0; i < set->nr_shards; i++) {
+		if (i != self && shard->overflowed[i])
+			flush_overflow(set, self, i);
+	}
+
+	for (i = 0; i < set->nr_shards; i++) {
+		if (i == self)
+			continue;
+		while (shard->inbound[i]->pop(msg)) {
+			if (msg.kind == SHARD_ROUTE || msg.kind == SHARD_RELAY) {
+				deliver_everywhere(set, self, msg.buf, msg.kind == SHARD_RELAY);
+			} else if (msg.kind == SHARD_DELIVER) {
+				deliver_message(msg.buf, &shard->broker);
+			} else if (msg.kind == SHARD_RETAIN_REQUEST) {
+				// the buffer holds the subscribed topic or pattern
+				retained.clear();
+				find_retained(&shard->broker, string_view(msg.buf->data, msg.buf->length), retained);
+				for (j = 0; j < retained.size(); j++)
+					send_to_shard(set, self, i, SHARD_RETAINED, retained[j], msg.subscriber);
+			} else if (msg.kind == SHARD_INTEREST) {
+				// the buffer holds the operation, then the topic or pattern
+				count_interest(set->federation, msg.buf->data[0], string_view(msg.buf->data + 1, msg.buf->length - 1));
+			} else if (msg.kind == SHARD_SUBSCRIBERS) {
+				update_peer_interest(&shard->broker.shard_interest, i, msg.buf->data[0],
+									string_view(msg.buf->data + 1, msg.buf->length - 1));
+			} else if (msg.kind == SHARD_PEER_INTEREST) {
+				update_peer_interest(&shard->broker.peer_interest, msg.subscriber, msg.buf->data[0],
+									string_view(msg.buf->data + 1, msg.buf->length - 1));
+			} else if (msg.kind == SHARD_FEDERATE) {
+				forward_to_peers(set, msg.buf, msg.subscriber);
+			} else {
+				adopt_retained(&shard->broker, msg.subscriber, msg.buf);
+			}
+			release_msg(msg.buf);
+		}
+
+		// the queue is empty, the source pushes the messages that did not fit
+		if (set->shards[i].overflowed[self])
+			shard->wake_pending[i] = true;
+	}
+
+	flush_dirty_subscribers(&shard->broker);
+	wake_shards(set, self);
+}
+
+/**
+	@brief Function that wakes the shards that were sent messages since the
+		   last call (once per batch, not once per message).
+
+	@param set The shards of the broker.
+	@param self Index of the current shard.
+**/
+void wake_shards(struct shard_set *set, int self) {
+	u_int64_t value = 1;
+	int i;
+
+	for (i = 0; i < set->nr_shards; i++) {
+		if (set->shards[self].wake_pending[i]) {
+			set->shards[self].wake_pending[i] = false;
+			write(set->shards[i].wake_fd, &value, sizeof(value));
+		}
+	}
+}
+
+/**
+	@brief Function that asks every other shard for the retained messages
+		   matched by the subscriptions made on this shard since the last call.
+
+	@param set The shards of the broker.
+	@param self Index of the current shard.
+**/
+void forward_retain_requests(struct shard_set *set, int self) {
+	vector <struct retain_request> &requests = set->shards[self].broker.retain_requests;
+	struct msg_buf *buf;
+	size_t i;
+	int j;
+
+	for (i = 0; i < requests.size(); i++) {
+		buf = alloc_msg(requests[i].name.size());
+		memcpy(buf->data, requests[i].name.data(), requests[i].name.size());
+		for (j = 0; j < set->nr_shards; j++) {
+			if (j != self)
+				send_to_shard(set, self, j, SHARD_RETAIN_REQUEST, buf, requests[i].subscriber);
+		}
+		release_msg(buf);
+	}
+	requests.clear();
+	wake_shards(set, self);
+}
+
+// helper, encode a change of interest (the operation, then the topic or pattern) for another shard
+static struct msg_buf *encode_interest(u_int8_t op, string_view name) {
+	struct msg_buf *buf = alloc_msg(1 + name.size());
+
+	buf->data[0] = op;
+	memcpy(buf->data + 1, name.data(), name.size());
+	return buf;
+}
+
+/**
+	@brief Function that hands the topics and patterns that got their first
+		   subscription on this shard, or lost their last one, since the last
+		   call: to the shards that route their messages (the owner of a
+		   topic, every shard for a pattern) and to shard 0, which counts
+		   them for the peer brokers.
+
+	@param set The shards of the broker.
+	@param self Index of the current shard.
+**/
+void forward_interest(struct shard_set *set, int self) {
+	struct broker *broker = &set->shards[self].broker;
+	vector <struct interest_change> &changes = broker->interest_changes;
+	struct msg_buf *buf;
+	size_t i;
+	int owner, j;
+
+	for (i = 0; i < changes.size(); i++) {
+		buf = encode_interest(changes[i].op, changes[i].name);
+		if (broker->sharded && is_pattern(changes[i].name)) {
+			for (j = 0; j < set->nr_shards; j++) {
+				if (j != self)
+					send_to_shard(set, self, j, SHARD_SUBSCRIBERS, buf, NO_HANDLE);
+			}
+		} else if (broker->sharded) {
+			owner = topic_owner(set, changes[i].name.data(), changes[i].name.size());
+			if (owner != self)
+				send_to_shard(set, self, owner, SHARD_SUBSCRIBERS, buf, NO_HANDLE);
+		}
+
+		if (broker->federated && self == 0)
+			count_interest(set->federation, changes[i].op, changes[i].name);
+		else if (broker->federated)
+			send_to_shard(set, self, 0, SHARD_INTEREST, buf, NO_HANDLE);
+		release_msg(buf);
+	}
+	changes.clear();
+	wake_shards(set, self);
+}
+
+/**
+	@brief Function that applies a change of the interest of a peer broker
+		   on every shard (called by shard 0, which handles the links).
+
+	@param set The shards of the broker.
+	@param peer Index of the link of the peer.
+	@param op INTEREST_ADD, INTEREST_REMOVE or INTEREST_CLEAR.
+	@param name The topic or pattern.
+**/
+void broadcast_peer_interest(struct shard_set *set, int peer, u_int8_t op, string_view name) {
+	struct msg_buf *buf;
+	int i;
+
+	update_peer_interest(&set->shards[0].broker.peer_interest, peer, op, name);
+	if (set->nr_shards == 1)
+		return;
+
+	buf = encode_interest(op, name);
+	for (i = 1; i < set->nr_shards; i++)
+		send_to_shard(set, 0, i, SHARD_PEER_INTEREST, buf, peer);
+	release_msg(buf);
+	wake_shards(set, 0);
+}
+
+/**
+	@brief Function that hands an identified client to the shard that owns its ID.
+
+	@param set The shards of the broker.
+	@param owner Index of the owner shard.
+	@param client The socket, receive buffer and ID message of the client.
+**/
+void hand_off_client(struct shard_set *set, int owner, struct handoff *client) {
+	u_int64_t value = 1;
+
+	set->shards[owner].handoff_lock.lock();
+	set->shards[owner].handoffs.push_back(*client);
+	set->shards[owner].handoff_lock.unlock();
+	write(set->shards[owner].wake_fd, &value, sizeof(value));
+}
+
+/**
+	@brief Function that registers the clients handed to a shard.
+
+	@param set The shards of the broker.
+	@param self Index of the current shard.
+**/
+void adopt_clients(struct shard_set *set, int self) {
+	struct shard *shard = &set->shards[self];
+	vector <struct handoff> clients;
+	vector <struct handoff>::iterator iter;
+
+	shard->handoff_lock.lock();
+	clients.swap(shard->handoffs);
+	shard->handoff_lock.unlock();
+
+	for (iter = clients.begin(); iter != clients.end(); iter++)
+		admit_client(&shard->broker, (*iter).socket, &(*iter).reader, &(*iter).msg, &(*iter).addr);
+}
+
+/**
+	@brief Function that asks every shard to stop and waits for the worker threads.
+
+	@param set The shards of the broker.
+**/
+void stop_shards(struct shard_set *set) {
+	u_int64_t value = 1;
+	int i;
+
+	set->stopping = true;
+	for (i = 0; i < set->nr_shards; i++)
+		write(set->shards[i].wake_fd, &value, sizeof(value));
+	for (i = 0; i < set->nr_shards; i++) {
+		if (set->shards[i].worker.joinable())
+			set->shards[i].worker.join();
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef _SHARDS_H
+#define _SHARDS_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "custom_TCP.h"
+#include "spsc_queue.h"
+#include "msg_pool.h"
+
+#define MAX_SHARDS 64
+#define SHARD_QUEUE_SIZE 8192
+
+// kinds of messages exchanged between shards
+#define SHARD_ROUTE 0	// for the shard that owns the topic, which delivers it to every shard
+#define SHARD_DELIVER 1	// for the subscribers of the destination shard
+#define SHARD_RETAIN_REQUEST 2	// a new subscription asks for the retained messages of a topic or pattern
+#define SHARD_RETAINED 3	// a retained message, for the subscriber that asked for it
+#define SHARD_INTEREST 4	// a subscription was added or removed, for shard 0 (counted for the peer brokers)
+#define SHARD_PEER_INTEREST 5	// a peer broker (un)subscribed a topic or pattern
+#define SHARD_FEDERATE 6	// a message for the links of shard 0 to the peers that want it
+#define SHARD_RELAY 7		// a message from a peer broker, for the shard that owns the topic
+#define SHARD_SUBSCRIBERS 8	// a shard got its first subscription of a topic or pattern, or lost its last one
+
+struct udp_batch;
+struct admission;
+
+// reference to an encoded message, handed from one shard to another
+struct shard_msg {
+	u_int8_t kind;
+	u_int32_t subscriber;	// handle of the subscriber (retained messages), peer or peers (federation)
+	struct msg_buf *buf;
+};
+
+// client identified by shard 0, to be registered by the shard that owns its ID
+struct handoff {
+	int socket;
+	struct frame_reader reader;
+	struct TCP_msg msg;
+	struct sockaddr_in addr;
+};
+
+/*
+ * A worker of the broker: a thread with its own event loop, UDP socket and
+ * broker state. Subscribers are partitioned between shards by their ID.
+ */
+struct shard {
+	int index;
+	int wake_fd;		// eventfd, written when messages or clients are handed to this shard
+	int socket_UDP;
+	struct broker broker;
+	struct udp_batch *UDP_batch;
+	struct msg_pool *pool;	// buffers of the messages encoded by this shard
+	vector <spsc_queue<struct shard_msg> *> inbound;	// indexed by the source shard
+	vector <bool> wake_pending;	// destination shards that got messages and were not woken yet
+	vector <deque <struct shard_msg>> overflow;	// by destination, messages that did not fit in its queue (in order)
+	atomic <bool> overflowed[MAX_SHARDS];	// by destination, set while its overflow is not empty
+	mutex handoff_lock;
+	vector <struct handoff> handoffs;
+	thread worker;
+};
+
+struct shard_set {
+	int nr_shards;
+	struct shard *shards;
+	atomic <bool> stopping;
+	bool temporary_sf_dir;	// the SF logs are removed when the server stops
+	int stats_socket;		// UNIX socket for statistics snapshots, -1 if there is none
+	struct federation *federation;	// links to the peer brokers (shard 0), NULL without peers
+	struct admission *admission;	// connections accepted by shard 0 that did not identify themselves yet
+};
+
+void init_shards(struct shard_set *set, int nr_shards, struct broker *config);
+int client_owner(struct shard_set *set, const char *id);
+int topic_owner(struct shard_set *set, const char *content, int content_size);
+void route_message(struct shard_set *set, int self, char *content, int content_size, struct sockaddr_in addr);
+void relay_message(struct shard_set *set, int self, struct msg_buf *buf);
+void drain_inbound(struct shard_set *set, int self);
+void wake_shards(struct shard_set *set, int self);
+void forward_retain_requests(struct shard_set *set, int self);
+void forward_interest(struct shard_set *set, int self);
+void broadcast_peer_interest(struct shard_set *set, int peer, u_int8_t op, string_view name);
+void hand_off_client(struct shard_set *set, int owner, struct handoff *client);
+void adopt_clients(struct shard_set *set, int self);
+void stop_shards(struct shard_set *set);
+
+#endif
@@ -0,0 +1,380 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include "shm_ring.h"
+#include "frame_reader.h"
+
+// helper, futex(2) on a word shared between processes (there is no wrapper in libc)
+static void futex(atomic <u_int32_t> *word, int op, u_int32_t value) {
+	syscall(SYS_futex, (u_int32_t *) word, op, value, NULL, NULL, 0);
+}
+
+// helper, bytes taken by a record of a frame
+static u_int64_t record_size(u_int32_t length) {
+	return (sizeof(struct shm_record) + length + SHM_ALIGN - 1) & ~((u_int64_t) SHM_ALIGN - 1);
+}
+
+/**
+	@brief Function that creates the shared memory ring of a shard, with a
+		   name that is unique on the host.
+
+	@param capacity Bytes of records (rounded up to a power of two).
+
+	@return struct shm_ring* The ring, NULL if the segment cannot be created.
+**/
+struct shm_ring *create_shm_ring(size_t capacity) {
+	static atomic <int> nr_rings(0);
+	struct shm_ring *ring = new struct shm_ring;
+	u_int64_t rounded = 4096;
+	int i;
+
+	while (rounded < capacity)
+		rounded <<= 1;
+	snprintf(ring->name, sizeof(ring->name), "/broker.%d.%d", (int) getpid(), nr_rings++);
+	ring->size = sizeof(struct shm_header) + rounded;
+	ring->fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (ring->fd == -1) {
+		delete ring;
+		return NULL;
+	}
+	if (ftruncate(ring->fd, ring->size) == -1
+			|| (ring->header = (struct shm_header *) mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+														MAP_SHARED, ring->fd, 0)) == MAP_FAILED) {
+		close(ring->fd);
+		shm_unlink(ring->name);
+		delete ring;
+		return NULL;
+	}
+
+	ring->header->magic = SHM_MAGIC;
+	ring->header->capacity = rounded;
+	ring->header->write_position.store(0);
+	for (i = 0; i < SHM_MAX_READERS; i++) {
+		ring->header->slots[i].position.store(SHM_DETACHED);
+		ring->header->slots[i].doorbell.store(0);
+		ring->header->slots[i].sleeping.store(0);
+	}
+	ring->records = (char *) (ring->header + 1);
+	ring->attached = 0;
+	ring->pending_bells = 0;
+	return ring;
+}
+
+/**
+	@brief Function that unmaps and removes the ring (readers keep their
+		   mapping until they close it).
+
+	@param ring The ring.
+**/
+void close_shm_ring(struct shm_ring *ring) {
+	munmap(ring->header, ring->size);
+	close(ring->fd);
+	shm_unlink(ring->name);
+	delete ring;
+}
+
+/**
+	@brief Function that gives a free slot to a new reader, which starts at
+		   the current end of the ring.
+
+	@param ring The ring.
+
+	@return int The slot, NO_SHM_SLOT if every slot is in use.
+**/
+int attach_reader(struct shm_ring *ring) {
+	struct shm_slot *slot;
+	int i;
+
+	if (~ring->attached == 0)
+		return NO_SHM_SLOT;
+	i = __builtin_ctzll(~ring->attached);
+	slot = &ring->header->slots[i];
+	slot->sleeping.store(0);
+	slot->position.store(ring->header->write_position.load(memory_order_relaxed));
+	ring->attached |= 1ULL << i;
+	return i;
+}
+
+/**
+	@brief Function that takes a slot back from its reader. The reader fails
+		   to claim anything after this.
+
+	@param ring The ring.
+	@param slot The slot.
+
+	@return u_int64_t Position of the first record the reader did not claim.
+**/
+u_int64_t detach_reader(struct shm_ring *ring, int slot) {
+	ring->attached &= ~(1ULL << slot);
+	ring->pending_bells &= ~(1ULL << slot);
+	return ring->header->slots[slot].position.exchange(SHM_DETACHED);
+}
+
+// helper, bytes needed to write a record at the end of the ring, with the padding before it
+static u_int64_t space_needed(struct shm_ring *ring, u_int32_t length) {
+	u_int64_t capacity = ring->header->capacity;
+	u_int64_t offset = ring->header->write_position.load(memory_order_relaxed) & (capacity - 1);
+	u_int64_t size = record_size(length);
+
+	return capacity - offset < size ? capacity - offset + size : size;
+}
+
+/**
+	@brief Function that finds the readers whose unread records would be
+		   overwritten by the next record.
+
+	@param ring The ring.
+	@param length Length of the next frame.
+
+	@return u_int64_t Mask of the slots of those readers.
+**/
+u_int64_t lagging_readers(struct shm_ring *ring, u_int32_t length) {
+	u_int64_t end = ring->header->write_position.load(memory_order_relaxed) + space_needed(ring, length);
+	u_int64_t attached = ring->attached, lagging = 0, position;
+	int i;
+
+	while (attached != 0) {
+		i = __builtin_ctzll(attached);
+		attached &= attached - 1;
+		position = ring->header->slots[i].position.load(memory_order_acquire);
+		if (end - position > ring->header->capacity)
+			lagging |= 1ULL << i;
+	}
+	return lagging;
+}
+
+/**
+	@brief Function that appends a frame to the ring, once for all its
+		   readers (lagging readers must be detached first).
+
+	@param ring The ring.
+	@param frame The encoded frame.
+	@param length Length of the frame.
+	@param readers Mask of the slots of the readers.
+**/
+void write_record(struct shm_ring *ring, const char *frame, u_int32_t length, u_int64_t readers) {
+	u_int64_t capacity = ring->header->capacity, size = record_size(length);
+	u_int64_t position = ring->header->write_position.load(memory_order_relaxed);
+	struct shm_record *record;
+
+	if (capacity - (position & (capacity - 1)) < size) {
+		record = (struct shm_record *) (ring->records + (position & (capacity - 1)));
+		record->length = SHM_PADDING;
+		record->readers = 0;
+		position += capacity - (position & (capacity - 1));
+	}
+	record = (struct shm_record *) (ring->records + (position & (capacity - 1)));
+	record->length = length;
+	record->readers = readers;
+	memcpy(record + 1, frame, length);
+
+	// published with a full barrier, so the doorbells see the readers that went to sleep before it
+	ring->header->write_position.store(position + size);
+	ring->pending_bells |= readers;
+}
+
+/**
+	@brief Function that reads the records of a reader taken back by the
+		   broker, from the position it did not claim (broker side).
+
+	@param ring The ring.
+	@param position Position of the next record, moved past the record returned.
+	@param slot Slot of the reader.
+	@param frame Where the frame is stored.
+	@param length Where the length of the frame is stored.
+
+	@return bool False if there are no more records for the reader.
+**/
+bool next_record(struct shm_ring *ring, u_int64_t *position, int slot, const char **frame, u_int32_t *length) {
+	u_int64_t capacity = ring->header->capacity;
+	u_int64_t end = ring->header->write_position.load(memory_order_relaxed);
+	struct shm_record *record;
+
+	while (*position != end) {
+		record = (struct shm_record *) (ring->records + (*position & (capacity - 1)));
+		if (record->length == SHM_PADDING) {
+			*position += capacity - (*position & (capacity - 1));
+			continue;
+		}
+		*position += record_size(record->length);
+		if (record->readers & (1ULL << slot)) {
+			*frame = (const char *) (record + 1);
+			*length = record->length;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+	@brief Function that wakes the sleeping readers that got records since
+		   the last call (once per batch, like the socket writes).
+
+	@param ring The ring.
+**/
+void ring_doorbells(struct shm_ring *ring) {
+	u_int64_t readers = ring->pending_bells;
+	struct shm_slot *slot;
+	int i;
+
+	ring->pending_bells = 0;
+	while (readers != 0) {
+		i = __builtin_ctzll(readers);
+		readers &= readers - 1;
+		slot = &ring->header->slots[i];
+		if (slot->sleeping.load() != 0 && slot->sleeping.exchange(0) != 0) {
+			slot->doorbell.fetch_add(1);
+			futex(&slot->doorbell, FUTEX_WAKE, 1);
+		}
+	}
+}
+
+// helper, thread of a reader that waits on the doorbell of its slot and signals the event loop
+static void wait_doorbell(struct shm_reader *reader) {
+	atomic <u_int32_t> *doorbell = &reader->header->slots[reader->slot].doorbell;
+	u_int32_t seen = doorbell->load(), now;
+	u_int64_t value = 1;
+
+	while (!reader->stopping) {
+		futex(doorbell, FUTEX_WAIT, seen);
+		now = doorbell->load();
+		if (now != seen) {
+			seen = now;
+			write(reader->wake_fd, &value, sizeof(value));
+		}
+	}
+}
+
+/**
+	@brief Function that maps the ring of the broker in a subscriber process
+		   and starts waiting on the doorbell of its slot.
+
+	@param name Name of the shared memory segment.
+	@param slot The slot given by the broker.
+
+	@return struct shm_reader* The reader, NULL if the ring cannot be mapped.
+**/
+struct shm_reader *open_shm_reader(const char *name, int slot) {
+	struct shm_reader *reader;
+	struct stat status;
+	void *mapping;
+	int fd;
+
+	if (slot < 0 || slot >= SHM_MAX_READERS || (fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) == -1)
+		return NULL;
+	if (fstat(fd, &status) == -1 || (size_t) status.st_size < sizeof(struct shm_header)
+			|| (mapping = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	reader = new struct shm_reader;
+	reader->header = (struct shm_header *) mapping;
+	reader->records = (char *) (reader->header + 1);
+	reader->size = status.st_size;
+	reader->slot = slot;
+	reader->position = reader->header->slots[slot].position.load();
+	reader->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	reader->stopping = false;
+	if (reader->header->magic != SHM_MAGIC || reader->size != sizeof(struct shm_header) + reader->header->capacity
+			|| reader->position == SHM_DETACHED || reader->wake_fd == -1) {
+		if (reader->wake_fd != -1)
+			close(reader->wake_fd);
+		munmap(mapping, reader->size);
+		delete reader;
+		return NULL;
+	}
+	reader->waker = thread(wait_doorbell, reader);
+	return reader;
+}
+
+/**
+	@brief Function that copies the next frame of the ring for the reader.
+		   A record is claimed (compare-and-swap of the slot position) only
+		   after it is copied, so it is never lost nor delivered twice when
+		   the broker takes the slot back meanwhile.
+
+	@param reader The reader.
+	@param frame Where the copy of the frame is stored (valid until the next call).
+	@param length Where the length of the frame is stored.
+
+	@return int FRAME_READY, FRAME_INCOMPLETE if the ring is empty for now or
+				SHM_CLOSED if the broker took the slot back.
+**/
+int next_shm_frame(struct shm_reader *reader, const char **frame, u_int32_t *length) {
+	u_int64_t capacity = reader->header->capacity, size, expected;
+	atomic <u_int64_t> *claimed = &reader->header->slots[reader->slot].position;
+	struct shm_record *record;
+	bool mine;
+
+	while (reader->position != reader->header->write_position.load(memory_order_acquire)) {
+		record = (struct shm_record *) (reader->records + (reader->position & (capacity - 1)));
+		if (record->length == SHM_PADDING) {
+			size = capacity - (reader->position & (capacity - 1));
+			mine = false;
+		} else {
+			size = record_size(record->length);
+			// a record overwritten after the slot was taken back may be garbage, the claim then fails
+			mine = (record->readers & (1ULL << reader->slot))
+				&& (reader->position & (capacity - 1)) + size <= capacity;
+			if (mine) {
+				reader->frame.assign((const char *) (record + 1), (const char *) (record + 1) + record->length);
+				*frame = reader->frame.data();
+				*length = reader->frame.size();
+			}
+		}
+
+		expected = reader->position;
+		if (!claimed->compare_exchange_strong(expected, reader->position + size))
+			return SHM_CLOSED;
+		reader->position += size;
+		if (mine)
+			return FRAME_READY;
+	}
+	return claimed->load() == SHM_DETACHED ? SHM_CLOSED : FRAME_INCOMPLETE;
+}
+
+/**
+	@brief Function that asks the broker to ring the doorbell of the reader
+		   for its next record.
+
+	@param reader The reader.
+
+	@return bool False if records arrived meanwhile (the reader must not sleep).
+**/
+bool sleep_shm_reader(struct shm_reader *reader) {
+	struct shm_slot *slot = &reader->header->slots[reader->slot];
+
+	slot->sleeping.store(1);
+	if (reader->header->write_position.load() != reader->position) {
+		slot->sleeping.store(0);
+		return false;
+	}
+	return true;
+}
+
+/**
+	@brief Function that stops the doorbell thread of the reader and unmaps
+		   the ring.
+
+	@param reader The reader.
+**/
+void close_shm_reader(struct shm_reader *reader) {
+	atomic <u_int32_t> *doorbell = &reader->header->slots[reader->slot].doorbell;
+
+	reader->stopping = true;
+	doorbell->fetch_add(1);
+	futex(doorbell, FUTEX_WAKE, 1);
+	reader->waker.join();
+	close(reader->wake_fd);
+	munmap(reader->header, reader->size);
+	delete reader;
+}
@@ -0,0 +1,100 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define SHM_MAX_READERS 64		// reader slots of a ring (bits of a record mask)
+#define SHM_ALIGN 16			// records start on this boundary
+#define SHM_MAGIC 0x53484d52494e4731ULL
+#define SHM_NAME_SIZE 32
+#define NO_SHM_SLOT -1
+
+#define DEFAULT_SHM_BYTES (4 * 1024 * 1024)
+
+// position of a reader slot that the broker took back (results of next_shm_frame() too)
+#define SHM_DETACHED ((u_int64_t) -1)
+#define SHM_CLOSED -3
+
+/*
+ * Slot of a reader, in its own cache line. The reader moves its position
+ * forward with a compare-and-swap after copying a record, so the broker can
+ * take the slot back at any time: whatever the reader did not claim yet is
+ * sent trough the socket instead.
+ */
+struct shm_slot {
+	atomic <u_int64_t> position;	// next byte to read, SHM_DETACHED once taken back
+	atomic <u_int32_t> doorbell;	// futex word, incremented to wake the reader
+	atomic <u_int32_t> sleeping;	// the reader waits for the doorbell
+	char padding[48];
+};
+
+// start of the shared memory segment, followed by the records
+struct shm_header {
+	u_int64_t magic;
+	u_int64_t capacity;		// bytes of records, a power of two
+	atomic <u_int64_t> write_position;	// bytes written since the ring was created
+	char padding[40];
+	struct shm_slot slots[SHM_MAX_READERS];
+};
+
+/*
+ * Record of the ring: an encoded v1 PUBLISH frame and the slots of the
+ * readers it is for, padded to SHM_ALIGN bytes. A record with length
+ * SHM_PADDING fills the end of the ring when the next one does not fit.
+ */
+#define SHM_PADDING ((u_int32_t) -1)
+struct shm_record {
+	u_int32_t length;
+	u_int32_t reserved;
+	u_int64_t readers;
+};
+
+/*
+ * Single producer / multiple consumer ring of a shard, in a POSIX shared
+ * memory segment. The shard writes every message once, for all the local
+ * subscribers it is for; readers that fall a whole ring behind are taken
+ * back before their records are overwritten.
+ */
+struct shm_ring {
+	int fd;
+	char name[SHM_NAME_SIZE];
+	struct shm_header *header;
+	char *records;
+	size_t size;			// of the mapping
+	u_int64_t attached;		// slots in use
+	u_int64_t pending_bells;	// readers that got records since the doorbells were rung
+};
+
+// reader side of a ring, in a subscriber process
+struct shm_reader {
+	struct shm_header *header;
+	char *records;
+	size_t size;
+	int slot;
+	u_int64_t position;
+	int wake_fd;			// eventfd written when the doorbell of the slot rings
+	atomic <bool> stopping;
+	thread waker;			// turns the futex doorbell into wake_fd events
+	vector <char> frame;	// copy of the last frame read
+};
+
+struct shm_ring *create_shm_ring(size_t capacity);
+void close_shm_ring(struct shm_ring *ring);
+int attach_reader(struct shm_ring *ring);
+u_int64_t detach_reader(struct shm_ring *ring, int slot);
+u_int64_t lagging_readers(struct shm_ring *ring, u_int32_t length);
+void write_record(struct shm_ring *ring, const char *frame, u_int32_t length, u_int64_t readers);
+bool next_record(struct shm_ring *ring, u_int64_t *position, int slot, const char **frame, u_int32_t *length);
+void ring_doorbells(struct shm_ring *ring);
+
+struct shm_reader *open_shm_reader(const char *name, int slot);
+int next_shm_frame(struct shm_reader *reader, const char **frame, u_int32_t *length);
+bool sleep_shm_reader(struct shm_reader *reader);
+void close_shm_reader(struct shm_reader *reader);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+#define CACHE_LINE 64
+
+/*
+ * Lock-free bounded queue with a single producer thread and a single consumer
+ * thread. The capacity must be a power of two. The head is only written by the
+ * consumer and the tail only by the producer, each on its own cache line.
+ */
+template <typename T>
+class spsc_queue {
+public:
+	explicit spsc_queue(size_t capacity) : mask(capacity - 1), slots(new T[capacity]) {
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	~spsc_queue() {
+		delete[] slots;
+	}
+
+	// producer side; returns false if the queue is full
+	bool push(const T &value) {
+		size_t current_tail = tail.load(std::memory_order_relaxed);
+
+		if (current_tail - cached_head > mask) {
+			cached_head = head.load(std::memory_order_acquire);
+			if (current_tail - cached_head > mask)
+				return false;
+		}
+		slots[current_tail & mask] = value;
+		tail.store(current_tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side; returns false if the queue is empty
+	bool pop(T &value) {
+		size_t current_head = head.load(std::memory_order_relaxed);
+
+		if (current_head == cached_tail) {
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (current_head == cached_tail)
+				return false;
+		}
+		value = slots[current_head & mask];
+		head.store(current_head + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+private:
+	const size_t mask;
+	T *const slots;
+
+	alignas(CACHE_LINE) std::atomic<size_t> head;
+	size_t cached_tail = 0;		// consumer's copy of tail
+
+	alignas(CACHE_LINE) std::atomic<size_t> tail;
+	size_t cached_head = 0;		// producer's copy of head
+};
+
+#endif
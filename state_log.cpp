@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "state_log.h"
+#include "custom_TCP.h"
+
+// helper, FNV-1a checksum of the bytes of a record
+static u_int32_t record_checksum(const char *bytes, size_t length) {
+	u_int32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (u_int8_t) bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// helper, path of a file of the state
+static string state_path(struct state_log *log, const char *name) {
+	return log->dir + "/" + name;
+}
+
+// helper, append the record of a subscription (or of its removal, without options) to a buffer
+static void encode_record(string &out, u_int8_t type, string_view id, string_view name,
+						const struct subscription *subscription) {
+	struct state_record record;
+	size_t start = out.size(), length;
+
+	memset(&record, 0, sizeof(record));
+	record.type = type;
+	record.filter_type = NO_DATA_TYPE;
+	record.id_length = id.size();
+	record.name_length = name.size();
+	if (subscription != NULL) {
+		record.fs = subscription->fs;
+		record.conflate = subscription->conflate;
+	}
+	// the other fields of a filter are not set when there is none
+	if (subscription != NULL && subscription->filter.data_type != NO_DATA_TYPE) {
+		record.filter_type = subscription->filter.data_type;
+		record.filter_op = subscription->filter.op;
+		record.low = subscription->filter.low;
+		record.high = subscription->filter.high;
+		record.text_length = subscription->filter.text.size();
+	}
+	length = sizeof(record) + id.size() + name.size() + record.text_length;
+	record.length = (length + 7) & ~7;
+
+	out.append((char *) &record, sizeof(record));
+	out.append(id);
+	out.append(name);
+	if (record.text_length > 0)
+		out.append(subscription->filter.text);
+	out.append(record.length - length, '\0');
+	record.checksum = record_checksum(out.data() + start + 8, record.length - 8);
+	memcpy(&out[start + 4], &record.checksum, sizeof(record.checksum));
+}
+
+// helper, check the record at an offset of a mapping; returns its length, 0 if it is not valid
+static u_int32_t check_record(const char *map, size_t size, size_t offset) {
+	const struct state_record *record = (const struct state_record *) (map + offset);
+
+	if (offset + sizeof(struct state_record) > size)
+		return 0;
+	if (record->length < sizeof(struct state_record) || offset + record->length > size
+			|| sizeof(struct state_record) + record->id_length + record->name_length + record->text_length > record->length)
+		return 0;
+	if (record_checksum(map + offset + 8, record->length - 8) != record->checksum)
+		return 0;
+
+	return record->length;
+}
+
+// helper, apply a record to the subscriptions being loaded (keyed by client ID and name)
+static void apply_record(const char *bytes, unordered_map <string, struct state_entry> &state) {
+	const struct state_record *record = (const struct state_record *) bytes;
+	const char *data = bytes + sizeof(struct state_record);
+	string key(data, record->id_length + record->name_length);
+
+	// an ID never contains a topic, so the key is not ambiguous
+	key.insert(record->id_length, 1, '\0');
+	if (record->type == STATE_UNSUBSCRIBE) {
+		state.erase(key);
+		return;
+	}
+
+	struct state_entry &entry = state[key];
+	entry.id.assign(data, record->id_length);
+	entry.name.assign(data + record->id_length, record->name_length);
+	entry.subscription.subscriber = NO_HANDLE;
+	entry.subscription.fs = record->fs;
+	entry.subscription.conflate = record->conflate;
+	entry.subscription.filter.data_type = record->filter_type;
+	entry.subscription.filter.op = record->filter_op;
+	entry.subscription.filter.low = record->low;
+	entry.subscription.filter.high = record->high;
+	entry.subscription.filter.text.assign(data + record->id_length + record->name_length, record->text_length);
+}
+
+// helper, map a file and apply its records from an offset; returns the end of the last valid record
+static size_t replay_file(int fd, size_t start, unordered_map <string, struct state_entry> &state) {
+	struct stat info;
+	size_t offset = start;
+	u_int32_t length;
+	char *map;
+
+	if (fstat(fd, &info) == -1 || (size_t) info.st_size <= start)
+		return start;
+	map = (char *) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	ABORT(map == MAP_FAILED, "State log: MAP error\n");
+	while ((length = check_record(map, info.st_size, offset)) != 0) {
+		apply_record(map + offset, state);
+		offset += length;
+	}
+	munmap(map, info.st_size);
+
+	return offset;
+}
+
+/**
+	@brief Function that opens the subscription state of a shard and loads
+		   the subscriptions saved by a previous run: the snapshot, then the
+		   changes logged after it (in the old log of a compaction, if any,
+		   then in the log). A torn record (the server stopped while
+		   writing it) ends the log.
+
+	@param dir Directory of the state (the directory of the SF log of the shard).
+	@param entries Where the loaded subscriptions are stored.
+
+	@return struct state_log* The state.
+**/
+struct state_log *open_state_log(const char *dir, vector <struct state_entry> &entries) {
+	struct state_log *log = new struct state_log;
+	unordered_map <string, struct state_entry> state;
+	unordered_map <string, struct state_entry>::iterator iter;
+	struct state_header header;
+	size_t end;
+	int fd;
+
+	log->dir = dir;
+	log->snapshot_bytes = 0;
+	fd = open(state_path(log, "state.snap").c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		if (read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == STATE_MAGIC)
+			log->snapshot_bytes = replay_file(fd, sizeof(header), state);
+		close(fd);
+	}
+
+	// the log set aside by a compaction that did not complete (replaying it again is harmless)
+	fd = open(state_path(log, "state.log.old").c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		replay_file(fd, 0, state);
+		close(fd);
+	}
+
+	log->fd = open(state_path(log, "state.log").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	ABORT(log->fd == -1, "State log: OPEN error\n");
+	end = replay_file(log->fd, 0, state);
+	ABORT(ftruncate(log->fd, end) == -1, "State log: TRUNCATE error\n");
+	log->log_bytes = end;
+
+	entries.reserve(state.size());
+	for (iter = state.begin(); iter != state.end(); iter++)
+		entries.push_back((*iter).second);
+	return log;
+}
+
+/**
+	@brief Function that closes the subscription state of a shard (the
+		   snapshot is written by the caller first).
+
+	@param log The state.
+**/
+void close_state_log(struct state_log *log) {
+	if (log->writer.joinable())
+		log->writer.join();
+	close(log->fd);
+	delete log;
+}
+
+/**
+	@brief Function that logs a subscription that was added, or whose options
+		   changed. The record is written by the next flush_state_log().
+
+	@param log The state.
+	@param id ID of the client.
+	@param name The topic or pattern.
+	@param subscription The subscription.
+**/
+void log_subscribe(struct state_log *log, const char *id, string_view name, const struct subscription *subscription) {
+	encode_record(log->pending, STATE_SUBSCRIBE, string_view(id, strnlen(id, SF_ID_SIZE)), name, subscription);
+}
+
+/**
+	@brief Function that logs a subscription that was removed.
+
+	@param log The state.
+	@param id ID of the client.
+	@param name The topic or pattern.
+**/
+void log_unsubscribe(struct state_log *log, const char *id, string_view name) {
+	encode_record(log->pending, STATE_UNSUBSCRIBE, string_view(id, strnlen(id, SF_ID_SIZE)), name, NULL);
+}
+
+// helper, write a buffer to a file, whatever the number of calls it takes
+static bool write_bytes(int fd, const char *bytes, size_t length) {
+	size_t written = 0;
+	ssize_t ret;
+
+	while (written < length) {
+		ret = write(fd, bytes + written, length - written);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return false;
+		written += ret;
+	}
+	return true;
+}
+
+/**
+	@brief Function that appends the changes logged since the last call to
+		   the change log, with a single write.
+
+	@param log The state.
+
+	@return bool True if the log outgrew the snapshot and a new snapshot
+				 should be written.
+**/
+bool flush_state_log(struct state_log *log) {
+	ABORT(!write_bytes(log->fd, log->pending.data(), log->pending.size()), "State log: WRITE error\n");
+	log->log_bytes += log->pending.size();
+	log->pending.clear();
+
+	return log->log_bytes > STATE_COMPACT_BYTES && log->log_bytes > log->snapshot_bytes;
+}
+
+// helper, write a snapshot of the subscriptions next to the old one, then rename it over the old one once it is on disk; returns its size
+static size_t store_snapshot(const string &dir, vector <struct state_entry> &entries) {
+	string path = dir + "/state.snap", temporary = path + ".tmp", records;
+	struct state_header header;
+	size_t i;
+	int fd;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = STATE_MAGIC;
+	header.nr_records = entries.size();
+	records.append((char *) &header, sizeof(header));
+	for (i = 0; i < entries.size(); i++)
+		encode_record(records, STATE_SUBSCRIBE, entries[i].id, entries[i].name, &entries[i].subscription);
+
+	fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	ABORT(fd == -1, "State log: WRITE SNAPSHOT error\n");
+	ABORT(!write_bytes(fd, records.data(), records.size()) || fsync(fd) == -1, "State log: WRITE SNAPSHOT error\n");
+	close(fd);
+	ABORT(rename(temporary.c_str(), path.c_str()) == -1, "State log: WRITE SNAPSHOT error\n");
+
+	// the rename itself is only durable once the directory is
+	fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	ABORT(fd == -1 || fsync(fd) == -1, "State log: SYNC DIRECTORY error\n");
+	close(fd);
+
+	return records.size();
+}
+
+// helper, body of the thread of a compaction: the snapshot replaces the old change log
+static void snapshot_writer(struct state_log *log, vector <struct state_entry> entries) {
+	log->snapshot_bytes = store_snapshot(log->dir, entries);
+	ABORT(unlink(state_path(log, "state.log.old").c_str()) == -1, "State log: REMOVE error\n");
+}
+
+/**
+	@brief Function that replaces the snapshot by the current subscriptions
+		   and empties the change log, before returning (when the broker
+		   starts or stops). The new snapshot is written next to the old
+		   one, then renamed over it.
+
+	@param log The state.
+	@param entries Every subscription of the shard.
+**/
+void write_state_snapshot(struct state_log *log, vector <struct state_entry> &entries) {
+	if (log->writer.joinable())
+		log->writer.join();
+	log->snapshot_bytes = store_snapshot(log->dir, entries);
+
+	// the snapshot holds every change logged so far
+	ABORT(unlink(state_path(log, "state.log.old").c_str()) == -1 && errno != ENOENT, "State log: REMOVE error\n");
+	ABORT(ftruncate(log->fd, 0) == -1, "State log: TRUNCATE error\n");
+	log->log_bytes = 0;
+	log->pending.clear();
+}
+
+/**
+	@brief Function that compacts the change log from the event loop. The
+		   log is set aside and a new one started, then the snapshot of the
+		   current subscriptions is written by a thread, which removes the
+		   old log once the snapshot replaced the previous one. Until then,
+		   a restarted broker loads the old snapshot and both logs.
+
+	@param log The state (its pending records were written).
+	@param entries Every subscription of the shard (moved to the thread).
+**/
+void compact_state_log(struct state_log *log, vector <struct state_entry> &entries) {
+	// the last compaction is still running only if the log grew very fast
+	if (log->writer.joinable())
+		log->writer.join();
+
+	ABORT(rename(state_path(log, "state.log").c_str(), state_path(log, "state.log.old").c_str()) == -1,
+		"State log: RENAME error\n");
+	close(log->fd);
+	log->fd = open(state_path(log, "state.log").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	ABORT(log->fd == -1, "State log: OPEN error\n");
+	log->log_bytes = 0;
+
+	log->writer = thread(snapshot_writer, log, move(entries));
+}
@@ -0,0 +1,83 @@
+#ifndef _STATE_LOG_H
+#define _STATE_LOG_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "topic_trie.h"
+
+using namespace std;
+
+#define STATE_MAGIC 0x5355425354415431ULL
+#define STATE_COMPACT_BYTES (8 * 1024 * 1024)	// the snapshot is rewritten when the log grows past this
+
+// types of a state record
+#define STATE_SUBSCRIBE 0
+#define STATE_UNSUBSCRIBE 1
+
+/*
+ * Record of the subscription state: a subscription (with its options and its
+ * compiled filter) or its removal, followed by the client ID, the topic or
+ * pattern and the operand of a text filter. Records are padded to 8 bytes.
+ */
+struct state_record {
+	u_int32_t length;		// whole record, with padding
+	u_int32_t checksum;		// of everything after this field
+	double low, high;		// bounds of a numeric filter
+	u_int8_t type;
+	u_int8_t fs;
+	u_int8_t conflate;
+	u_int8_t filter_type;	// NO_DATA_TYPE without a filter
+	u_int8_t filter_op;
+	u_int8_t id_length;
+	u_int8_t name_length;
+	u_int8_t reserved;
+	u_int32_t text_length;
+};
+
+// start of a snapshot, followed by STATE_SUBSCRIBE records
+struct state_header {
+	u_int64_t magic;
+	u_int32_t nr_records;
+	u_int32_t reserved;
+};
+
+// a subscription of a client, as saved
+struct state_entry {
+	string id;
+	string name;			// topic or pattern
+	struct subscription subscription;	// without a subscriber handle
+};
+
+/*
+ * Subscription state of a shard, saved next to its SF log: a snapshot of
+ * every subscription, rewritten atomically, plus an append-only log of the
+ * changes made since. A restarted broker maps both and rebuilds its topics
+ * before it accepts any client.
+ *
+ * A log that grew too long is compacted without stopping the event loop: it
+ * is renamed (state.log.old) and a new one is started, then a thread writes
+ * the new snapshot and removes the old log once the snapshot is on disk.
+ */
+struct state_log {
+	string dir;
+	int fd;				// of the change log
+	size_t log_bytes;
+	atomic <size_t> snapshot_bytes;	// written by the thread of a compaction
+	string pending;		// records not written yet
+	thread writer;		// writes the snapshot of the last compaction
+};
+
+struct state_log *open_state_log(const char *dir, vector <struct state_entry> &entries);
+void close_state_log(struct state_log *log);
+void log_subscribe(struct state_log *log, const char *id, string_view name, const struct subscription *subscription);
+void log_unsubscribe(struct state_log *log, const char *id, string_view name);
+bool flush_state_log(struct state_log *log);
+void write_state_snapshot(struct state_log *log, vector <struct state_entry> &entries);
+void compact_state_log(struct state_log *log, vector <struct state_entry> &entries);
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "stats.h"
+
+static const char *counter_names[NR_STATS] = {
+	"udp_batches", "udp_datagrams", "udp_bytes", "routed", "deliveries", "dropped",
+	"overflow_disconnects", "sf_records", "writes", "bytes_sent", "subscribers", "sf_bytes",
+	"retained_bytes", "filtered", "shm_records", "shm_overruns",
+	"peer_forwards", "peer_relays", "handshakes", "handshake_timeouts", "shard_overflows"
+};
+
+static const char *histogram_names[NR_HISTOGRAMS] = {
+	"route_ns", "queue_depth_bytes", "publish_to_send_ns"
+};
+
+// helper, highest value counted in a bucket
+static u_int64_t bucket_limit(int bucket) {
+	int exponent;
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+	exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	return ((u_int64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS + 1)
+			<< (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+// helper, value under which a fraction (per million) of the values of a histogram are
+static u_int64_t percentile(struct stats_snapshot *snapshot, int histogram, u_int64_t per_million) {
+	u_int64_t rank, seen = 0;
+	int i;
+
+	if (snapshot->count[histogram] == 0)
+		return 0;
+	rank = (snapshot->count[histogram] * per_million + 999999) / 1000000;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += snapshot->buckets[histogram][i];
+		if (seen >= rank)
+			break;
+	}
+	return min(bucket_limit(i), snapshot->max[histogram]);
+}
+
+/**
+	@brief Function that resets the statistics of a shard.
+
+	@param stats The statistics.
+**/
+void init_stats(struct broker_stats *stats) {
+	int i, j;
+
+	for (i = 0; i < NR_STATS; i++)
+		stats->counters[i].store(0, memory_order_relaxed);
+	for (i = 0; i < NR_HISTOGRAMS; i++) {
+		for (j = 0; j < HISTOGRAM_BUCKETS; j++)
+			stats->histograms[i].buckets[j].store(0, memory_order_relaxed);
+		stats->histograms[i].count.store(0, memory_order_relaxed);
+		stats->histograms[i].sum.store(0, memory_order_relaxed);
+		stats->histograms[i].max.store(0, memory_order_relaxed);
+	}
+}
+
+/**
+	@brief Function that empties a snapshot, before the statistics of the
+		   shards are added to it.
+
+	@param snapshot The snapshot.
+**/
+void clear_snapshot(struct stats_snapshot *snapshot) {
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+
+/**
+	@brief Function that adds the statistics of a shard to a snapshot. It may
+		   run on any thread; the values of a shard that is still working may
+		   be a few updates apart from each other.
+
+	@param snapshot The snapshot.
+	@param stats The statistics of the shard.
+**/
+void add_to_snapshot(struct stats_snapshot *snapshot, struct broker_stats *stats) {
+	u_int64_t max;
+	int i, j;
+
+	for (i = 0; i < NR_STATS; i++)
+		snapshot->counters[i] += stats->counters[i].load(memory_order_relaxed);
+	for (i = 0; i < NR_HISTOGRAMS; i++) {
+		for (j = 0; j < HISTOGRAM_BUCKETS; j++)
+			snapshot->buckets[i][j] += stats->histograms[i].buckets[j].load(memory_order_relaxed);
+		snapshot->count[i] += stats->histograms[i].count.load(memory_order_relaxed);
+		snapshot->sum[i] += stats->histograms[i].sum.load(memory_order_relaxed);
+		max = stats->histograms[i].max.load(memory_order_relaxed);
+		if (max > snapshot->max[i])
+			snapshot->max[i] = max;
+	}
+}
+
+/**
+	@brief Function that renders a snapshot as a JSON object, on one line:
+		   every counter, then the count, mean, p50, p99, p99.9 and max of
+		   every histogram.
+
+	@param snapshot The snapshot.
+	@param out Where the text is appended.
+**/
+void format_snapshot(struct stats_snapshot *snapshot, string &out) {
+	char field[256];
+	int i;
+
+	out += "{";
+	for (i = 0; i < NR_STATS; i++) {
+		snprintf(field, sizeof(field), "%s\"%s\":%llu", i == 0 ? "" : ",", counter_names[i],
+				(unsigned long long) snapshot->counters[i]);
+		out += field;
+	}
+	for (i = 0; i < NR_HISTOGRAMS; i++) {
+		snprintf(field, sizeof(field),
+				",\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+				histogram_names[i], (unsigned long long) snapshot->count[i],
+				(unsigned long long) (snapshot->count[i] == 0 ? 0 : snapshot->sum[i] / snapshot->count[i]),
+				(unsigned long long) percentile(snapshot, i, 500000),
+				(unsigned long long) percentile(snapshot, i, 990000),
+				(unsigned long long) percentile(snapshot, i, 999000),
+				(unsigned long long) snapshot->max[i]);
+		out += field;
+	}
+	out += "}\n";
+}
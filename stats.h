@@ -0,0 +1,116 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+// counters of a shard
+#define STAT_UDP_BATCHES 0
+#define STAT_UDP_DATAGRAMS 1
+#define STAT_UDP_BYTES 2
+#define STAT_ROUTED 3			// messages routed to the subscribers of their topic
+#define STAT_DELIVERIES 4		// messages queued for a subscriber
+#define STAT_DROPPED 5			// messages dropped by a full send queue
+#define STAT_OVERFLOW_DISCONNECTS 6
+#define STAT_SF_RECORDS 7
+#define STAT_WRITES 8
+#define STAT_BYTES_SENT 9
+#define STAT_SUBSCRIBERS 10		// gauge: connected subscribers
+#define STAT_SF_BYTES 11		// gauge: size of the SF log
+#define STAT_RETAINED_BYTES 12	// gauge: size of the retained messages
+#define STAT_FILTERED 13		// messages not sent to a subscriber because of its filter
+#define STAT_SHM_RECORDS 14		// messages written in the shared memory ring
+#define STAT_SHM_OVERRUNS 15	// readers of the ring taken back
+#define STAT_PEER_FORWARDS 16	// messages queued on the links to the peer brokers
+#define STAT_PEER_RELAYS 17		// messages received from the peer brokers
+#define STAT_HANDSHAKES 18		// gauge: connections that did not send their ID yet
+#define STAT_HANDSHAKE_TIMEOUTS 19	// connections closed before they sent their ID
+#define STAT_SHARD_OVERFLOWS 20	// messages that waited for room in the queue of another shard
+#define NR_STATS 21
+
+// histograms of a shard
+#define HIST_ROUTE_NS 0			// time to route a message (sampled)
+#define HIST_QUEUE_DEPTH 1		// bytes in a send queue when it is written
+#define HIST_PUBLISH_TO_SEND_NS 2	// from the UDP datagram to the end of the write
+#define NR_HISTOGRAMS 3
+
+#define ROUTE_SAMPLE 64			// one message in ROUTE_SAMPLE is timed
+
+/*
+ * Values are counted in buckets with 3 significant bits: exact below 8, then
+ * 8 buckets for every power of two, so every bucket is within 12.5% of its
+ * values (as in an HDR histogram).
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (64 - HISTOGRAM_SUB_BITS + 1))
+
+struct histogram {
+	atomic <u_int64_t> buckets[HISTOGRAM_BUCKETS];
+	atomic <u_int64_t> count;
+	atomic <u_int64_t> sum;
+	atomic <u_int64_t> max;
+};
+
+/*
+ * Statistics of a shard. Only the shard thread writes them, with plain
+ * (relaxed) loads and stores instead of read-modify-write instructions;
+ * any thread may read them for a snapshot.
+ */
+struct broker_stats {
+	atomic <u_int64_t> counters[NR_STATS];
+	struct histogram histograms[NR_HISTOGRAMS];
+};
+
+// sum of the statistics of every shard
+struct stats_snapshot {
+	u_int64_t counters[NR_STATS];
+	u_int64_t buckets[NR_HISTOGRAMS][HISTOGRAM_BUCKETS];
+	u_int64_t count[NR_HISTOGRAMS];
+	u_int64_t sum[NR_HISTOGRAMS];
+	u_int64_t max[NR_HISTOGRAMS];
+};
+
+void init_stats(struct broker_stats *stats);
+void clear_snapshot(struct stats_snapshot *snapshot);
+void add_to_snapshot(struct stats_snapshot *snapshot, struct broker_stats *stats);
+void format_snapshot(struct stats_snapshot *snapshot, string &out);
+
+// helper, add to a counter of the calling shard
+static inline void count_stat(struct broker_stats *stats, int counter, u_int64_t value) {
+	stats->counters[counter].store(stats->counters[counter].load(memory_order_relaxed) + value,
+								memory_order_relaxed);
+}
+
+// helper, set a gauge of the calling shard
+static inline void set_stat(struct broker_stats *stats, int counter, u_int64_t value) {
+	stats->counters[counter].store(value, memory_order_relaxed);
+}
+
+// helper, bucket of a value
+static inline int histogram_bucket(u_int64_t value) {
+	int exponent;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+	exponent = 63 - __builtin_clzll(value);
+	return HISTOGRAM_SUB_BUCKETS * (exponent - HISTOGRAM_SUB_BITS + 1)
+		+ ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// helper, add a value to a histogram of the calling shard
+static inline void record_value(struct broker_stats *stats, int histogram, u_int64_t value) {
+	struct histogram *target = &stats->histograms[histogram];
+	atomic <u_int64_t> *bucket = &target->buckets[histogram_bucket(value)];
+
+	bucket->store(bucket->load(memory_order_relaxed) + 1, memory_order_relaxed);
+	target->count.store(target->count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	target->sum.store(target->sum.load(memory_order_relaxed) + value, memory_order_relaxed);
+	if (value > target->max.load(memory_order_relaxed))
+		target->max.store(value, memory_order_relaxed);
+}
+
+#endif
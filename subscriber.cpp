@@ -9,41 +9,61 @@
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include "custom_TCP.h"
+#include "output_formatter.h"
+#include "broker_client.h"
+#include "protocol_v2.h"
 
+// messages are rendered here and written in blocks
+static struct output_buffer output;
 
-int main(int argc, char **argv) {
-	int server_socket, errors, enable, message_result;
-	char id[13];
-	char buffer[BUFLEN], command[15], *token, topic[52];
-	u_int8_t SF;
-	struct sockaddr_in serv_addr;
-	struct TCP_msg msg, received_msg;
+#define USAGE "Invalid number of arguments.\n \
+				./subscriber <ID_CLIENT> <IP_SERVER> <PORT_SERVER> [--v1] [--line-flush] [--shm] [--reconnect]\n"
 
-	/*
-	 * These tables will never be used. Their only purpose is having a valid
-	 * receive_msg() call.
-	 */
-	unordered_map <string, Subscriber> clients_table;
-	unordered_map <string, list <Subscription>> topics_table;
-	unordered_map <string, list<TCP_msg *>> unsent_table;
+#define RECONNECT_DELAY_US 100000
 
-	ABORT(argc != 4, "Invalid number of arguments.\n \
-					./subscriber <ID_CLIENT> <IP_SERVER> <PORT_SERVER>\n");
+// helper, render a message received from the server
+static void print_message(const struct message_view *message, void *arg) {
+	format_message((struct output_buffer *) arg, message);
+}
 
-	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+// helper, connect again to the server after the connection was lost, until it accepts
+static void reconnect(struct broker_client *client, struct sockaddr_in *server) {
+	client_close(client);
+	printf("Connection to server lost, reconnecting.\n");
+	while (client_reconnect(client, server) == -1)
+		usleep(RECONNECT_DELAY_US);
+}
 
-	// create socket for server communication
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-	ABORT(server_socket < 0, "Server socket: Socket CREATE error");
-	enable = 1;
+int main(int argc, char **argv) {
+	int errors, received, i;
+	bool line_flush = isatty(STDOUT_FILENO);
+	bool keep_connected = false;
+	u_int64_t reported_lost = 0;
+	u_int8_t protocol = PROTOCOL_V2, transport = TRANSPORT_TCP;
+	char buffer[BUFLEN], command[15], *token, *filter, topic[52];
+	u_int8_t SF, options;
+	struct sockaddr_in serv_addr;
+	struct broker_client client;
+
+	ABORT(argc < 4, USAGE);
+	for (i = 4; i < argc; i++) {
+		if (!strcmp(argv[i], "--v1"))
+			protocol = PROTOCOL_V1;
+		else if (!strcmp(argv[i], "--line-flush"))
+			line_flush = true;
+		else if (!strcmp(argv[i], "--shm"))
+			transport = TRANSPORT_SHM;
+		else if (!strcmp(argv[i], "--reconnect"))
+			keep_connected = true;
+		else
+			ABORT(1, USAGE);
+	}
+	init_output(&output, STDOUT_FILENO, line_flush);
 
-	// disable Neagle algorithm
-	errors = setsockopt(server_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
-	ABORT(errors == -1, "Server socket: SET SOCKET OPTIONS error");
+	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
 	// parse command line arguments and create connection configuration
 	ABORT(strlen(argv[1]) > 10, "Invalid ID\n");
-	strcpy(id, argv[1]);
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_port = atoi(argv[3]);
 	ABORT((atoi(argv[3]) > 65535) || (atoi(argv[3]) < 0), "Invalid port number\n");
@@ -52,65 +72,114 @@ int main(int argc, char **argv) {
 	ABORT(errors < 0, "Invalid IP address\n");
 
 	// create connection and send subscriber ID to server
-	errors = connect(server_socket, (struct sockaddr*) &serv_addr, sizeof(serv_addr));
+	errors = client_connect(&client, argv[1], &serv_addr, protocol, transport);
 	ABORT(errors < 0, "Connection to server failed.\n");
-	create_id_msg(id, &msg);
-	send_msg(server_socket, &msg);
-	ABORT(errors < 0, "Server HANDSHAKE error.\n");
 
-	struct pollfd descriptors[2];
+	struct pollfd descriptors[3];
 	descriptors[0].fd = STDIN_FILENO; descriptors[0].events = POLLIN;
-	descriptors[1].fd = server_socket; descriptors[1].events = POLLIN;
+	descriptors[1].fd = client.socket;
+	descriptors[2].events = POLLIN;
 
 	// start listening for incoming data from stdin or server
-	memset(&received_msg, 0, sizeof(received_msg));
 	while (1) {
-		errors = poll(descriptors, 2, -1);
+		descriptors[1].events = client_events(&client);
+		// the shared memory ring of the server, if it was granted
+		descriptors[2].fd = client_wake_fd(&client);
+		errors = poll(descriptors, 3, -1);
 		ABORT(errors == -1, "Polling errors: failed stdin or server communication.\n");
 
-		if (descriptors[0].revents & POLLIN) { // stdin commands case
+		if (descriptors[0].revents & (POLLIN | POLLHUP)) { // stdin commands case
 			descriptors[0].revents = 0;
-			fgets(buffer, 70, stdin);
+			if (fgets(buffer, sizeof(buffer), stdin) == NULL) { // no more commands, only receive messages
+				descriptors[0].fd = -1;
+				continue;
+			}
 			/*
 			 * Parse the command and perform subscriber actions as required.
 			 * Print problem message on invalid command.
 			 */
-			buffer[strlen(buffer) - 1] = '\0';
+			buffer[strcspn(buffer, "\n")] = '\0';
 			token = strtok(buffer, " ");
-			strcpy(command, token);
+			if (token == NULL) // empty line
+				continue;
+			snprintf(command, sizeof(command), "%s", token);
 			if (!strcmp(command, "exit")) { // disconnect and stop subscriber
-				close(server_socket);
+				client_close(&client);
 				exit(0);
 			} else {
+				// every command has an argument, which fits a topic
 				token = strtok(NULL, " ");
-				WARNING(token == NULL, "Invalid command. Try 'subscribe <TOPIC> <SF>' or 'unsubscribe <TOPIC>'.\n");
-				strcpy(topic, token);
+				if (token == NULL || strlen(token) > TOPIC_SIZE) {
+					WARNING(1, "Invalid command. Try 'subscribe <TOPIC> <SF> [conflate] [where <FILTER>]' or 'unsubscribe <TOPIC>'.\n");
+					continue;
+				}
+				snprintf(topic, sizeof(topic), "%s", token);
 				if (!strcmp(command, "subscribe")) { // subscribe to topic
 					token = strtok(NULL, " ");
+					if (token == NULL) {
+						WARNING(1, "Invalid SF option\n");
+						continue;
+					}
 					SF = atoi(token);
 					ABORT(SF != 0 && SF != 1, "Invalid SF option\n");
-					create_subscribe_msg(SF, id, topic, &msg);
-					send_msg(server_socket, &msg);
-					printf("Subscribed to topic.\n");
+					// only the newest message of a topic is kept while the subscriber is behind
+					token = strtok(NULL, "");
+					options = 0;
+					if (token != NULL && !strncmp(token, "conflate", 8)) {
+						options = SUBSCRIBE_CONFLATE;
+						token += strspn(token + 8, " ") + 8;
+					}
+					// the server only sends the messages selected by "where <TYPE> <OP> <VALUE>..."
+					filter = token != NULL && !strncmp(token, "where ", 6) ? token + 6 : NULL;
+					if (client_subscribe(&client, topic, SF, options, filter) < 0)
+						printf("Invalid topic or filter. Try e.g. 'where INT > 10' or 'where FLOAT outside -1.5 1.5'.\n");
+					else
+						printf("Subscribed to topic.\n");
+				} else if (!strcmp(command, "mode")) { // lowest latency or highest throughput
+					if (strcmp(topic, "latency") && strcmp(topic, "throughput")) {
+						WARNING(1, "Invalid mode. Try 'mode latency' or 'mode throughput'.\n");
+						continue;
+					}
+					client_set_mode(&client, strcmp(topic, "throughput") ? OUTPUT_LATENCY : OUTPUT_THROUGHPUT);
+					printf("Output mode changed.\n");
 				} else if (!strcmp(command, "unsubscribe")) { // unsubscribe from topic
-					create_unsubscribe_msg(id, topic, &msg);
-					send_msg(server_socket, &msg);      
-					printf("Unsubscribed from topic.\n");              
+					client_unsubscribe(&client, topic);
+					printf("Unsubscribed from topic.\n");
 				} else {
 					WARNING(1, "Invalid command. Try exit, subscribe or unsubscribe.\n")
 				}
 			}
-		} else { // receive message from server case
-			message_result = receive_msg(server_socket, &received_msg, topics_table, clients_table, unsent_table);
-			// If the server is disconnected, close the subscriber.
-			if (message_result == SOCKET_CLOSED) {
-				close(server_socket);
+		} else if (descriptors[1].revents & POLLOUT) { // the pending requests can be written
+			if (client_flush(&client) == QUEUE_ERROR) {
+				ABORT(!keep_connected, "Connection to server failed.\n");
+				reconnect(&client, &serv_addr);
+				descriptors[1].fd = client.socket;
+			}
+		} else if (descriptors[1].revents || descriptors[2].revents) { // receive messages from server case
+			// print every complete message, keep a partial one for the next read
+			received = client_drain(&client, print_message, &output);
+
+			// everything decoded from this read is written at once
+			flush_output(&output);
+
+			// the messages lost with a previous connection, if the server could not send them again
+			if (client.lost > reported_lost) {
+				printf("%llu messages lost while reconnecting.\n", (unsigned long long) (client.lost - reported_lost));
+				reported_lost = client.lost;
+			}
+
+			// If the server is disconnected, close the subscriber (or connect again, with --reconnect).
+			if (received == CLIENT_CLOSED && keep_connected) {
+				reconnect(&client, &serv_addr);
+				descriptors[1].fd = client.socket;
+			} else if (received == CLIENT_CLOSED) {
+				client_close(&client);
 				exit(0);
 			}
+			ABORT(received == CLIENT_INVALID, "Invalid message received from server.\n");
 		}
 
 	}
 
 	return 0;
 }
-
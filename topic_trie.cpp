@@ -0,0 +1,290 @@
+#include <algorithm>
+#include "topic_trie.h"
+
+// helper, split a topic (or a pattern) in levels
+static void split_levels(string_view name, vector <string_view> &levels) {
+	size_t start = 0, end;
+
+	while ((end = name.find(TOPIC_SEPARATOR, start)) != string_view::npos) {
+		levels.push_back(name.substr(start, end - start));
+		start = end + 1;
+	}
+	levels.push_back(name.substr(start));
+}
+
+// helper, check if the levels of a pattern, from i, match the levels of a topic, from j
+static bool match_levels(vector <string_view> &pattern, size_t i, vector <string_view> &topic, size_t j) {
+	size_t k;
+
+	if (i == pattern.size())
+		return j == topic.size();
+	if (pattern[i] == WILDCARD_LEVELS) {
+		for (k = j; k <= topic.size(); k++) {
+			if (match_levels(pattern, i + 1, topic, k))
+				return true;
+		}
+		return false;
+	}
+	if (j == topic.size() || (pattern[i] != WILDCARD_LEVEL && pattern[i] != topic[j]))
+		return false;
+	return match_levels(pattern, i + 1, topic, j + 1);
+}
+
+// helper, collect the subscriptions of the patterns under a node that match the topic levels from depth
+static void match_node(struct trie_node *node, vector <string_view> &levels, size_t depth,
+					vector <struct subscription> &matches) {
+	unordered_map <string, struct trie_node *>::iterator child;
+	size_t k;
+
+	if (depth == levels.size()) {
+		matches.insert(matches.end(), node->subscriptions.begin(), node->subscriptions.end());
+	} else {
+		if ((child = node->children.find(string(levels[depth]))) != node->children.end())
+			match_node((*child).second, levels, depth + 1, matches);
+		if ((child = node->children.find(WILDCARD_LEVEL)) != node->children.end())
+			match_node((*child).second, levels, depth + 1, matches);
+	}
+
+	// a multi-level wildcard may also match no level at all
+	if ((child = node->children.find(WILDCARD_LEVELS)) != node->children.end()) {
+		for (k = depth; k <= levels.size(); k++)
+			match_node((*child).second, levels, k, matches);
+	}
+}
+
+// helper, collect the subscriptions of the patterns under a node, at depth, whose levels so far are in prefix
+static void list_node(struct trie_node *node, size_t depth, string &prefix, vector <string> &patterns,
+					vector <struct subscription> &subscriptions) {
+	unordered_map <string, struct trie_node *>::iterator child;
+	size_t i, length = prefix.size();
+
+	for (i = 0; i < node->subscriptions.size(); i++) {
+		patterns.push_back(prefix);
+		subscriptions.push_back(node->subscriptions[i]);
+	}
+	for (child = node->children.begin(); child != node->children.end(); child++) {
+		if (depth > 0)
+			prefix += TOPIC_SEPARATOR;
+		prefix += (*child).first;
+		list_node((*child).second, depth + 1, prefix, patterns, subscriptions);
+		prefix.resize(length);
+	}
+}
+
+/**
+	@brief Function that checks if a topic name is a pattern, i.e. if one of
+		   its levels is a wildcard.
+
+	@param name The topic name.
+**/
+bool is_pattern(string_view name) {
+	vector <string_view> levels;
+	size_t i;
+
+	split_levels(name, levels);
+	for (i = 0; i < levels.size(); i++) {
+		if (levels[i] == WILDCARD_LEVEL || levels[i] == WILDCARD_LEVELS)
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Function that checks if a pattern matches a topic.
+
+	@param pattern The pattern.
+	@param topic The (concrete) topic.
+**/
+bool pattern_matches(string_view pattern, string_view topic) {
+	vector <string_view> pattern_levels, topic_levels;
+
+	split_levels(pattern, pattern_levels);
+	split_levels(topic, topic_levels);
+	return match_levels(pattern_levels, 0, topic_levels, 0);
+}
+
+/**
+	@brief Function that adds a wildcard subscription to the trie. Subscribing
+		   again to the same pattern only changes its options.
+
+	@param trie The trie of the broker.
+	@param pattern The subscribed pattern.
+	@param subscriber Handle of the subscriber.
+	@param fs True if store-and-forward is enabled.
+	@param conflate True if waiting messages are replaced by newer ones of the same topic.
+	@param filter Filter of the messages sent to the subscriber.
+
+	@return bool True if the subscription is new.
+**/
+bool add_pattern(struct topic_trie *trie, string_view pattern, u_int32_t subscriber, bool fs, bool conflate,
+				const struct content_filter *filter) {
+	struct trie_node *node = &trie->root;
+	vector <string_view> levels;
+	vector <struct subscription>::iterator iter;
+	size_t i;
+
+	split_levels(pattern, levels);
+	for (i = 0; i < levels.size(); i++) {
+		struct trie_node *&next = node->children[string(levels[i])];
+
+		if (next == NULL)
+			next = new struct trie_node();
+		node = next;
+	}
+
+	for (iter = node->subscriptions.begin(); iter != node->subscriptions.end(); iter++) {
+		if ((*iter).subscriber == subscriber) {
+			(*iter).fs = fs;
+			(*iter).conflate = conflate;
+			(*iter).filter = *filter;
+			return false;
+		}
+	}
+	node->subscriptions.push_back(subscription());
+	node->subscriptions.back().subscriber = subscriber;
+	node->subscriptions.back().fs = fs;
+	node->subscriptions.back().conflate = conflate;
+	node->subscriptions.back().filter = *filter;
+	trie->nr_patterns++;
+	return true;
+}
+
+/**
+	@brief Function that finds the wildcard subscription of a subscriber to
+		   a pattern.
+
+	@param trie The trie of the broker.
+	@param pattern The pattern.
+	@param subscriber Handle of the subscriber.
+
+	@return struct subscription* The subscription, NULL if there is none.
+**/
+struct subscription *find_pattern(struct topic_trie *trie, string_view pattern, u_int32_t subscriber) {
+	unordered_map <string, struct trie_node *>::iterator child;
+	struct trie_node *node = &trie->root;
+	vector <string_view> levels;
+	size_t i;
+
+	split_levels(pattern, levels);
+	for (i = 0; i < levels.size(); i++) {
+		if ((child = node->children.find(string(levels[i]))) == node->children.end())
+			return NULL;
+		node = (*child).second;
+	}
+	for (i = 0; i < node->subscriptions.size(); i++) {
+		if (node->subscriptions[i].subscriber == subscriber)
+			return &node->subscriptions[i];
+	}
+	return NULL;
+}
+
+/**
+	@brief Function that removes a wildcard subscription from the trie. The
+		   nodes left without patterns are freed.
+
+	@param trie The trie of the broker.
+	@param pattern The unsubscribed pattern.
+	@param subscriber Handle of the subscriber.
+
+	@return bool True if the subscription existed.
+**/
+bool remove_pattern(struct topic_trie *trie, string_view pattern, u_int32_t subscriber) {
+	vector <struct trie_node *> path(1, &trie->root);
+	unordered_map <string, struct trie_node *>::iterator child;
+	vector <struct subscription>::iterator iter;
+	vector <string_view> levels;
+	size_t i;
+
+	split_levels(pattern, levels);
+	for (i = 0; i < levels.size(); i++) {
+		if ((child = path.back()->children.find(string(levels[i]))) == path.back()->children.end())
+			return false;
+		path.push_back((*child).second);
+	}
+
+	vector <struct subscription> &subscriptions = path.back()->subscriptions;
+	for (iter = subscriptions.begin(); iter != subscriptions.end(); iter++) {
+		if ((*iter).subscriber == subscriber)
+			break;
+	}
+	if (iter == subscriptions.end())
+		return false;
+	*iter = subscriptions.back();
+	subscriptions.pop_back();
+	trie->nr_patterns--;
+
+	// free the empty nodes, from the deepest one
+	for (i = levels.size(); i > 0; i--) {
+		struct trie_node *node = path[i];
+
+		if (!node->subscriptions.empty() || !node->children.empty())
+			break;
+		path[i - 1]->children.erase(string(levels[i - 1]));
+		delete node;
+	}
+	return true;
+}
+
+/**
+	@brief Function that collects the wildcard subscriptions matching a topic.
+		   A subscriber may be found several times, if several of its patterns
+		   match the topic.
+
+	@param trie The trie of the broker.
+	@param topic The (concrete) topic.
+	@param matches Vector where the subscriptions are appended.
+**/
+void match_topic(struct topic_trie *trie, string_view topic, vector <struct subscription> &matches) {
+	vector <string_view> levels;
+
+	if (trie->nr_patterns == 0)
+		return;
+	split_levels(topic, levels);
+	match_node(&trie->root, levels, 0, matches);
+}
+
+/**
+	@brief Function that lists every wildcard subscription of the trie, with
+		   its pattern.
+
+	@param trie The trie of the broker.
+	@param patterns Vector where the patterns are appended.
+	@param subscriptions Vector where the subscriptions are appended (in the
+						 order of the patterns).
+**/
+void list_patterns(struct topic_trie *trie, vector <string> &patterns, vector <struct subscription> &subscriptions) {
+	string prefix;
+
+	list_node(&trie->root, 0, prefix, patterns, subscriptions);
+}
+
+// helper, order subscriptions by subscriber
+static bool by_subscriber(const struct subscription &first, const struct subscription &second) {
+	return first.subscriber < second.subscriber;
+}
+
+/**
+	@brief Function that keeps a single subscription for every subscriber,
+		   with store-and-forward enabled if any of its subscriptions has it and
+		   conflation only if all of them ask for it. Different filters are
+		   dropped, so the subscriber gets every message of the topic.
+
+	@param subscriptions The subscriptions matching a topic.
+**/
+void merge_subscriptions(vector <struct subscription> &subscriptions) {
+	size_t i, kept = 0;
+
+	if (subscriptions.size() < 2)
+		return;
+	sort(subscriptions.begin(), subscriptions.end(), by_subscriber);
+	for (i = 1; i < subscriptions.size(); i++) {
+		if (subscriptions[i].subscriber == subscriptions[kept].subscriber) {
+			subscriptions[kept].fs = subscriptions[kept].fs || subscriptions[i].fs;
+			subscriptions[kept].conflate = subscriptions[kept].conflate && subscriptions[i].conflate;
+			if (!same_filter(&subscriptions[kept].filter, &subscriptions[i].filter))
+				subscriptions[kept].filter.data_type = NO_DATA_TYPE;
+		} else
+			subscriptions[++kept] = subscriptions[i];
+	}
+	subscriptions.resize(kept + 1);
+}
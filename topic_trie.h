@@ -0,0 +1,50 @@
+#ifndef _TOPIC_TRIE_H
+#define _TOPIC_TRIE_H
+
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "content_filter.h"
+
+using namespace std;
+
+#define TOPIC_SEPARATOR '/'
+#define WILDCARD_LEVEL "+"	// matches exactly one level
+#define WILDCARD_LEVELS "*"	// matches any number of levels, none included
+
+// subscription of a topic (or of a wildcard pattern)
+struct subscription {
+	u_int32_t subscriber;	// handle of the subscriber
+	bool fs;
+	bool conflate;		// only the newest waiting message of a topic is kept
+	struct content_filter filter;	// messages that do not match it are not sent
+};
+
+// node of the trie, for one level of the patterns
+struct trie_node {
+	unordered_map <string, struct trie_node *> children;
+	vector <struct subscription> subscriptions;	// of the patterns that end here
+};
+
+/*
+ * Wildcard subscriptions of a broker, stored level by level, so the
+ * subscriptions matching a topic are found in a single walk of the trie.
+ */
+struct topic_trie {
+	struct trie_node root;
+	size_t nr_patterns;	// number of wildcard subscriptions
+};
+
+bool is_pattern(string_view name);
+bool pattern_matches(string_view pattern, string_view topic);
+bool add_pattern(struct topic_trie *trie, string_view pattern, u_int32_t subscriber, bool fs, bool conflate,
+				const struct content_filter *filter);
+struct subscription *find_pattern(struct topic_trie *trie, string_view pattern, u_int32_t subscriber);
+bool remove_pattern(struct topic_trie *trie, string_view pattern, u_int32_t subscriber);
+void match_topic(struct topic_trie *trie, string_view topic, vector <struct subscription> &matches);
+void list_patterns(struct topic_trie *trie, vector <string> &patterns, vector <struct subscription> &subscriptions);
+void merge_subscriptions(vector <struct subscription> &subscriptions);
+
+#endif
@@ -0,0 +1,154 @@
+#include <string.h>
+#include <errno.h>
+#include "udp_ingest.h"
+#include "event_loop.h"
+#include "uring.h"
+
+/**
+	@brief Function that links the message headers of a batch to its buffers.
+
+	@param batch The batch to be initialized.
+**/
+void init_udp_batch(struct udp_batch *batch) {
+	int i;
+
+	memset(batch->headers, 0, sizeof(batch->headers));
+	for (i = 0; i < UDP_BATCH; i++) {
+		batch->iov[i].iov_base = batch->buffers[i];
+		batch->iov[i].iov_len = BUFLEN;
+		batch->headers[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->headers[i].msg_hdr.msg_iovlen = 1;
+		batch->headers[i].msg_hdr.msg_name = &batch->addrs[i];
+	}
+}
+
+/**
+	@brief Function that receives up to UDP_BATCH datagrams with one recvmmsg() call.
+
+	@param socket The (non-blocking) UDP socket.
+	@param batch The batch where the datagrams are stored.
+
+	@return int Number of datagrams received, 0 if there were none.
+**/
+int receive_udp_batch(int socket, struct udp_batch *batch) {
+	int i, nr_received;
+
+	// the address length is overwritten by every call
+	for (i = 0; i < UDP_BATCH; i++)
+		batch->headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+	do {
+		nr_received = recvmmsg(socket, batch->headers, UDP_BATCH, MSG_DONTWAIT, NULL);
+	} while (nr_received == -1 && errno == EINTR);
+
+	if (nr_received == -1) {
+		ABORT(errno != EAGAIN && errno != EWOULDBLOCK, "UDP socket: RECEIVE error\n");
+		return 0;
+	}
+
+	return nr_received;
+}
+
+/**
+	@brief Function that drains the UDP socket of a shard batch by batch. All
+		   the messages of a batch are routed first, then every subscriber that
+		   got messages is flushed once, so the whole batch leaves in a single
+		   write, and every other shard that got messages is woken once.
+
+	@param set The shards of the broker.
+	@param self Index of the shard that owns the (non-blocking, edge-triggered) socket.
+
+	@return int Number of datagrams received.
+**/
+int ingest_udp(struct shard_set *set, int self) {
+	struct shard *shard = &set->shards[self];
+	struct udp_batch *batch = shard->UDP_batch;
+	int i, nr_received, total = 0;
+
+	do {
+		nr_received = receive_udp_batch(shard->socket_UDP, batch);
+		if (nr_received > 0) {
+			shard->broker.receive_time = monotonic_ns();
+			count_stat(&shard->broker.stats, STAT_UDP_BATCHES, 1);
+			count_stat(&shard->broker.stats, STAT_UDP_DATAGRAMS, nr_received);
+		}
+		for (i = 0; i < nr_received; i++) {
+			count_stat(&shard->broker.stats, STAT_UDP_BYTES, batch->headers[i].msg_len);
+			route_message(set, self, batch->buffers[i], batch->headers[i].msg_len, batch->addrs[i]);
+		}
+		flush_dirty_subscribers(&shard->broker);
+		wake_shards(set, self);
+		total += nr_received;
+		/*
+		 * a short batch means the socket was emptied; datagrams arriving
+		 * later trigger a new edge
+		 */
+	} while (nr_received == UDP_BATCH);
+
+	return total;
+}
+
+/**
+	@brief Function that handles the completions of the io_uring of a shard:
+		   the datagrams of its multishot UDP receive, which are routed in
+		   batches of up to UDP_BATCH as by ingest_udp(), and the writes to
+		   its subscribers. If the kernel cannot receive in multishot mode,
+		   the UDP socket falls back to recvmmsg() on the event loop.
+
+	@param set The shards of the broker.
+	@param self Index of the shard that owns the io_uring.
+
+	@return int Number of datagrams received.
+**/
+int ingest_uring(struct shard_set *set, int self) {
+	struct shard *shard = &set->shards[self];
+	struct broker *broker = &shard->broker;
+	struct uring *ring = broker->ring;
+	struct io_uring_cqe cqe;
+	struct sockaddr_in addr;
+	char *datagram;
+	int length, nr_received, total = 0;
+	bool more = true;
+
+	while (more) {
+		nr_received = 0;
+		while (nr_received < UDP_BATCH && (more = next_cqe(ring, &cqe))) {
+			if (cqe.user_data != URING_RECV_TAG) {
+				complete_send(broker, (struct uring_send *) cqe.user_data, cqe.res);
+				continue;
+			}
+
+			// the kernel ended the receive (out of buffers or an error); it is armed again below
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				ring->receiving = false;
+			if (cqe.res == -EINVAL && total == 0 && nr_received == 0) {
+				WARNING(1, "io_uring: multishot receive not supported, using recvmmsg\n");
+				ring->socket_UDP = -1;
+				watch_fd(broker->epoll_fd, shard->socket_UDP, EPOLLIN | EPOLLET);
+				ingest_udp(set, self);
+				continue;
+			}
+			if (cqe.res < 0) {
+				WARNING(cqe.res != -ENOBUFS, "UDP socket: RECEIVE error\n");
+				continue;
+			}
+
+			if (nr_received == 0) {
+				broker->receive_time = monotonic_ns();
+				count_stat(&broker->stats, STAT_UDP_BATCHES, 1);
+			}
+			datagram = recv_datagram(ring, &cqe, &length, &addr);
+			count_stat(&broker->stats, STAT_UDP_DATAGRAMS, 1);
+			count_stat(&broker->stats, STAT_UDP_BYTES, length);
+			route_message(set, self, datagram, length, addr);
+			recycle_recv_buffer(ring, &cqe);
+			nr_received++;
+		}
+		flush_dirty_subscribers(broker);
+		wake_shards(set, self);
+		total += nr_received;
+	}
+
+	arm_udp_receive(ring);
+	return total;
+}
@@ -0,0 +1,28 @@
+#ifndef _UDP_INGEST_H
+#define _UDP_INGEST_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "custom_TCP.h"
+#include "shards.h"
+
+#define UDP_BATCH 64
+
+/*
+ * Preallocated buffers for a batch of datagrams. Every recvmmsg() call fills
+ * them from the beginning, so no memory is allocated or cleared per message.
+ */
+struct udp_batch {
+	struct mmsghdr headers[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct sockaddr_in addrs[UDP_BATCH];
+	char buffers[UDP_BATCH][BUFLEN];
+};
+
+void init_udp_batch(struct udp_batch *batch);
+int receive_udp_batch(int socket, struct udp_batch *batch);
+int ingest_udp(struct shard_set *set, int self);
+int ingest_uring(struct shard_set *set, int self);
+
+#endif
@@ -0,0 +1,366 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+#include "custom_TCP.h"
+
+// helper, io_uring_setup(2) (there is no wrapper in libc)
+static int uring_setup(u_int32_t entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+// helper, io_uring_enter(2)
+static int uring_enter(int fd, u_int32_t to_submit, u_int32_t flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+// helper, io_uring_register(2)
+static int uring_register(int fd, u_int32_t opcode, void *arg, u_int32_t nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// helper, unmap the rings and buffers of a partially created instance, then free it
+static void free_uring(struct uring *ring) {
+	if (ring->fd != -1)
+		close(ring->fd);
+	if (ring->recv_buffers != MAP_FAILED)
+		munmap(ring->recv_buffers, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+	if (ring->buf_ring != MAP_FAILED)
+		munmap(ring->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	while (!ring->free_sends.empty()) {
+		delete ring->free_sends.back();
+		ring->free_sends.pop_back();
+	}
+	delete ring;
+}
+
+// helper, map the submission and completion rings of a new instance
+static bool map_rings(struct uring *ring, struct io_uring_params *params) {
+	char *sq, *cq;
+	u_int32_t i, *array;
+
+	ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(u_int32_t);
+	ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return false;
+	if (params->features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+							ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		return false;
+	ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+											MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return false;
+
+	sq = (char *) ring->sq_ring;
+	ring->sq_head = (u_int32_t *) (sq + params->sq_off.head);
+	ring->sq_tail = (u_int32_t *) (sq + params->sq_off.tail);
+	ring->sq_flags = (u_int32_t *) (sq + params->sq_off.flags);
+	ring->sq_mask = *(u_int32_t *) (sq + params->sq_off.ring_mask);
+	ring->sq_entries = params->sq_entries;
+	ring->sq_prepared = *ring->sq_tail;
+
+	// entry i of the submission queue always uses sqes[i]
+	array = (u_int32_t *) (sq + params->sq_off.array);
+	for (i = 0; i < params->sq_entries; i++)
+		array[i] = i;
+
+	cq = (char *) ring->cq_ring;
+	ring->cq_head = (u_int32_t *) (cq + params->cq_off.head);
+	ring->cq_tail = (u_int32_t *) (cq + params->cq_off.tail);
+	ring->cq_mask = *(u_int32_t *) (cq + params->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+
+	return true;
+}
+
+// helper, give a receive buffer (back) to the kernel
+static void provide_buffer(struct uring *ring, u_int16_t bid) {
+	u_int16_t tail = ring->buf_ring->tail;
+	// not ring->buf_ring->bufs: in C++ the empty struct before that flexible array takes a byte
+	struct io_uring_buf *buf = (struct io_uring_buf *) ring->buf_ring + (tail & (URING_RECV_BUFFERS - 1));
+
+	buf->addr = (u_int64_t) (ring->recv_buffers + (size_t) bid * URING_RECV_BUFFER_SIZE);
+	buf->len = URING_RECV_BUFFER_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&ring->buf_ring->tail, (u_int16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+// helper, register the ring of buffers the UDP receive picks from
+static bool register_recv_buffers(struct uring *ring) {
+	struct io_uring_buf_reg reg;
+	int i;
+
+	ring->buf_ring = (struct io_uring_buf_ring *) mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf),
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED)
+		return false;
+	ring->recv_buffers = (char *) mmap(NULL, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->recv_buffers == MAP_FAILED)
+		return false;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u_int64_t) ring->buf_ring;
+	reg.ring_entries = URING_RECV_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return false;
+
+	ring->buf_ring->tail = 0;
+	for (i = 0; i < URING_RECV_BUFFERS; i++)
+		provide_buffer(ring, i);
+	return true;
+}
+
+/**
+	@brief Function that creates the io_uring instance of a shard and registers
+		   the buffers of its UDP receive. The caller falls back to epoll if
+		   the kernel lacks any of the required features.
+
+	@param socket_UDP The (non-blocking) UDP socket of the shard.
+
+	@return struct uring* The instance, NULL if io_uring is not available.
+**/
+struct uring *create_uring(int socket_UDP) {
+	struct uring *ring = new struct uring;
+	struct io_uring_params params;
+
+	ring->sq_ring = ring->cq_ring = MAP_FAILED;
+	ring->sqes = (struct io_uring_sqe *) MAP_FAILED;
+	ring->buf_ring = (struct io_uring_buf_ring *) MAP_FAILED;
+	ring->recv_buffers = (char *) MAP_FAILED;
+	ring->socket_UDP = socket_UDP;
+	ring->receiving = false;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ring->fd = uring_setup(URING_ENTRIES, &params);
+
+	/*
+	 * writes to a full socket must wait inside the kernel (fast poll) and
+	 * completions must never be dropped when the completion queue is full
+	 */
+	if (ring->fd == -1 || !(params.features & IORING_FEAT_FAST_POLL) || !(params.features & IORING_FEAT_NODROP)
+			|| !map_rings(ring, &params) || !register_recv_buffers(ring)) {
+		free_uring(ring);
+		return NULL;
+	}
+
+	// datagrams are laid out as io_uring_recvmsg_out, the sender address and the payload
+	memset(&ring->recv_template, 0, sizeof(ring->recv_template));
+	ring->recv_template.msg_namelen = sizeof(struct sockaddr_in);
+
+	return ring;
+}
+
+/**
+	@brief Function that destroys an io_uring instance. The kernel cancels
+		   the requests still in flight.
+
+	@param ring The instance.
+**/
+void close_uring(struct uring *ring) {
+	close(ring->fd);
+	ring->fd = -1;
+	free_uring(ring);
+}
+
+// helper, next free submission entry (the queue is submitted first if it is full)
+static struct io_uring_sqe *get_sqe(struct uring *ring) {
+	struct io_uring_sqe *sqe;
+
+	if (ring->sq_prepared - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+		submit_uring(ring);
+	ABORT(ring->sq_prepared - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries,
+		"io_uring: submission queue full\n");
+
+	sqe = &ring->sqes[ring->sq_prepared & ring->sq_mask];
+	ring->sq_prepared++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/**
+	@brief Function that arms the multishot receive of the UDP socket: one
+		   request that completes once for every datagram, in a buffer picked
+		   by the kernel from the provided ones. It is armed again when the
+		   kernel ends it (e.g. because it ran out of buffers).
+
+	@param ring The instance.
+**/
+void arm_udp_receive(struct uring *ring) {
+	struct io_uring_sqe *sqe;
+
+	if (ring->socket_UDP == -1 || ring->receiving)
+		return;
+
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ring->socket_UDP;
+	sqe->addr = (u_int64_t) &ring->recv_template;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = URING_RECV_TAG;
+	ring->receiving = true;
+}
+
+/**
+	@brief Function that finds the datagram of a receive completion in its
+		   buffer (the datagram stays valid until the buffer is recycled).
+
+	@param ring The instance.
+	@param cqe The completion (with a buffer).
+	@param length Where the length of the datagram is stored.
+	@param addr Where the address of the sender is stored.
+
+	@return char* The datagram.
+**/
+char *recv_datagram(struct uring *ring, struct io_uring_cqe *cqe, int *length, struct sockaddr_in *addr) {
+	char *buffer = ring->recv_buffers + (size_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_RECV_BUFFER_SIZE;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buffer;
+
+	memset(addr, 0, sizeof(*addr));
+	memcpy(addr, buffer + sizeof(*out), min((size_t) out->namelen, sizeof(*addr)));
+
+	// longer datagrams are truncated, as by recvmmsg()
+	*length = min(out->payloadlen, (u_int32_t) BUFLEN);
+	return buffer + sizeof(*out) + ring->recv_template.msg_namelen + ring->recv_template.msg_controllen;
+}
+
+/**
+	@brief Function that gives the buffer of a receive completion back to the kernel.
+
+	@param ring The instance.
+	@param cqe The completion.
+**/
+void recycle_recv_buffer(struct uring *ring, struct io_uring_cqe *cqe) {
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		provide_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+/**
+	@brief Function that prepares one write of up to MAX_IOV frames from the
+		   front of a send queue. The frames stay in the queue until the write
+		   completes; the write takes its own references to them.
+
+	@param ring The instance.
+	@param socket The socket of the subscriber.
+	@param queue The send queue (not empty).
+
+	@return struct uring_send* The write, whose address is its user_data.
+**/
+struct uring_send *send_queue(struct uring *ring, int socket, struct out_queue *queue) {
+	struct uring_send *send;
+	struct io_uring_sqe *sqe;
+	deque<struct msg_buf *>::iterator iter;
+	int i;
+
+	if (ring->free_sends.empty()) {
+		send = new struct uring_send;
+	} else {
+		send = ring->free_sends.back();
+		ring->free_sends.pop_back();
+	}
+
+	send->nr_frames = gather_queue(queue, send->iov);
+	for (i = 0, iter = queue->frames.begin(); i < send->nr_frames; i++, iter++)
+		send->frames[i] = hold_msg(*iter);
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_iov = send->iov;
+	send->msg.msg_iovlen = send->nr_frames;
+
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = socket;
+	sqe->addr = (u_int64_t) &send->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (u_int64_t) send;
+
+	return send;
+}
+
+/**
+	@brief Function that drops the frames of a completed write and keeps it for reuse.
+
+	@param ring The instance.
+	@param send The write.
+**/
+void release_send(struct uring *ring, struct uring_send *send) {
+	int i;
+
+	for (i = 0; i < send->nr_frames; i++)
+		release_msg(send->frames[i]);
+	send->nr_frames = 0;
+	ring->free_sends.push_back(send);
+}
+
+/**
+	@brief Function that submits every prepared entry with one system call,
+		   so the writes of a whole batch of messages cost a single enter.
+
+	@param ring The instance.
+**/
+void submit_uring(struct uring *ring) {
+	u_int32_t to_submit;
+	int ret;
+
+	to_submit = ring->sq_prepared - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0)
+		return;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_prepared, __ATOMIC_RELEASE);
+	do {
+		ret = uring_enter(ring->fd, to_submit, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	// entries refused while completions overflow are submitted next time
+	ABORT(ret == -1 && errno != EAGAIN && errno != EBUSY, "io_uring: SUBMIT error\n");
+}
+
+/**
+	@brief Function that takes the next completion of an instance.
+
+	@param ring The instance.
+	@param cqe Where the completion is copied.
+
+	@return bool False if there are no completions.
+**/
+bool next_cqe(struct uring *ring, struct io_uring_cqe *cqe) {
+	u_int32_t head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		// completions that did not fit the queue are kept by the kernel until asked for
+		if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+			return false;
+		uring_enter(ring->fd, 0, IORING_ENTER_GETEVENTS);
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			return false;
+	}
+
+	*cqe = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
@@ -0,0 +1,71 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <vector>
+#include "out_queue.h"
+
+using namespace std;
+
+#define URING_ENTRIES 1024			// submission queue
+#define URING_CQ_ENTRIES 8192		// completion queue
+#define URING_RECV_BUFFERS 1024		// provided to the UDP receive (a power of two)
+#define URING_RECV_BUFFER_SIZE 2048	// recvmsg header, address and datagram
+#define URING_BUFFER_GROUP 0
+
+// user_data of the UDP receive; writes carry the address of their uring_send
+#define URING_RECV_TAG 1
+
+struct subscriber;
+
+/*
+ * A write in flight on a subscriber socket. It holds its own reference to
+ * every frame it sends, so the send queue may be cleared (the subscriber
+ * disconnected) before the kernel is done with them.
+ */
+struct uring_send {
+	struct subscriber *subscriber;	// NULL once the subscriber is disconnected
+	int nr_frames;
+	struct msg_buf *frames[MAX_IOV];
+	struct iovec iov[MAX_IOV];
+	struct msghdr msg;
+};
+
+/*
+ * io_uring instance of a shard: the rings shared with the kernel, the
+ * multishot receive of the UDP socket with its provided buffers, and the
+ * writes to subscriber sockets. Prepared entries are submitted together at
+ * the end of every event loop iteration.
+ */
+struct uring {
+	int fd;
+	u_int32_t *sq_head, *sq_tail, *sq_flags, sq_mask, sq_entries;
+	u_int32_t sq_prepared;	// tail including the entries not submitted yet
+	struct io_uring_sqe *sqes;
+	u_int32_t *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	int socket_UDP;		// -1 if the UDP socket is read with recvmmsg()
+	bool receiving;		// the multishot receive is armed
+	struct msghdr recv_template;
+	struct io_uring_buf_ring *buf_ring;
+	char *recv_buffers;
+	vector <struct uring_send *> free_sends;
+};
+
+struct uring *create_uring(int socket_UDP);
+void close_uring(struct uring *ring);
+void arm_udp_receive(struct uring *ring);
+char *recv_datagram(struct uring *ring, struct io_uring_cqe *cqe, int *length, struct sockaddr_in *addr);
+void recycle_recv_buffer(struct uring *ring, struct io_uring_cqe *cqe);
+struct uring_send *send_queue(struct uring *ring, int socket, struct out_queue *queue);
+void release_send(struct uring *ring, struct uring_send *send);
+void submit_uring(struct uring *ring);
+bool next_cqe(struct uring *ring, struct io_uring_cqe *cqe);
+
+#endif